@@ -0,0 +1,9453 @@
+/*
+  spill - segregated package install logical linker
+
+ **********************************************************************
+ * Copyright (C) Richard P. Curnow  2003, 2004, 2005, 2006, 2009
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ *
+ **********************************************************************
+ */
+
+/*
+ * Naming :
+ * "source" means the directory tree where the package is actually installed.
+ * "destination" means the directory where the symbolic links will be which
+ *  point into "source"
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/xattr.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <linux/stat.h>
+#include <sys/sysmacros.h>
+#ifndef AT_STATX_DONT_SYNC
+#define AT_STATX_DONT_SYNC 0x4000  /* from <linux/fcntl.h>, which clashes with <fcntl.h> */
+#endif
+#endif
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "memory.h"
+#include "version.h"
+#include "spill.h"
+
+#define RECORD_DIR ".spill"
+#define STATS_PREFIX ".stats."
+#define IGNORE_FILE ".spillignore"
+#define IGNORE_CACHE ".ignore"
+#define ORIGIN_XATTR "user.spill.origin"
+#define SOURCE_XATTR "user.spill.source"
+#define LINKS_PREFIX ".links."
+
+static FILE *conflict_file = NULL;
+
+/* Tally of what the current install did, kept alongside the package record */
+static struct {
+  int links;
+  int expansions;
+} install_counts;
+
+static char *caten(const char *s1, const char *s2)/*{{{*/
+{
+  int n1, n2, n;
+  char *res;
+
+  n1 = strlen(s1);
+  n2 = strlen(s2);
+  n = n1 + n2;
+
+  res = new_array(char, n + 1);
+  if (n1 > 0) memcpy(res, s1, n1);
+  if (n2 > 0) memcpy(res+n1, s2, n2);
+  res[n1+n2] = 0;
+  return res;
+}
+/*}}}*/
+static char *dfcaten(const char *d, const char *f)/*{{{*/
+{
+  int nd, nf, n;
+  char *res;
+
+  nd = strlen(d);
+  nf = strlen(f);
+  n = nd + nf;
+
+  res = new_array(char, n + 2);
+  if (nd > 0) memcpy(res, d, nd);
+  res[nd] = '/';
+  if (nf > 0) memcpy(res+nd+1, f, nf);
+  res[nd+nf+1] = 0;
+  return res;
+}
+/*}}}*/
+static char *dfcaten3(const char *x, const char *y, const char *z)/*{{{*/
+
+{
+  int nx, ny, nz, n;
+  char *res;
+
+  nx = strlen(x);
+  ny = strlen(y);
+  nz = strlen(z);
+  n = nx + ny + nz;
+
+  res = new_array(char, n + 3);
+  if (nx > 0) memcpy(res, x, nx);
+  res[nx] = '/';
+  if (ny > 0) memcpy(res+nx+1, y, ny);
+  res[nx+ny+1] = '/';
+  if (nz > 0) memcpy(res+nx+ny+2, z, nz);
+  res[nx+ny+nz+2] = 0;
+  return res;
+}
+/*}}}*/
+
+struct strtab_node {/*{{{*/
+  struct strtab_node *next;
+  unsigned long hash;
+  char *key;
+  void *value;
+};
+/*}}}*/
+struct strtab {/*{{{*/
+  int size; /* power of 2 */
+  int count;
+  struct strtab_node **buckets;
+};
+/*}}}*/
+static unsigned long hash_string(const char *s)/*{{{*/
+{
+  /* FNV-1a */
+  unsigned long h = 2166136261UL;
+  while (*s) {
+    h ^= (unsigned char) *s++;
+    h *= 16777619UL;
+  }
+  return h;
+}
+/*}}}*/
+static struct strtab *new_strtab(void)/*{{{*/
+{
+  struct strtab *t;
+  int i;
+  t = new(struct strtab);
+  t->size = 256;
+  t->count = 0;
+  t->buckets = new_array(struct strtab_node *, t->size);
+  for (i=0; i<t->size; i++) t->buckets[i] = NULL;
+  return t;
+}
+/*}}}*/
+static struct strtab_node *strtab_find(struct strtab *t, const char *key)/*{{{*/
+{
+  unsigned long h = hash_string(key);
+  struct strtab_node *n;
+  for (n = t->buckets[h & (t->size - 1)]; n; n = n->next) {
+    if ((n->hash == h) && !strcmp(n->key, key)) return n;
+  }
+  return NULL;
+}
+/*}}}*/
+static void strtab_grow(struct strtab *t)/*{{{*/
+{
+  struct strtab_node **old = t->buckets;
+  int old_size = t->size;
+  int i;
+  t->size <<= 1;
+  t->buckets = new_array(struct strtab_node *, t->size);
+  for (i=0; i<t->size; i++) t->buckets[i] = NULL;
+  for (i=0; i<old_size; i++) {
+    struct strtab_node *n, *next;
+    for (n = old[i]; n; n = next) {
+      next = n->next;
+      n->next = t->buckets[n->hash & (t->size - 1)];
+      t->buckets[n->hash & (t->size - 1)] = n;
+    }
+  }
+  free(old);
+}
+/*}}}*/
+static struct strtab_node *strtab_insert(struct strtab *t, const char *key)/*{{{*/
+{
+  /* Return the node for 'key', creating it (with a NULL value) if needed. */
+  struct strtab_node *n = strtab_find(t, key);
+  if (n) return n;
+  if (t->count >= t->size) strtab_grow(t);
+  n = new(struct strtab_node);
+  n->hash = hash_string(key);
+  n->key = new_string(key);
+  n->value = NULL;
+  n->next = t->buckets[n->hash & (t->size - 1)];
+  t->buckets[n->hash & (t->size - 1)] = n;
+  t->count++;
+  return n;
+}
+/*}}}*/
+static void *strtab_remove(struct strtab *t, const char *key)/*{{{*/
+{
+  /* Unhook the node for 'key' and hand back its value */
+  unsigned long h = hash_string(key);
+  struct strtab_node **pn, *n;
+  for (pn = &t->buckets[h & (t->size - 1)]; (n = *pn); pn = &n->next) {
+    if ((n->hash == h) && !strcmp(n->key, key)) {
+      void *value = n->value;
+      *pn = n->next;
+      free(n->key);
+      free(n);
+      t->count--;
+      return value;
+    }
+  }
+  return NULL;
+}
+/*}}}*/
+static void strtab_free(struct strtab *t)/*{{{*/
+{
+  /* Free the table and its keys; the values are the caller's business */
+  int i;
+  for (i=0; i<t->size; i++) {
+    struct strtab_node *n, *next;
+    for (n = t->buckets[i]; n; n = next) {
+      next = n->next;
+      free(n->key);
+      free(n);
+    }
+  }
+  free(t->buckets);
+  free(t);
+}
+/*}}}*/
+
+/*{{{ Throttling */
+/* With --throttle, the metadata operations spill makes on the filesystem
+ * (reading a directory, looking at or reading a link, creating or removing
+ * one) are paced so as not to swamp a busy server.  A token bucket limits
+ * the rate, allowing a tenth of a second's worth in a burst, and a count of
+ * operations in progress limits how many the pipeline's threads can have
+ * outstanding at once.  If a target latency is given, the rate backs off
+ * while operations take longer than that, and creeps back up when they're
+ * well inside it. */
+
+#define THROTTLE_DEFAULT_RATE 2000.0  /* when only a target latency is given */
+#define THROTTLE_MIN_FACTOR 0.02
+
+static struct {
+  int enabled;
+  double rate;            /* operations per second, 0 for no limit */
+  int max_outstanding;    /* 0 for no limit */
+  double target_latency;  /* seconds, 0 for no backoff */
+  double factor;          /* how much of 'rate' backoff currently allows */
+  double tokens;
+  double last_refill;
+  double mean_latency;
+  int outstanding;
+} throttle = { 0, 0.0, 0, 0.0, 1.0, 0.0, 0.0, 0.0, 0 };
+static pthread_mutex_t throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t throttle_cond = PTHREAD_COND_INITIALIZER;
+
+static double now_seconds(void)/*{{{*/
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+/*}}}*/
+static double throttle_start(void)/*{{{*/
+{
+  /* Wait until another operation is allowed, then return the time it
+   * started, to pass to throttle_done() */
+  double wait = 0.0;
+
+  if (!throttle.enabled) return 0.0;
+  pthread_mutex_lock(&throttle_lock);
+  while (throttle.max_outstanding && (throttle.outstanding >= throttle.max_outstanding)) {
+    pthread_cond_wait(&throttle_cond, &throttle_lock);
+  }
+  throttle.outstanding++;
+  if (throttle.rate > 0.0) {
+    double rate = throttle.rate * throttle.factor;
+    double burst = (rate > 10.0) ? (rate / 10.0) : 1.0;
+    double now = now_seconds();
+    if (throttle.last_refill == 0.0) throttle.tokens = burst;
+    else throttle.tokens += (now - throttle.last_refill) * rate;
+    if (throttle.tokens > burst) throttle.tokens = burst;
+    throttle.last_refill = now;
+    /* Take a token, going into debt (and waiting it off) if there isn't one,
+     * so that threads waiting together are spaced out rather than all
+     * woken at once. */
+    throttle.tokens -= 1.0;
+    if (throttle.tokens < 0.0) wait = -throttle.tokens / rate;
+  }
+  pthread_mutex_unlock(&throttle_lock);
+
+  if (wait > 0.0) {
+    struct timespec ts;
+    ts.tv_sec = (time_t) wait;
+    ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+    while ((nanosleep(&ts, &ts) < 0) && (errno == EINTR)) ;
+  }
+  return now_seconds();
+}
+/*}}}*/
+static void throttle_done(double started)/*{{{*/
+{
+  double latency;
+  int saved_errno;
+
+  if (!throttle.enabled) return;
+  saved_errno = errno;
+  latency = now_seconds() - started;
+  pthread_mutex_lock(&throttle_lock);
+  throttle.outstanding--;
+  if (throttle.target_latency > 0.0) {
+    throttle.mean_latency = (throttle.mean_latency == 0.0) ? latency :
+                            (0.9 * throttle.mean_latency + 0.1 * latency);
+    if (throttle.mean_latency > throttle.target_latency) {
+      throttle.factor *= 0.95;
+      if (throttle.factor < THROTTLE_MIN_FACTOR) throttle.factor = THROTTLE_MIN_FACTOR;
+    } else if (throttle.mean_latency < 0.5 * throttle.target_latency) {
+      throttle.factor *= 1.01;
+      if (throttle.factor > 1.0) throttle.factor = 1.0;
+    }
+  }
+  pthread_cond_signal(&throttle_cond);
+  pthread_mutex_unlock(&throttle_lock);
+  errno = saved_errno;
+}
+/*}}}*/
+static int parse_throttle(const char *spec)/*{{{*/
+{
+  /* <ops per second>[,<max outstanding>[,<target latency in ms>]], any of
+   * which may be empty or 0 for no limit.  Return 0 if it doesn't parse. */
+  char *copy, *field, *rest;
+  double values[3] = { 0.0, 0.0, 0.0 };
+  int i;
+
+  copy = new_string(spec);
+  rest = copy;
+  for (i=0; (i<3) && rest; i++) {
+    char *end;
+    field = rest;
+    rest = strchr(field, ',');
+    if (rest) *rest++ = 0;
+    if (!*field) continue;
+    values[i] = strtod(field, &end);
+    if (*end || (values[i] < 0.0)) {
+      free(copy);
+      return 0;
+    }
+  }
+  free(copy);
+  if (rest) return 0;
+
+  throttle.enabled = 1;
+  throttle.rate = values[0];
+  throttle.max_outstanding = (int) values[1];
+  throttle.target_latency = values[2] / 1000.0;
+  if ((throttle.target_latency > 0.0) && (throttle.rate == 0.0)) {
+    throttle.rate = THROTTLE_DEFAULT_RATE;
+  }
+  return 1;
+}
+/*}}}*/
+/*}}}*/
+/*{{{ Metadata calls */
+/* With --nfs, spill keeps in mind that each call below can be a round trip
+ * to a file server.  Looking at a file is a statx() asking for only the
+ * fields that are wanted, with AT_STATX_DONT_SYNC so that an NFS client
+ * answers from the attributes it already has (typically from READDIRPLUS,
+ * when the directory has just been listed) instead of revalidating them with
+ * the server.  That's safe here because the link area is locked and the
+ * package trees aren't expected to change during a run.  When spill exits,
+ * it reports how many of each kind of call it made. */
+
+enum meta_op {/*{{{*/
+  OP_READDIR,
+  OP_LSTAT,
+  OP_STAT,
+  OP_READLINK,
+  OP_SYMLINK,
+  OP_UNLINK,
+  OP_MKDIR
+};
+/*}}}*/
+#define N_META_OPS (OP_MKDIR + 1)
+
+#ifndef STATX_TYPE
+#define STATX_TYPE  0x001U
+#define STATX_MODE  0x002U
+#define STATX_NLINK 0x004U
+#define STATX_INO   0x100U
+#define STATX_SIZE  0x200U
+#endif
+#ifndef STATX_MTIME
+#define STATX_MTIME 0x040U
+#endif
+
+static const char *meta_op_names[N_META_OPS] = {
+  "directory reads", "lstat", "stat", "readlink", "symlink", "unlink", "mkdir"
+};
+
+static int nfs_mode = 0;
+static int use_statx = 1;  /* until the kernel says it hasn't got it */
+static unsigned long meta_calls[N_META_OPS];
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void count_call(enum meta_op op)/*{{{*/
+{
+  if (!nfs_mode) return;
+  pthread_mutex_lock(&meta_lock);
+  meta_calls[op]++;
+  pthread_mutex_unlock(&meta_lock);
+}
+/*}}}*/
+static void report_meta_calls(void)/*{{{*/
+{
+  unsigned long total = 0;
+  int i;
+  for (i=0; i<N_META_OPS; i++) total += meta_calls[i];
+  fprintf(stderr, "Filesystem calls : %lu", total);
+  for (i=0; i<N_META_OPS; i++) {
+    fprintf(stderr, "%s%lu %s", i ? ", " : " (", meta_calls[i], meta_op_names[i]);
+  }
+  fprintf(stderr, ")\n");
+}
+/*}}}*/
+static int meta_stat(int dir_fd, const char *path, int flags, unsigned int mask, struct stat *sb)/*{{{*/
+{
+  /* fstatat(), made with statx() in --nfs mode.  'mask' is the STATX_xxx
+   * fields that the caller needs (the type is always filled in); nothing
+   * else in 'sb' is to be relied on. */
+  double started;
+  int status;
+
+  count_call((flags & AT_SYMLINK_NOFOLLOW) ? OP_LSTAT : OP_STAT);
+  started = throttle_start();
+#if defined(__linux__) && defined(SYS_statx) && defined(AT_STATX_DONT_SYNC)
+  if (nfs_mode && use_statx) {
+    struct statx stx;
+    status = syscall(SYS_statx, dir_fd, path, flags | AT_STATX_DONT_SYNC, mask | STATX_TYPE, &stx);
+    if (status == 0) {
+      memset(sb, 0, sizeof(struct stat));
+      sb->st_mode = stx.stx_mode;
+      sb->st_nlink = stx.stx_nlink;
+      sb->st_ino = stx.stx_ino;
+      sb->st_size = stx.stx_size;
+      sb->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+      sb->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+      sb->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+      throttle_done(started);
+      return 0;
+    }
+    if (errno != ENOSYS) {
+      throttle_done(started);
+      return status;
+    }
+    use_statx = 0;
+  }
+#else
+  (void) mask;
+#endif
+  status = fstatat(dir_fd, path, sb, flags);
+  throttle_done(started);
+  return status;
+}
+/*}}}*/
+static int meta_readlink(int dir_fd, const char *path, char *buf, int size)/*{{{*/
+{
+  double started;
+  int status;
+  count_call(OP_READLINK);
+  started = throttle_start();
+  status = readlinkat(dir_fd, path, buf, size);
+  throttle_done(started);
+  return status;
+}
+/*}}}*/
+/*}}}*/
+/*{{{ Batched calls */
+/* With --io-uring, calls that spill makes a directory's worth at a time (the
+ * stats after listing a directory, and the links made into it) are put
+ * through an io_uring, so that a whole batch goes to the kernel in one
+ * system call and is in progress at once.  The ring is driven with the raw
+ * system calls.  There are two rings, one for reading and one for writing,
+ * so that the pipeline's reader and writer stages don't wait for each other;
+ * each is set up when it's first wanted.  meta_batch() returns -1 without
+ * doing anything if a ring can't be used (the kernel is too old, io_uring is
+ * turned off, or --throttle wants the calls one at a time), and the caller
+ * then makes the calls the usual way.  There's no io_uring operation for
+ * reading a link, so that is always done directly. */
+
+#define RING_ENTRIES 256
+
+struct meta_req {/*{{{*/
+  enum meta_op op;      /* OP_LSTAT, OP_STAT, OP_SYMLINK, OP_UNLINK or OP_MKDIR */
+  int dir_fd;           /* paths are relative to this */
+  const char *path;
+  const char *target;   /* for OP_SYMLINK */
+  mode_t mode;          /* for OP_MKDIR, and the result of a stat */
+  unsigned int mask;    /* STATX_xxx fields wanted by a stat */
+  int chain;            /* only do the next request if this one works */
+  int err;              /* errno, 0 if the call worked */
+};
+/*}}}*/
+
+static int use_uring = 0;
+
+#ifdef HAVE_IO_URING
+struct uring {/*{{{*/
+  pthread_mutex_t lock;
+  int state;            /* 0 not tried yet, 1 working, -1 not usable */
+  int fd;
+  unsigned int entries;
+  void *sq_map, *cq_map;
+  size_t sq_map_len, cq_map_len;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  unsigned int *sq_tail, *sq_mask, *sq_array;
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+};
+/*}}}*/
+static struct uring read_ring = { PTHREAD_MUTEX_INITIALIZER, 0 };
+static struct uring write_ring = { PTHREAD_MUTEX_INITIALIZER, 0 };
+
+static int uring_supports(int fd)/*{{{*/
+{
+  /* Does the kernel do all the operations that spill will ask for? */
+  static const int wanted[] = {
+    IORING_OP_STATX, IORING_OP_UNLINKAT, IORING_OP_MKDIRAT, IORING_OP_SYMLINKAT
+  };
+  struct io_uring_probe *probe;
+  int n_ops = IORING_OP_LAST;
+  int result = 1;
+  int i;
+
+  probe = (struct io_uring_probe *) new_array(char, sizeof(struct io_uring_probe) +
+                                              n_ops * sizeof(struct io_uring_probe_op));
+  memset(probe, 0, sizeof(struct io_uring_probe) + n_ops * sizeof(struct io_uring_probe_op));
+  if (syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE, probe, n_ops) < 0) {
+    result = 0;
+  } else {
+    for (i=0; i<(int)(sizeof(wanted)/sizeof(wanted[0])); i++) {
+      if ((wanted[i] > probe->last_op) || !(probe->ops[wanted[i]].flags & IO_URING_OP_SUPPORTED)) {
+        result = 0;
+      }
+    }
+  }
+  free(probe);
+  return result;
+}
+/*}}}*/
+static int uring_setup(struct uring *r)/*{{{*/
+{
+  /* Return 0 if the ring is ready to use.  Called with r->lock held. */
+  struct io_uring_params p;
+  char *sq, *cq;
+
+  memset(&p, 0, sizeof(p));
+  r->fd = syscall(SYS_io_uring_setup, RING_ENTRIES, &p);
+  if (r->fd < 0) return -1;
+  fcntl(r->fd, F_SETFD, FD_CLOEXEC);
+  if (!uring_supports(r->fd)) {
+    close(r->fd);
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+
+  r->entries = p.sq_entries;
+  r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_map_len > r->sq_map_len) r->sq_map_len = r->cq_map_len;
+    r->cq_map_len = 0;
+  }
+  r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_map == MAP_FAILED) goto fail_fd;
+  if (r->cq_map_len) {
+    r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_map == MAP_FAILED) goto fail_sq;
+  } else {
+    r->cq_map = r->sq_map;
+  }
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) goto fail_cq;
+
+  sq = (char *) r->sq_map;
+  cq = (char *) r->cq_map;
+  r->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+  r->sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned int *) (sq + p.sq_off.array);
+  r->cq_head = (unsigned int *) (cq + p.cq_off.head);
+  r->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+  r->cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  return 0;
+
+fail_cq:
+  if (r->cq_map_len) munmap(r->cq_map, r->cq_map_len);
+fail_sq:
+  munmap(r->sq_map, r->sq_map_len);
+fail_fd:
+  close(r->fd);
+  return -1;
+}
+/*}}}*/
+static void uring_prepare(struct io_uring_sqe *sqe, struct meta_req *req, struct statx *stx)/*{{{*/
+{
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->fd = req->dir_fd;
+  sqe->addr = (unsigned long) req->path;
+  switch (req->op) {
+    case OP_LSTAT:
+    case OP_STAT:
+      sqe->opcode = IORING_OP_STATX;
+      sqe->len = req->mask | STATX_TYPE;
+      sqe->off = (unsigned long) stx;
+      sqe->statx_flags = ((req->op == OP_LSTAT) ? AT_SYMLINK_NOFOLLOW : 0) |
+                         (nfs_mode ? AT_STATX_DONT_SYNC : 0);
+      break;
+    case OP_SYMLINK:
+      sqe->opcode = IORING_OP_SYMLINKAT;
+      sqe->addr = (unsigned long) req->target;
+      sqe->addr2 = (unsigned long) req->path;
+      break;
+    case OP_UNLINK:
+      sqe->opcode = IORING_OP_UNLINKAT;
+      break;
+    case OP_MKDIR:
+      sqe->opcode = IORING_OP_MKDIRAT;
+      sqe->len = req->mode;
+      break;
+    default:
+      break;
+  }
+  if (req->chain) sqe->flags |= IOSQE_IO_LINK;
+}
+/*}}}*/
+static int uring_run(struct uring *r, struct meta_req *reqs, int n)/*{{{*/
+{
+  /* Submit up to a ringful of 'reqs', wait for them all to finish and return
+   * how many there were.  A chain isn't split between submissions.  If the
+   * ring stops taking requests, the ones it didn't take fail and the ring
+   * isn't used again.  Called with r->lock held. */
+  struct statx *stx;
+  unsigned int tail, head;
+  int queued, submitted = 0, reaped = 0;
+  int i;
+
+  queued = (n < (int) r->entries) ? n : (int) r->entries;
+  while ((queued < n) && (queued > 0) && reqs[queued - 1].chain) queued--;
+  if (queued == 0) queued = (n < (int) r->entries) ? n : (int) r->entries;
+
+  stx = new_array(struct statx, queued);
+  tail = *r->sq_tail;
+  for (i=0; i<queued; i++) {
+    unsigned int index = (tail + i) & *r->sq_mask;
+    reqs[i].err = EIO;  /* until it completes */
+    uring_prepare(&r->sqes[index], &reqs[i], &stx[i]);
+    r->sqes[index].user_data = i;
+    r->sq_array[index] = index;
+    count_call(reqs[i].op);
+  }
+  __atomic_store_n(r->sq_tail, tail + queued, __ATOMIC_RELEASE);
+
+  while (reaped < queued) {
+    int status = syscall(SYS_io_uring_enter, r->fd, queued - submitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (status < 0) {
+      if ((errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY)) continue;
+      if (r->state < 0) {
+        /* Can't even wait for what's in flight, so leave it be, along with
+         * the buffers it may still write to */
+        return queued;
+      }
+      fprintf(stderr, "io_uring failed (%s), carrying on without it\n", strerror(errno));
+      for (i=submitted; i<queued; i++) reqs[i].err = errno;
+      reaped += queued - submitted;
+      submitted = queued;
+      r->state = -1;
+      continue;
+    }
+    submitted += status;
+    head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+      struct meta_req *req = &reqs[cqe->user_data];
+      req->err = (cqe->res < 0) ? -cqe->res : 0;
+      if (!req->err && ((req->op == OP_LSTAT) || (req->op == OP_STAT))) {
+        req->mode = stx[cqe->user_data].stx_mode;
+      }
+      head++;
+      reaped++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  }
+  free(stx);
+  return queued;
+}
+/*}}}*/
+#endif
+static int meta_batch(int writing, struct meta_req *reqs, int n)/*{{{*/
+{
+  /* Make all the calls in 'reqs' through a ring, setting each one's 'err'
+   * (ECANCELED where an earlier call in its chain failed).  Return 0 if that
+   * was done, or -1 if the calls should be made one at a time instead. */
+#ifdef HAVE_IO_URING
+  struct uring *r = writing ? &write_ring : &read_ring;
+  int done = 0;
+
+  if (!use_uring || throttle.enabled || (n == 0)) return -1;
+  pthread_mutex_lock(&r->lock);
+  if (r->state == 0) {
+    r->state = (uring_setup(r) == 0) ? 1 : -1;
+    if (r->state < 0) {
+      fprintf(stderr, "Couldn't set up io_uring (%s), carrying on without it\n", strerror(errno));
+    }
+  }
+  while ((r->state > 0) && (done < n)) {
+    done += uring_run(r, reqs + done, n - done);
+  }
+  pthread_mutex_unlock(&r->lock);
+  if (done == 0) return -1;
+  if (done < n) {
+    /* The ring broke part way : finish off with plain calls */
+    int i, chained = 0;
+    for (i=done; i<n; i++) {
+      struct meta_req *req = &reqs[i];
+      struct stat sb;
+      int status = -1;
+      if (chained) {
+        errno = ECANCELED;
+      } else {
+        switch (req->op) {
+          case OP_LSTAT:
+          case OP_STAT:
+            status = meta_stat(req->dir_fd, req->path, (req->op == OP_LSTAT) ? AT_SYMLINK_NOFOLLOW : 0,
+                               req->mask, &sb);
+            if (status == 0) req->mode = sb.st_mode;
+            break;
+          case OP_SYMLINK: count_call(OP_SYMLINK); status = symlinkat(req->target, req->dir_fd, req->path); break;
+          case OP_UNLINK:  count_call(OP_UNLINK);  status = unlinkat(req->dir_fd, req->path, 0); break;
+          case OP_MKDIR:   count_call(OP_MKDIR);   status = mkdirat(req->dir_fd, req->path, req->mode); break;
+          default: errno = EINVAL; break;
+        }
+      }
+      req->err = (status < 0) ? errno : 0;
+      chained = req->chain && req->err;
+    }
+  }
+  return 0;
+#else
+  (void) writing; (void) reqs; (void) n;
+  return -1;
+#endif
+}
+/*}}}*/
+/*}}}*/
+/*{{{ Directory listings */
+/* A whole directory read in one go.  The names are packed back to back in
+ * one buffer and the entries, sorted by name, sit in one array, so even a
+ * directory like share/man/man3 costs a handful of allocations and can be
+ * walked or merged with another listing in order.  On Linux the entries are
+ * pulled in with getdents64 through a large buffer rather than one at a time
+ * through readdir. */
+
+struct dir_entry {/*{{{*/
+  const char *name;
+  int len;
+  unsigned char type;   /* DT_xxx from <dirent.h>, may be DT_UNKNOWN */
+  ino_t ino;
+};
+/*}}}*/
+struct dirlist {/*{{{*/
+  int n;
+  struct dir_entry *entries;
+  char *names;
+};
+/*}}}*/
+
+#define DIRLIST_BUFFER_SIZE 65536
+
+static int compare_dir_entries(const void *a, const void *b)/*{{{*/
+{
+  return strcmp(((const struct dir_entry *) a)->name, ((const struct dir_entry *) b)->name);
+}
+/*}}}*/
+static void add_dir_entry(struct dirlist *dl, int *max_entries,/*{{{*/
+                          int *names_len, int *max_names,
+                          const char *name, unsigned char type, ino_t ino)
+{
+  /* While the listing's being built, entries[].name holds an offset into the
+   * names buffer, since the buffer may move as it grows. */
+  int len;
+  if (!strcmp(name, ".") || !strcmp(name, "..")) return;
+  len = strlen(name);
+  if (dl->n == *max_entries) {
+    *max_entries = *max_entries ? (*max_entries << 1) : 64;
+    dl->entries = grow_array(struct dir_entry, *max_entries, dl->entries);
+  }
+  while (*names_len + len + 1 > *max_names) {
+    *max_names = *max_names ? (*max_names << 1) : 1024;
+    dl->names = grow_array(char, *max_names, dl->names);
+  }
+  memcpy(dl->names + *names_len, name, len + 1);
+  dl->entries[dl->n].name = (const char *) (long) *names_len;
+  dl->entries[dl->n].len = len;
+  dl->entries[dl->n].type = type;
+  dl->entries[dl->n].ino = ino;
+  dl->n++;
+  *names_len += len + 1;
+}
+/*}}}*/
+#if defined(__linux__) && defined(SYS_getdents64)
+struct linux_dirent64 {/*{{{*/
+  unsigned long long d_ino;
+  long long d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+/*}}}*/
+static int read_entries_getdents(int fd, struct dirlist *dl, int *max_entries,/*{{{*/
+                                 int *names_len, int *max_names)
+{
+  /* Return 0 on success, -1 with errno set otherwise */
+  char *buffer = new_array(char, DIRLIST_BUFFER_SIZE);
+  int result = 0;
+  for (;;) {
+    long nread = syscall(SYS_getdents64, fd, buffer, DIRLIST_BUFFER_SIZE);
+    long pos;
+    if (nread < 0) {
+      result = -1;
+      break;
+    }
+    if (nread == 0) break;
+    for (pos = 0; pos < nread; ) {
+      struct linux_dirent64 *d = (struct linux_dirent64 *) (buffer + pos);
+      add_dir_entry(dl, max_entries, names_len, max_names, d->d_name, d->d_type, (ino_t) d->d_ino);
+      pos += d->d_reclen;
+    }
+  }
+  free(buffer);
+  return result;
+}
+/*}}}*/
+#endif
+static int read_entries_readdir(int fd, struct dirlist *dl, int *max_entries,/*{{{*/
+                                int *names_len, int *max_names)
+{
+  DIR *d;
+  struct dirent *de;
+  d = fdopendir(fd);
+  if (!d) return -1;
+  while ((de = readdir(d))) {
+#ifdef _DIRENT_HAVE_D_TYPE
+    add_dir_entry(dl, max_entries, names_len, max_names, de->d_name, de->d_type, de->d_ino);
+#else
+    add_dir_entry(dl, max_entries, names_len, max_names, de->d_name, DT_UNKNOWN, de->d_ino);
+#endif
+  }
+  closedir(d); /* closes fd too */
+  return 0;
+}
+/*}}}*/
+static struct dirlist *read_dirlist(const char *path)/*{{{*/
+{
+  /* Read the whole of directory 'path' (without '.' and '..').  Return NULL,
+   * with errno set, if it can't be read. */
+  struct dirlist *dl;
+  int max_entries = 0, names_len = 0, max_names = 0;
+  int fd, status, i;
+  double started;
+
+  count_call(OP_READDIR);
+  started = throttle_start();
+  fd = open(path[0] ? path : "/", O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    throttle_done(started);
+    return NULL;
+  }
+
+  dl = new(struct dirlist);
+  dl->n = 0;
+  dl->entries = NULL;
+  dl->names = NULL;
+
+#if defined(__linux__) && defined(SYS_getdents64)
+  status = read_entries_getdents(fd, dl, &max_entries, &names_len, &max_names);
+  if ((status < 0) && (errno == ENOSYS) && (dl->n == 0)) {
+    status = read_entries_readdir(fd, dl, &max_entries, &names_len, &max_names);
+  } else {
+    close(fd);
+  }
+#else
+  status = read_entries_readdir(fd, dl, &max_entries, &names_len, &max_names);
+#endif
+  throttle_done(started);
+  if (status < 0) {
+    int saved_errno = errno;
+    if (dl->entries) free(dl->entries);
+    if (dl->names) free(dl->names);
+    free(dl);
+    errno = saved_errno;
+    return NULL;
+  }
+
+  for (i=0; i<dl->n; i++) {
+    dl->entries[i].name = dl->names + (long) dl->entries[i].name;
+  }
+  if (dl->n > 1) qsort(dl->entries, dl->n, sizeof(struct dir_entry), compare_dir_entries);
+  return dl;
+}
+/*}}}*/
+static void free_dirlist(struct dirlist *dl)/*{{{*/
+{
+  if (dl->entries) free(dl->entries);
+  if (dl->names) free(dl->names);
+  free(dl);
+}
+/*}}}*/
+/*}}}*/
+
+/*{{{ Destination state cache */
+/* When spill runs as a daemon, what's known about the link area is kept here
+ * so that classifying a destination path doesn't need to touch the disk.  The
+ * daemon keeps it current with inotify; spill's own writes go through the
+ * dest_xxx() wrappers, which keep it current as they go.  When there's no
+ * cache, the wrappers answer from a snapshot of the directory being walked
+ * if there is one, and otherwise are just the system calls. */
+
+struct dest_state {
+  int err;       /* errno from lstat, 0 if it succeeded */
+  mode_t mode;
+  char *link;    /* target if it's a symbolic link */
+  int link_len;
+};
+
+static struct strtab *dest_cache = NULL;
+static char *dest_cache_root = NULL;
+static int dest_cache_root_len = 0;
+/* Directories whose contents the cache can be trusted for */
+static struct strtab *dest_cache_dirs = NULL;
+/* Held while the cache is used, since the install pipeline's writer stage
+ * updates it from another thread */
+static pthread_mutex_t dest_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void free_dest_state(void *x)/*{{{*/
+{
+  struct dest_state *ds = (struct dest_state *) x;
+  if (ds->link) free(ds->link);
+  free(ds);
+}
+/*}}}*/
+static int dest_cacheable(const char *path)/*{{{*/
+{
+  char *parent, *p;
+  int result;
+  if (!dest_cache) return 0;
+  if (strncmp(path, dest_cache_root, dest_cache_root_len)) return 0;
+  if (path[dest_cache_root_len] != '/') return 0;
+  parent = new_string(path);
+  p = strrchr(parent, '/');
+  *p = 0;
+  result = strtab_find(dest_cache_dirs, parent) ? 1 : 0;
+  free(parent);
+  return result;
+}
+/*}}}*/
+static struct dest_state *probe_dest_at(int dir_fd, const char *path, int is_link)/*{{{*/
+{
+  /* Look at 'path' (relative to 'dir_fd').  If a directory listing has
+   * already said it's a link, go straight to reading it. */
+  struct dest_state *ds;
+  struct stat sb;
+  char linkbuf[PATH_MAX];
+  int len = -1;
+  ds = new(struct dest_state);
+  ds->err = 0;
+  ds->link = NULL;
+  ds->link_len = 0;
+  ds->mode = 0;
+  if (is_link) {
+    len = meta_readlink(dir_fd, path, linkbuf, PATH_MAX);
+    if (len >= 0) {
+      ds->mode = S_IFLNK | 0777;
+    } else if (errno != EINVAL) {
+      ds->err = errno;  /* gone since it was listed */
+      return ds;
+    }
+  }
+  if (len < 0) {
+    if (meta_stat(dir_fd, path, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_MODE, &sb) < 0) {
+      ds->err = errno;
+      return ds;
+    }
+    ds->mode = sb.st_mode;
+    if (S_ISLNK(sb.st_mode)) {
+      len = meta_readlink(dir_fd, path, linkbuf, PATH_MAX);
+      if (len < 0) {
+        ds->err = errno;
+        return ds;
+      }
+    }
+  }
+  if (len >= 0) {
+    ds->link = new_array(char, len + 1);
+    memcpy(ds->link, linkbuf, len);
+    ds->link[len] = 0;
+    ds->link_len = len;
+  }
+  return ds;
+}
+/*}}}*/
+static struct dest_state *probe_dest(const char *path)/*{{{*/
+{
+  return probe_dest_at(AT_FDCWD, path, 0);
+}
+/*}}}*/
+static struct dest_state *lookup_dest(const char *path)/*{{{*/
+{
+  struct strtab_node *n;
+  n = strtab_insert(dest_cache, path);
+  if (!n->value) n->value = probe_dest(path);
+  return (struct dest_state *) n->value;
+}
+/*}}}*/
+/*{{{ Directory snapshots */
+/* Without the daemon's cache, each link area directory that traverse_action()
+ * walks is read whole first.  Anything the package has that isn't in the
+ * listing is known to be absent without a system call.  Entries present in
+ * both are looked at in inode order rather than name order, which keeps the
+ * inode table reads on a cold disk close to sequential, and usually only the
+ * links need looking at, since the listing gives each entry's type.  The
+ * creates then happen in name order, which is the best that can be done for
+ * the directory index: ext4's htree order depends on a per-filesystem hash
+ * seed that isn't visible from userspace.
+ *
+ * Snapshots nest as the walk descends.  A name that spill writes to is
+ * noted, and from then on is looked up with system calls again. */
+
+struct dest_snapshot {/*{{{*/
+  char *dir;
+  int dir_len;
+  struct dirlist *dl;
+  struct dest_state *states;   /* parallel to dl->entries */
+  struct strtab *touched;      /* names written since the snapshot was taken */
+  struct dest_snapshot *next;  /* the snapshot of the directory above */
+};
+/*}}}*/
+static struct dest_snapshot *snapshots = NULL;
+
+struct ino_order {/*{{{*/
+  ino_t ino;
+  int index;
+};
+/*}}}*/
+static int compare_ino_order(const void *a, const void *b)/*{{{*/
+{
+  ino_t ia = ((const struct ino_order *) a)->ino;
+  ino_t ib = ((const struct ino_order *) b)->ino;
+  return (ia < ib) ? -1 : (ia > ib) ? 1 : 0;
+}
+/*}}}*/
+static int find_dir_entry(const struct dirlist *dl, const char *name)/*{{{*/
+{
+  int lo = 0, hi = dl->n - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) >> 1;
+    int c = strcmp(name, dl->entries[mid].name);
+    if (c == 0) return mid;
+    if (c < 0) hi = mid - 1;
+    else lo = mid + 1;
+  }
+  return -1;
+}
+/*}}}*/
+static struct dest_snapshot *take_snapshot(const char *dir, int n, const char **wanted)/*{{{*/
+{
+  /* Snapshot directory 'dir', looking up the 'n' names in 'wanted' (which
+   * may or may not be there) straight away.  Return NULL if it can't be
+   * read, in which case lookups just go to the system. */
+  struct dest_snapshot *snap;
+  struct dirlist *dl;
+  struct ino_order *order;
+  int n_order;
+  int dir_fd;
+  int i;
+
+  if (dest_cache) return NULL;
+  dl = read_dirlist(dir);
+  if (!dl) return NULL;
+
+  snap = new(struct dest_snapshot);
+  snap->dir = new_string(dir);
+  snap->dir_len = strlen(dir);
+  snap->dl = dl;
+  snap->touched = NULL;
+  snap->states = new_array(struct dest_state, dl->n + 1);
+  for (i=0; i<dl->n; i++) {
+    struct dest_state *ds = &snap->states[i];
+    ds->err = -1; /* not looked at yet */
+    ds->link = NULL;
+    ds->link_len = 0;
+    switch (dl->entries[i].type) {
+      case DT_DIR:  ds->mode = S_IFDIR;  break;
+      case DT_REG:  ds->mode = S_IFREG;  break;
+      case DT_LNK:  ds->mode = S_IFLNK;  break;
+      case DT_CHR:  ds->mode = S_IFCHR;  break;
+      case DT_BLK:  ds->mode = S_IFBLK;  break;
+      case DT_FIFO: ds->mode = S_IFIFO;  break;
+      case DT_SOCK: ds->mode = S_IFSOCK; break;
+      default:      ds->mode = 0;        break;
+    }
+    if (ds->mode && !S_ISLNK(ds->mode)) ds->err = 0; /* the type is all that's needed */
+  }
+
+  /* Look up what's wanted, in inode order */
+  order = new_array(struct ino_order, n + 1);
+  n_order = 0;
+  for (i=0; i<n; i++) {
+    int k = find_dir_entry(dl, wanted[i]);
+    if ((k >= 0) && (snap->states[k].err == -1)) {
+      order[n_order].ino = dl->entries[k].ino;
+      order[n_order].index = k;
+      n_order++;
+    }
+  }
+  if (n_order > 1) qsort(order, n_order, sizeof(struct ino_order), compare_ino_order);
+  dir_fd = n_order ? open(dir[0] ? dir : "/", O_RDONLY | O_DIRECTORY) : -1;
+  for (i=0; i<n_order; i++) {
+    int k = order[i].index;
+    struct dest_state *ds;
+    if (dir_fd >= 0) {
+      ds = probe_dest_at(dir_fd, dl->entries[k].name, S_ISLNK(snap->states[k].mode));
+    } else {
+      char *path = dfcaten(dir, dl->entries[k].name);
+      ds = probe_dest_at(AT_FDCWD, path, S_ISLNK(snap->states[k].mode));
+      free(path);
+    }
+    snap->states[k] = *ds;
+    free(ds);
+  }
+  if (dir_fd >= 0) close(dir_fd);
+  free(order);
+
+  pthread_mutex_lock(&dest_lock);
+  snap->next = snapshots;
+  snapshots = snap;
+  pthread_mutex_unlock(&dest_lock);
+  return snap;
+}
+/*}}}*/
+static void drop_snapshot(struct dest_snapshot *snap)/*{{{*/
+{
+  /* Snapshots are dropped in the reverse order they're taken */
+  int i;
+  if (!snap) return;
+  pthread_mutex_lock(&dest_lock);
+  snapshots = snap->next;
+  pthread_mutex_unlock(&dest_lock);
+  for (i=0; i<snap->dl->n; i++) {
+    if (snap->states[i].link) free(snap->states[i].link);
+  }
+  free(snap->states);
+  if (snap->touched) strtab_free(snap->touched);
+  free_dirlist(snap->dl);
+  free(snap->dir);
+  free(snap);
+}
+/*}}}*/
+static struct dest_snapshot *snapshot_for(const char *path, const char **name)/*{{{*/
+{
+  /* Find the snapshot covering 'path', if any.  Called with dest_lock held. */
+  struct dest_snapshot *snap;
+  const char *slash = strrchr(path, '/');
+  int len;
+  if (!slash) return NULL;
+  len = slash - path;
+  for (snap = snapshots; snap; snap = snap->next) {
+    if ((snap->dir_len == len) && !memcmp(snap->dir, path, len)) {
+      if (snap->touched && strtab_find(snap->touched, slash + 1)) return NULL;
+      *name = slash + 1;
+      return snap;
+    }
+  }
+  return NULL;
+}
+/*}}}*/
+static struct dest_state *snapshot_lookup(const char *path, struct dest_state *absent)/*{{{*/
+{
+  /* Return what the snapshot says about 'path' ('absent' if it isn't there),
+   * or NULL if there's no snapshot to ask.  Called with dest_lock held. */
+  struct dest_snapshot *snap;
+  struct dest_state *ds;
+  const char *name;
+  int k;
+
+  if (!snapshots) return NULL;
+  snap = snapshot_for(path, &name);
+  if (!snap) return NULL;
+  k = find_dir_entry(snap->dl, name);
+  if (k < 0) {
+    absent->err = ENOENT;
+    absent->mode = 0;
+    absent->link = NULL;
+    absent->link_len = 0;
+    return absent;
+  }
+  ds = &snap->states[k];
+  if (ds->err == -1) {
+    /* Wasn't asked for up front */
+    struct dest_state *probed = probe_dest_at(AT_FDCWD, path, S_ISLNK(ds->mode));
+    *ds = *probed;
+    free(probed);
+  }
+  return ds;
+}
+/*}}}*/
+/*}}}*/
+/*{{{ Staged writes */
+/* With --archive, the link area itself is left alone.  What would have been
+ * written to it is kept here instead, by path, and lookups see that in front
+ * of what's on disk.  Nothing under a path written here is taken from the
+ * disk either : a directory made here is new, and what's under a removed
+ * link or one that's been replaced isn't what the walk would find. */
+#define MAX_STAGED_HOPS 16
+
+static struct strtab *staged = NULL;  /* path -> struct dest_state */
+static char *staged_root = NULL;      /* the link area, as its paths start */
+static int staged_root_len = 0;
+
+static int staged_shadowed(const char *path)/*{{{*/
+{
+  /* Is anything above 'path' (but inside the area) staged?  Called with
+   * dest_lock held. */
+  char *parent = new_string(path);
+  char *slash;
+  int result = 0;
+  while (!result && (slash = strrchr(parent, '/')) && (slash - parent > staged_root_len)) {
+    *slash = 0;
+    result = strtab_find(staged, parent) ? 1 : 0;
+  }
+  free(parent);
+  return result;
+}
+/*}}}*/
+static void collapse_dots(char *path)/*{{{*/
+{
+  /* Take the "." and "<name>/.." components out of 'path', in place,
+   * without asking the disk */
+  char *out = path;
+  const char *p = path;
+  int depth = 0;  /* components in 'out' that a ".." can take back */
+
+  if (*p == '/') *out++ = *p++;
+  while (*p) {
+    const char *end = strchr(p, '/');
+    int len = end ? (end - p) : (int) strlen(p);
+    if ((len == 0) || ((len == 1) && (p[0] == '.'))) {
+      /* nothing */
+    } else if ((len == 2) && (p[0] == '.') && (p[1] == '.') && depth) {
+      out--;
+      while ((out > path) && (out[-1] != '/')) out--;
+      depth--;
+    } else {
+      memmove(out, p, len);
+      out += len;
+      *out++ = '/';
+      if ((len != 2) || (p[0] != '.') || (p[1] != '.')) depth++;
+    }
+    p += len;
+    if (*p) p++;
+  }
+  if ((out > path + 1) && (out[-1] == '/')) out--;
+  *out = 0;
+}
+/*}}}*/
+static struct dest_state *staged_lookup(const char *path, struct dest_state *absent)/*{{{*/
+{
+  /* Return what's been staged at 'path' ('absent' if it's below something
+   * that has), or NULL if the disk has to be asked.  Called with dest_lock
+   * held. */
+  struct strtab_node *n;
+  if (!staged) return NULL;
+  n = strtab_find(staged, path);
+  if (n) return (struct dest_state *) n->value;
+  if (!staged_shadowed(path)) return NULL;
+  absent->err = ENOENT;
+  absent->mode = 0;
+  absent->link = NULL;
+  absent->link_len = 0;
+  return absent;
+}
+/*}}}*/
+/*}}}*/
+static void dest_invalidate(const char *path)/*{{{*/
+{
+  struct dest_state *ds;
+  struct dest_snapshot *snap;
+  const char *name;
+  pthread_mutex_lock(&dest_lock);
+  snap = snapshot_for(path, &name);
+  if (snap) {
+    if (!snap->touched) snap->touched = new_strtab();
+    strtab_insert(snap->touched, name);
+  }
+  pthread_mutex_unlock(&dest_lock);
+  if (!dest_cache) return;
+  pthread_mutex_lock(&dest_lock);
+  ds = (struct dest_state *) strtab_remove(dest_cache, path);
+  pthread_mutex_unlock(&dest_lock);
+  if (ds) free_dest_state(ds);
+}
+/*}}}*/
+static int dest_lstat(const char *path, mode_t *mode)/*{{{*/
+{
+  struct dest_state *ds;
+  if (!dest_cacheable(path)) {
+    struct stat sb;
+    struct dest_state absent;
+    pthread_mutex_lock(&dest_lock);
+    ds = staged_lookup(path, &absent);
+    if (!ds) ds = snapshot_lookup(path, &absent);
+    if (ds) {
+      int err = ds->err;
+      *mode = ds->mode;
+      pthread_mutex_unlock(&dest_lock);
+      if (err) {
+        errno = err;
+        return -1;
+      }
+      return 0;
+    }
+    pthread_mutex_unlock(&dest_lock);
+    if (meta_stat(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_MODE, &sb) < 0) return -1;
+    *mode = sb.st_mode;
+    return 0;
+  }
+  pthread_mutex_lock(&dest_lock);
+  ds = lookup_dest(path);
+  if (ds->err) {
+    errno = ds->err;
+    pthread_mutex_unlock(&dest_lock);
+    return -1;
+  }
+  *mode = ds->mode;
+  pthread_mutex_unlock(&dest_lock);
+  return 0;
+}
+/*}}}*/
+static int dest_readlink(const char *path, char *buf, int size)/*{{{*/
+{
+  struct dest_state *ds;
+  if (!dest_cacheable(path)) {
+    struct dest_state absent;
+    pthread_mutex_lock(&dest_lock);
+    ds = staged_lookup(path, &absent);
+    if (!ds) ds = snapshot_lookup(path, &absent);
+    if (ds && (ds->err || ds->link || ds->mode)) {
+      int len = ds->link_len;
+      if (ds->err || !ds->link) {
+        errno = ds->err ? ds->err : EINVAL;
+        pthread_mutex_unlock(&dest_lock);
+        return -1;
+      }
+      if (len > size) len = size;
+      memcpy(buf, ds->link, len);
+      pthread_mutex_unlock(&dest_lock);
+      return len;
+    }
+    pthread_mutex_unlock(&dest_lock);
+    return meta_readlink(AT_FDCWD, path, buf, size);
+  }
+  pthread_mutex_lock(&dest_lock);
+  ds = lookup_dest(path);
+  if (ds->err || !ds->link) {
+    errno = ds->err ? ds->err : EINVAL;
+    pthread_mutex_unlock(&dest_lock);
+    return -1;
+  }
+  if (ds->link_len < size) size = ds->link_len;
+  memcpy(buf, ds->link, size);
+  pthread_mutex_unlock(&dest_lock);
+  return size;
+}
+/*}}}*/
+static int stage_write(const char *path, mode_t mode, const char *target)/*{{{*/
+{
+  /* Stage making a link to 'target' or a directory at 'path', or removing
+   * what's there if 'mode' is 0, failing as the system call would. */
+  struct strtab_node *n;
+  struct dest_state *ds;
+  char *parent, *slash;
+  mode_t old, parent_mode;
+  int exists, parent_ok;
+
+  parent = new_string(path);
+  slash = strrchr(parent, '/');
+  if (slash) *slash = 0;
+  parent_ok = !slash || ((dest_lstat(parent, &parent_mode) == 0) && S_ISDIR(parent_mode));
+  free(parent);
+  exists = (dest_lstat(path, &old) == 0);
+  if (!parent_ok || (!mode && !exists)) {
+    errno = ENOENT;
+    return -1;
+  }
+  if (mode && exists) {
+    errno = EEXIST;
+    return -1;
+  }
+  if (!mode && S_ISDIR(old)) {
+    errno = EISDIR;
+    return -1;
+  }
+
+  pthread_mutex_lock(&dest_lock);
+  n = strtab_insert(staged, path);
+  ds = (struct dest_state *) n->value;
+  if (!ds) {
+    ds = new(struct dest_state);
+    n->value = ds;
+  } else if (ds->link) {
+    free(ds->link);
+  }
+  ds->err = mode ? 0 : ENOENT;
+  ds->mode = mode;
+  ds->link = target ? new_string(target) : NULL;
+  ds->link_len = target ? strlen(target) : 0;
+  pthread_mutex_unlock(&dest_lock);
+  return 0;
+}
+/*}}}*/
+static int dest_symlink(const char *target, const char *path)/*{{{*/
+{
+  double started;
+  int status;
+  if (staged) return stage_write(path, S_IFLNK | 0777, target);
+  count_call(OP_SYMLINK);
+  started = throttle_start();
+  status = symlink(target, path);
+  throttle_done(started);
+  dest_invalidate(path);
+  return status;
+}
+/*}}}*/
+static int dest_unlink(const char *path)/*{{{*/
+{
+  double started;
+  int status;
+  if (staged) return stage_write(path, 0, NULL);
+  count_call(OP_UNLINK);
+  started = throttle_start();
+  status = unlink(path);
+  throttle_done(started);
+  dest_invalidate(path);
+  return status;
+}
+/*}}}*/
+static int dest_mkdir(const char *path, mode_t mode)/*{{{*/
+{
+  double started;
+  int status;
+  if (staged) return stage_write(path, S_IFDIR | (mode & 07777), NULL);
+  count_call(OP_MKDIR);
+  started = throttle_start();
+  status = mkdir(path, mode);
+  throttle_done(started);
+  dest_invalidate(path);
+  return status;
+}
+/*}}}*/
+static int dest_batch(struct meta_req *reqs, int n)/*{{{*/
+{
+  /* Make a batch of writes (with full paths) to the link area together.
+   * Return -1, having done nothing, if they have to be made one at a time
+   * with the calls above. */
+  int i;
+  if (staged || (meta_batch(1, reqs, n) < 0)) return -1;
+  for (i=0; i<n; i++) dest_invalidate(reqs[i].path);
+  return 0;
+}
+/*}}}*/
+static char *dest_resolve(const char *path)/*{{{*/
+{
+  /* Where 'path' leads, following any links on the way that have only been
+   * staged (which the system can't), so that the result can be given to
+   * stat() and the like.  Staged links are relative to where they'd be, as
+   * spill made them, so they're resolved a name at a time. */
+  char *result = new_string(path);
+  int hops;
+  for (hops=0; staged && (hops < MAX_STAGED_HOPS); hops++) {
+    struct strtab_node *n;
+    struct dest_state *ds;
+    char *next, *slash;
+    pthread_mutex_lock(&dest_lock);
+    n = strtab_find(staged, result);
+    ds = n ? (struct dest_state *) n->value : NULL;
+    next = (ds && ds->link) ? new_string(ds->link) : NULL;
+    pthread_mutex_unlock(&dest_lock);
+    if (!next) break;
+    if (next[0] != '/') {
+      char *joined;
+      slash = strrchr(result, '/');
+      if (slash) *slash = 0;
+      joined = dfcaten(result, next);
+      free(next);
+      next = joined;
+      collapse_dots(next);
+    }
+    free(result);
+    result = next;
+  }
+  return result;
+}
+/*}}}*/
+/* With --hardlink or --reflink, regular files are put in the link area as
+ * hard links to the package's files, or as copies sharing their blocks,
+ * instead of as symlinks, so nothing using them has a link to follow.  A
+ * reflinked copy carries the path it was copied from in an extended
+ * attribute, which stands in for the text of a symlink, and the identity of
+ * the file it was copied from in another, so that a copy of a since-rebuilt
+ * file can be told from a current one.  A hard link can't carry anything the
+ * package's file doesn't, so the hard links an install makes are listed in
+ * its record (see record_install()), each with its inode, and are still known
+ * once the package's file has been replaced. */
+enum materialise {/*{{{*/
+  MAT_SYMLINK,
+  MAT_HARDLINK,
+  MAT_REFLINK
+};
+/*}}}*/
+static enum materialise materialise_mode = MAT_SYMLINK;
+static char *materialise_cwd = NULL; /* for making the recorded paths absolute */
+
+/* The hard links made since the install was last recorded, as "dev ino\tpath" */
+static char **new_hard_links = NULL;
+static int n_new_hard_links = 0;
+static int max_new_hard_links = 0;
+static pthread_mutex_t hard_link_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void source_stamp(const struct stat *sb, char *buf, int size)/*{{{*/
+{
+  /* What identifies the version of a file that was copied */
+  snprintf(buf, size, "%llu %llu %llu %lld %lld",
+           (unsigned long long) sb->st_dev, (unsigned long long) sb->st_ino,
+           (unsigned long long) sb->st_size,
+           (long long) sb->st_mtim.tv_sec, (long long) sb->st_mtim.tv_nsec);
+}
+/*}}}*/
+static void note_hard_link(const char *path, const struct stat *sb)/*{{{*/
+{
+  char *line = new_array(char, strlen(path) + 48);
+  sprintf(line, "%llu %llu\t%s", (unsigned long long) sb->st_dev, (unsigned long long) sb->st_ino, path);
+  pthread_mutex_lock(&hard_link_lock);
+  if (n_new_hard_links == max_new_hard_links) {
+    max_new_hard_links = max_new_hard_links ? (max_new_hard_links << 1) : 64;
+    new_hard_links = grow_array(char *, max_new_hard_links, new_hard_links);
+  }
+  new_hard_links[n_new_hard_links++] = line;
+  pthread_mutex_unlock(&hard_link_lock);
+}
+/*}}}*/
+
+static int reflink_file(const char *source, const struct stat *sb, const char *path)/*{{{*/
+{
+#ifdef FICLONE
+  char origin[PATH_MAX];
+  char stamp[128];
+  int in, out;
+  int status = 1;
+
+  if (source[0] == '/') {
+    snprintf(origin, sizeof(origin), "%s", source);
+  } else {
+    snprintf(origin, sizeof(origin), "%s/%s", materialise_cwd, source);
+  }
+  in = open(source, O_RDONLY);
+  if (in < 0) return 1;
+  out = open(path, O_WRONLY | O_CREAT | O_EXCL, sb->st_mode & 07777);
+  if (out < 0) {
+    close(in);
+    return -1;
+  }
+  source_stamp(sb, stamp, sizeof(stamp));
+  if ((ioctl(out, FICLONE, in) == 0) &&
+      (fsetxattr(out, ORIGIN_XATTR, origin, strlen(origin), 0) == 0) &&
+      (fsetxattr(out, SOURCE_XATTR, stamp, strlen(stamp), 0) == 0) &&
+      (fchmod(out, sb->st_mode & 07777) == 0)) {
+    status = 0;
+  }
+  close(in);
+  close(out);
+  /* Not cloneable, or the copy couldn't be marked as the package's */
+  if (status) unlink(path);
+  return status;
+#else
+  return 1;
+#endif
+}
+/*}}}*/
+static int dest_materialise(const char *source, const char *path)/*{{{*/
+{
+  /* Put a hard link to, or a reflinked copy of, 'source' at 'path'.  Return
+   * 0 if that was done, 1 if it isn't possible here (so a symlink should be
+   * made instead), or -1 with errno set if 'path' couldn't be created. */
+  struct stat sb;
+  double started;
+  int status;
+
+  if (materialise_mode == MAT_SYMLINK) return 1;
+  if ((meta_stat(AT_FDCWD, source, AT_SYMLINK_NOFOLLOW,
+                 STATX_MODE | STATX_INO | STATX_SIZE | STATX_MTIME, &sb) < 0) ||
+      !S_ISREG(sb.st_mode)) return 1;
+
+  started = throttle_start();
+  if (materialise_mode == MAT_REFLINK) {
+    status = reflink_file(source, &sb, path);
+  } else {
+    status = link(source, path);
+    if (status == 0) note_hard_link(path, &sb);
+    if (status < 0) {
+      switch (errno) {
+        case EXDEV: case EPERM: case EMLINK: case EOPNOTSUPP:
+          status = 1;
+          break;
+        default:
+          break;
+      }
+    }
+  }
+  throttle_done(started);
+  dest_invalidate(path);
+  return status;
+}
+/*}}}*/
+/*}}}*/
+
+static char *try_normalise_dir(const char *dir)/*{{{*/
+{
+  /* Given a relative path, find its absolute path when starting from pwd.
+   * NULL, having said why, if it can't be found. */
+  char startdir[PATH_MAX];
+  char srcdir[PATH_MAX];
+  int found;
+
+  if (getcwd(startdir, PATH_MAX) == NULL) {
+    fprintf(stderr, "Couldn't get start directory!\n");
+    return NULL;
+  }
+
+  if (chdir(dir) < 0) {
+    fprintf(stderr, "Couldn't cd to %s : %s!\n", dir, strerror(errno));
+    return NULL;
+  }
+
+  found = (getcwd(srcdir, PATH_MAX) != NULL);
+  if (!found) fprintf(stderr, "Couldn't read absolute src directory!\n");
+
+  if (chdir(startdir) < 0) {
+    fprintf(stderr, "Couldn't cd back to starting directory %s!\n", startdir);
+    return NULL;
+  }
+
+  return found ? new_string(srcdir) : NULL;
+
+}
+/*}}}*/
+static char *normalise_dir(const char *dir)/*{{{*/
+{
+  /* As try_normalise_dir(), for the command line, which gives up */
+  char *result = try_normalise_dir(dir);
+  if (!result) exit(1);
+  return result;
+}
+/*}}}*/
+static char *cleanup_dir(const char *dir)/*{{{*/
+{
+  /* Remove doubled / and trailing /, unless the / was the only char (i.e.
+   * install into /bin, /sbin etc) */
+  int len;
+  char *res;
+  int slash;
+  char *p;
+  const char *q;
+  len = strlen(dir);
+  res = new_array(char, len + 1);
+  p = res;
+  q = dir;
+  slash = 0;
+  while (*q) {
+    if (*q == '/') {
+      if (!slash) *p++ = *q;
+      slash = 1;
+    } else {
+      *p++ = *q;
+      slash = 0;
+    }
+    q++;
+  }
+  if (slash) p--;
+  *p = 0;
+  return res;
+}
+/*}}}*/
+static int check_sane(const char *tag, const char *dir)/*{{{*/
+{
+  /* Look at contents of directory, make sure the expected directories are present. */
+  struct dirlist *dl;
+  struct stat sb;
+  int has_bindir = 0;
+  int has_sbindir = 0;
+  int has_libdir = 0;
+  int i;
+
+  dl = read_dirlist(dir);
+  if (dl) {
+    for (i=0; i<dl->n; i++) {
+      const struct dir_entry *e = &dl->entries[i];
+      int is_dir;
+      if (strcmp(e->name, "bin") && strcmp(e->name, "sbin") && strcmp(e->name, "lib")) continue;
+      if (e->type == DT_DIR) {
+        is_dir = 1;
+      } else if ((e->type == DT_UNKNOWN) || (e->type == DT_LNK)) {
+        /* Links to directories count, as before */
+        char *full_path = dfcaten(dir, e->name);
+        is_dir = 0;
+        if (stat(full_path, &sb) < 0) {
+          fprintf(stderr, "Couldn't stat %s", full_path);
+        } else {
+          is_dir = S_ISDIR(sb.st_mode);
+        }
+        free(full_path);
+      } else {
+        is_dir = 0;
+      }
+      if (is_dir) {
+        has_bindir |= !strcmp(e->name, "bin");
+        has_sbindir |= !strcmp(e->name, "sbin");
+        has_libdir |= !strcmp(e->name, "lib");
+      }
+    }
+    free_dirlist(dl);
+  } else {
+    fprintf(stderr, "%s directory %s coudn't be opened.\n", tag, dir);
+    return 0;
+    exit(1);
+  }
+
+  if (!has_bindir && !has_libdir && !has_sbindir) {
+    fprintf(stderr, "%s directory %s doesn't have bin, sbin or lib subdirectory\n", tag, dir);
+    return 0;
+  }
+  return 1;
+}
+/*}}}*/
+static void extract_package_details(const char *src, char **pkg, char **version)/*{{{*/
+{
+  /* Given the path to the installation area, pull the final two pathname
+   * components out as the package and version+build */
+
+  const char *end, *s1, *s2;
+  end = src;
+  while (*end) end++;
+  s1 = end;
+  while ((s1 >= src) && (*s1 != '/')) s1--;
+  s2 = s1 - 1;
+  while ((s2 >= src) && (*s2 != '/')) s2--;
+
+  *pkg = new_array(char, (s1 - s2));
+  *version = new_array(char, (end - s1));
+
+  memcpy(*pkg, s2+1, s1-s2-1);
+  (*pkg)[s1-s2-1] = 0;
+
+  memcpy(*version, s1+1, end-s1);
+  return;
+
+}
+/*}}}*/
+/*{{{ Link prefixes */
+/* A link area directory's links mostly point into the same few package
+ * installs, so the package and version that each install path stands for are
+ * worked out once per run and kept, with the names interned so that they can
+ * be handed out and compared without copying.  Only used from the main
+ * thread, except by the --diff workers, which take diff_lock around it. */
+struct link_prefix {/*{{{*/
+  const char *pkg;
+  const char *version;
+};
+/*}}}*/
+static struct strtab *interned = NULL;
+static struct strtab *link_prefixes = NULL;
+
+static const char *intern(const char *s)/*{{{*/
+{
+  if (!interned) interned = new_strtab();
+  return strtab_insert(interned, s)->key;
+}
+/*}}}*/
+static const struct link_prefix *lookup_link_prefix(char *linkbuf, int prefix_len)/*{{{*/
+{
+  /* The package and version that the first 'prefix_len' characters of
+   * 'linkbuf' are the install path of.  'linkbuf' is cut short while the
+   * table is searched, so that a hit costs no copying. */
+  struct strtab_node *node;
+  struct link_prefix *lp;
+  char save;
+
+  if (!link_prefixes) link_prefixes = new_strtab();
+  save = linkbuf[prefix_len];
+  linkbuf[prefix_len] = 0;
+  node = strtab_find(link_prefixes, linkbuf);
+  if (!node) {
+    char *pkg, *version;
+    extract_package_details(linkbuf, &pkg, &version);
+    lp = new(struct link_prefix);
+    lp->pkg = intern(pkg);
+    lp->version = intern(version);
+    free(pkg);
+    free(version);
+    node = strtab_insert(link_prefixes, linkbuf);
+    node->value = lp;
+  }
+  linkbuf[prefix_len] = save;
+  return (const struct link_prefix *) node->value;
+}
+/*}}}*/
+static const struct link_prefix *decode_link_target(char *linkbuf, int link_len,/*{{{*/
+                                                    const char *tail_part, int tail_len)
+{
+  /* If the link target 'linkbuf' ends with 'tail_part', the part before it
+   * should be the path to the package base that the link points into.  Return
+   * the package and version from that, or NULL if the tail didn't match. */
+  if (tail_len > link_len) return NULL;
+  if (strcmp(tail_part, linkbuf + link_len - tail_len)) return NULL;
+  return lookup_link_prefix(linkbuf, link_len - tail_len);
+}
+/*}}}*/
+/*}}}*/
+
+/*{{{ Ignore rules */
+/* Paths not to link come from three places : ignore_path arguments, a
+ * .spillignore file at the top of the link area, which applies to every
+ * package installed there, and a .spillignore at the top of a package's own
+ * install tree.  Each file is compiled once per run into sorted tables of
+ * exact names, with anything containing wildcards kept aside for fnmatch(),
+ * and the compiled form is kept under .spill so later runs can skip the
+ * parsing until the file changes.
+ *
+ * A rule with a '/' in it (other than at the end) is a path relative to the
+ * top of the package; one without matches that name in any directory. */
+
+enum rule_kind {/*{{{*/
+  RK_PATH,      /* exact relative path */
+  RK_NAME,      /* exact name in any directory */
+  RK_PATH_GLOB, /* wildcard relative path */
+  RK_NAME_GLOB, /* wildcard name in any directory */
+  N_RULE_KINDS
+};
+/*}}}*/
+struct ignore_set {/*{{{*/
+  int n[N_RULE_KINDS];
+  int max[N_RULE_KINDS];
+  char **rules[N_RULE_KINDS]; /* exact kinds sorted, for bsearch */
+};
+/*}}}*/
+static const char rule_tags[N_RULE_KINDS] = { 'P', 'N', 'G', 'B' };
+
+/* From the command line */
+static struct ignore_set *arg_ignores = NULL;
+/* From the .spillignore of each package, keyed by install path.  A package
+ * without one maps to no_ignores. */
+static struct strtab *pkg_ignores = NULL;
+static struct ignore_set no_ignores;
+/* The pipeline's reader stage looks packages up from another thread */
+static pthread_mutex_t ignore_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Link area whose record directory holds the compiled rules, and whether
+ * they may be written there (not on a dry run, nor into a generation that's
+ * being built, which would go through to the live one) */
+static char *ignore_cache_area = NULL;
+static int ignore_cache_write = 0;
+
+static void add_rule(struct ignore_set *set, enum rule_kind kind, const char *rule)/*{{{*/
+{
+  /* Keeps the exact kinds in order as they're added, since the sets are only
+   * ever a few dozen rules long. */
+  int i;
+  if (set->n[kind] == set->max[kind]) {
+    set->max[kind] = set->max[kind] ? (set->max[kind] << 1) : 8;
+    set->rules[kind] = grow_array(char *, set->max[kind], set->rules[kind]);
+  }
+  i = set->n[kind];
+  if ((kind == RK_PATH) || (kind == RK_NAME)) {
+    for (; (i > 0) && (strcmp(set->rules[kind][i-1], rule) > 0); i--) {
+      set->rules[kind][i] = set->rules[kind][i-1];
+    }
+  }
+  set->rules[kind][i] = new_string(rule);
+  set->n[kind]++;
+}
+/*}}}*/
+static void free_ignore_set(struct ignore_set *set)/*{{{*/
+{
+  int k, i;
+  for (k=0; k<N_RULE_KINDS; k++) {
+    for (i=0; i<set->n[k]; i++) free(set->rules[k][i]);
+    if (set->rules[k]) free(set->rules[k]);
+  }
+  free(set);
+}
+/*}}}*/
+static void compile_rule(struct ignore_set *set, char *line)/*{{{*/
+{
+  char *start, *end;
+  int anchored, wild;
+
+  for (start=line; isspace((unsigned char) *start); start++) ;
+  for (end=start + strlen(start); (end > start) && isspace((unsigned char) end[-1]); end--) ;
+  *end = 0;
+  if (!*start || (*start == '#')) return;
+
+  /* A trailing slash just says it's a directory, which makes no difference */
+  while ((end > start + 1) && (end[-1] == '/')) *--end = 0;
+  anchored = (strchr(start, '/') != NULL);
+  while (*start == '/') start++;
+  if (!*start) return;
+  wild = (strpbrk(start, "*?[\\") != NULL);
+  if (anchored) {
+    add_rule(set, wild ? RK_PATH_GLOB : RK_PATH, start);
+  } else {
+    add_rule(set, wild ? RK_NAME_GLOB : RK_NAME, start);
+  }
+}
+/*}}}*/
+static struct ignore_set *read_ignore_cache(const char *cache_path, const struct stat *sb)/*{{{*/
+{
+  /* The first line of the cache identifies the .spillignore it was compiled
+   * from; each line after is a tag (see rule_tags) and a rule, already in
+   * order. */
+  FILE *in;
+  char line[PATH_MAX + 4];
+  unsigned long long dev, ino, size;
+  long long mtime, mtime_ns;
+  struct ignore_set *set;
+
+  in = fopen(cache_path, "r");
+  if (!in) return NULL;
+  if (!fgets(line, sizeof(line), in) ||
+      (sscanf(line, "spillignore %llu %llu %llu %lld %lld",
+              &dev, &ino, &size, &mtime, &mtime_ns) != 5) ||
+      (dev != (unsigned long long) sb->st_dev) ||
+      (ino != (unsigned long long) sb->st_ino) ||
+      (size != (unsigned long long) sb->st_size) ||
+      (mtime != (long long) sb->st_mtim.tv_sec) ||
+      (mtime_ns != (long long) sb->st_mtim.tv_nsec)) {
+    fclose(in);
+    return NULL;
+  }
+  set = new(struct ignore_set);
+  memset(set, 0, sizeof(struct ignore_set));
+  while (fgets(line, sizeof(line), in)) {
+    int len = strlen(line);
+    int k;
+    if ((len > 0) && (line[len-1] == '\n')) line[--len] = 0;
+    if ((len < 3) || (line[1] != ' ')) continue;
+    for (k=0; k<N_RULE_KINDS; k++) {
+      if (line[0] == rule_tags[k]) {
+        add_rule(set, (enum rule_kind) k, line + 2);
+        break;
+      }
+    }
+  }
+  fclose(in);
+  return set;
+}
+/*}}}*/
+static void write_ignore_cache(const char *cache_path, const struct stat *sb,/*{{{*/
+                               const struct ignore_set *set)
+{
+  /* Written alongside and renamed into place, so a reader never sees half of
+   * it.  Failing to write it just means compiling again next time. */
+  char suffix[32];
+  char *tmp_path;
+  FILE *out;
+  int k, i;
+
+  sprintf(suffix, ".tmp%ld", (long) getpid());
+  tmp_path = caten(cache_path, suffix);
+  out = fopen(tmp_path, "w");
+  if (out) {
+    fprintf(out, "spillignore %llu %llu %llu %lld %lld\n",
+            (unsigned long long) sb->st_dev, (unsigned long long) sb->st_ino,
+            (unsigned long long) sb->st_size,
+            (long long) sb->st_mtim.tv_sec, (long long) sb->st_mtim.tv_nsec);
+    for (k=0; k<N_RULE_KINDS; k++) {
+      for (i=0; i<set->n[k]; i++) fprintf(out, "%c %s\n", rule_tags[k], set->rules[k][i]);
+    }
+    if ((fclose(out) != 0) || (rename(tmp_path, cache_path) < 0)) unlink(tmp_path);
+  }
+  free(tmp_path);
+}
+/*}}}*/
+static char *ignore_cache_path(const char *dest_path, const char *pkg)/*{{{*/
+{
+  /* Where the compiled rules for 'pkg' (or the link area's own, if NULL)
+   * are kept */
+  char *name, *result;
+  name = pkg ? caten(IGNORE_CACHE ".", pkg) : new_string(IGNORE_CACHE);
+  result = dfcaten3(dest_path, RECORD_DIR, name);
+  free(name);
+  return result;
+}
+/*}}}*/
+static struct ignore_set *load_ignore_file(const char *dir, const char *pkg)/*{{{*/
+{
+  /* Compile the .spillignore at the top of 'dir', or fetch the compiled form
+   * from the cache if it's still current.  NULL if there's no such file. */
+  struct stat sb;
+  struct ignore_set *set;
+  char *path, *cache_path;
+  FILE *in;
+  char line[PATH_MAX + 2];
+
+  path = dfcaten(dir, IGNORE_FILE);
+  if ((stat(path, &sb) < 0) || !S_ISREG(sb.st_mode)) {
+    free(path);
+    return NULL;
+  }
+  cache_path = ignore_cache_area ? ignore_cache_path(ignore_cache_area, pkg) : NULL;
+  set = cache_path ? read_ignore_cache(cache_path, &sb) : NULL;
+  if (!set) {
+    in = fopen(path, "r");
+    if (!in) {
+      fprintf(stderr, "Could not read %s : %s\n", path, strerror(errno));
+    } else {
+      set = new(struct ignore_set);
+      memset(set, 0, sizeof(struct ignore_set));
+      while (fgets(line, sizeof(line), in)) compile_rule(set, line);
+      fclose(in);
+      if (cache_path && ignore_cache_write) write_ignore_cache(cache_path, &sb, set);
+    }
+  }
+  if (cache_path) free(cache_path);
+  free(path);
+  return set;
+}
+/*}}}*/
+static void save_ignore_cache(const char *dir, const char *pkg, const struct ignore_set *set)/*{{{*/
+{
+  /* Keep the compiled form of 'set', which was loaded from 'dir' without
+   * being written, unless what's kept already matches the file. */
+  struct stat sb;
+  struct ignore_set *cached;
+  char *path, *cache_path;
+
+  if (!set || (set == &no_ignores) || !ignore_cache_area) return;
+  path = dfcaten(dir, IGNORE_FILE);
+  if ((stat(path, &sb) == 0) && S_ISREG(sb.st_mode)) {
+    cache_path = ignore_cache_path(ignore_cache_area, pkg);
+    cached = read_ignore_cache(cache_path, &sb);
+    if (cached) {
+      free_ignore_set(cached);
+    } else {
+      write_ignore_cache(cache_path, &sb, set);
+    }
+    free(cache_path);
+  }
+  free(path);
+}
+/*}}}*/
+static void add_ignore(char *path)/*{{{*/
+{
+  /* Arguments are taken literally, wildcards and all */
+  if (!arg_ignores) {
+    arg_ignores = new(struct ignore_set);
+    memset(arg_ignores, 0, sizeof(struct ignore_set));
+  }
+  add_rule(arg_ignores, RK_PATH, path);
+}
+/*}}}*/
+static struct ignore_set *load_area_ignores(const char *dest_path, int first, int may_write)/*{{{*/
+{
+  /* The default rules of link area 'dest_path', which only apply to what's
+   * linked into that area (NULL if it has none).  The first area in the run
+   * is where compiled rules are kept. */
+  if (first) {
+    ignore_cache_area = new_string(dest_path);
+    ignore_cache_write = may_write;
+  }
+  return load_ignore_file(dest_path, NULL);
+}
+/*}}}*/
+static const struct ignore_set *package_ignores(const char *src)/*{{{*/
+{
+  /* The rules from the package installed at 'src', loaded the first time
+   * they're asked for. */
+  struct strtab_node *node;
+  struct ignore_set *set;
+  char *pkg, *version;
+
+  pthread_mutex_lock(&ignore_lock);
+  if (!pkg_ignores) pkg_ignores = new_strtab();
+  node = strtab_find(pkg_ignores, src);
+  if (!node) {
+    extract_package_details(src, &pkg, &version);
+    set = load_ignore_file(src, pkg);
+    free(pkg);
+    free(version);
+    node = strtab_insert(pkg_ignores, src);
+    node->value = set ? set : &no_ignores;
+  }
+  pthread_mutex_unlock(&ignore_lock);
+  return (const struct ignore_set *) node->value;
+}
+/*}}}*/
+static int compare_rule(const void *a, const void *b)/*{{{*/
+{
+  return strcmp((const char *) a, *(char * const *) b);
+}
+/*}}}*/
+static int match_ignore_set(const struct ignore_set *set, const char *path, const char *name)/*{{{*/
+{
+  int i;
+  if (set->n[RK_PATH] &&
+      bsearch(path, set->rules[RK_PATH], set->n[RK_PATH], sizeof(char *), compare_rule)) return 1;
+  if (set->n[RK_NAME] &&
+      bsearch(name, set->rules[RK_NAME], set->n[RK_NAME], sizeof(char *), compare_rule)) return 1;
+  for (i=0; i<set->n[RK_PATH_GLOB]; i++) {
+    if (!fnmatch(set->rules[RK_PATH_GLOB][i], path, FNM_PATHNAME)) return 1;
+  }
+  for (i=0; i<set->n[RK_NAME_GLOB]; i++) {
+    if (!fnmatch(set->rules[RK_NAME_GLOB][i], name, 0)) return 1;
+  }
+  return 0;
+}
+/*}}}*/
+static int check_ignore(const struct ignore_set *pkg_set, const struct ignore_set *area_set,/*{{{*/
+                        const char *head, const char *tail)
+{
+  /* Whether to leave out entry 'tail' of directory 'head' (relative to the
+   * top of the package whose rules are 'pkg_set') when linking it into the
+   * link area whose rules are 'area_set'.  Only the arguments count if
+   * 'pkg_set' is NULL. */
+  int len;
+  char *path;
+  int result;
+
+  /* The package's own rules are never linked */
+  if (!head[0] && !strcmp(tail, IGNORE_FILE)) return 1;
+
+  /* Early out */
+  if (!arg_ignores && (!pkg_set || (!area_set && (pkg_set == &no_ignores)))) return 0;
+
+  /* If 'head' starts with a '/', we drop it.  We put a '/' between head and
+   * tail.  */
+  len = strlen(head) + strlen(tail) + 2;
+  path = new_array(char, len);
+  if (head[0] == '/') {
+    strcpy(path, head + 1);
+  } else {
+    strcpy(path, head);
+  }
+  if (head[0] != '\0') {
+    strcat(path, "/");
+  }
+  strcat(path, tail);
+  result = (arg_ignores && match_ignore_set(arg_ignores, path, tail)) ||
+           (pkg_set && match_ignore_set(pkg_set, path, tail)) ||
+           (pkg_set && area_set && match_ignore_set(area_set, path, tail));
+
+  free(path);
+  return result;
+}
+/*}}}*/
+/*}}}*/
+
+struct options {/*{{{*/
+  unsigned quiet:1;
+  unsigned dry_run:1;
+  unsigned expand:1;
+  unsigned force:1;
+  unsigned override:1;
+};
+/*}}}*/
+enum source_type {/*{{{*/
+  ST_ERROR,
+  ST_DIR,
+  ST_OTHER
+};
+/*}}}*/
+enum dest_type {/*{{{*/
+  DT_VOID,              /* nothing there */
+  DT_ERROR,             /* some error examining it */
+  DT_LINK_EXACT,        /* readlink(dest) identical with source */
+  DT_LINK_SAME_SAME,    /* readlink(dest) appears to link to same version of
+                           same package as source, but installed elsewhere (or
+                           with a different representation of the same path.)
+                           NOTE .. don't check (dev,inode) to see if it's
+                           LINK_EXACT, because the user might want to replace
+                           the package with relative links to replace absolute
+                           etc.
+                           */
+  DT_LINK_SAME_OTHER,   /* link to same package, other version */
+  DT_LINK_OTHER_DIR,    /* link to directory in something else */
+  DT_LINK_OTHER_FILE,   /* link to file/dev/fifo/socket in something else */
+  DT_LINK_UNKNOWN,      /* link to something, readlink() doesn't have right format. */
+  DT_DIRECTORY,         /* directory */
+  DT_OTHER              /* file, device, fifo, socket etc */
+};
+/*}}}*/
+enum action {/*{{{*/
+  ACT_PRE_INSTALL,      /* check what installing would do */
+  ACT_INSTALL,
+  ACT_SOFT_DELETE,      /* remove the package's links */
+  ACT_LIST_OWNED        /* print the package's links */
+};
+/*}}}*/
+#define N_ACTIONS (ACT_LIST_OWNED + 1)
+
+static int descend(const char *rel_path, const char *tail);
+
+/*{{{ Source listings */
+/* Each source directory is listed and its entries classified once per run,
+ * however many times it's walked : by the pre-install check and the install,
+ * and again for each extra link area. */
+struct src_entry {/*{{{*/
+  const char *name;     /* points into dl */
+  enum source_type type;
+};
+/*}}}*/
+struct src_listing {/*{{{*/
+  int n;
+  struct src_entry *entries; /* sorted by name */
+  struct dirlist *dl;
+};
+/*}}}*/
+static struct strtab *src_listings = NULL;
+/* The pipeline's reader stage fills the table from another thread */
+static pthread_mutex_t src_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void free_src_listing(struct src_listing *l)/*{{{*/
+{
+  if (l->entries) free(l->entries);
+  free_dirlist(l->dl);
+  free(l);
+}
+/*}}}*/
+static struct src_listing *read_src_listing(const char *full_src)/*{{{*/
+{
+  /* Return NULL if the directory can't be opened */
+  struct strtab_node *node;
+  struct src_listing *l;
+  struct dirlist *dl;
+  struct ino_order *order;
+  int n_order;
+  int dir_fd;
+  int i;
+
+  pthread_mutex_lock(&src_lock);
+  if (!src_listings) src_listings = new_strtab();
+  node = strtab_find(src_listings, full_src);
+  pthread_mutex_unlock(&src_lock);
+  if (node) return (struct src_listing *) node->value;
+
+  dl = read_dirlist(full_src);
+  if (!dl) return NULL;
+
+  l = new(struct src_listing);
+  l->dl = dl;
+  l->n = dl->n;
+  l->entries = new_array(struct src_entry, dl->n + 1);
+  order = new_array(struct ino_order, dl->n + 1);
+  n_order = 0;
+  for (i=0; i<dl->n; i++) {
+    struct src_entry *e = l->entries + i;
+    e->name = dl->entries[i].name;
+
+    /* See what kind of a thing the installed entity is.  The directory
+     * entry usually says, which saves an lstat. */
+    switch (dl->entries[i].type) {
+      case DT_DIR:
+        e->type = ST_DIR;
+        break;
+      case DT_UNKNOWN:
+        order[n_order].ino = dl->entries[i].ino;
+        order[n_order].index = i;
+        n_order++;
+        break;
+      default:
+        e->type = ST_OTHER;
+        break;
+    }
+  }
+  /* Where it doesn't, stat in inode order, by name within the directory
+   * rather than by path from the top */
+  if (n_order > 1) qsort(order, n_order, sizeof(struct ino_order), compare_ino_order);
+  dir_fd = n_order ? open(full_src[0] ? full_src : "/", O_RDONLY | O_DIRECTORY) : -1;
+  if ((dir_fd >= 0) && (n_order > 1)) {
+    struct meta_req *reqs = new_array(struct meta_req, n_order);
+    memset(reqs, 0, n_order * sizeof(struct meta_req));
+    for (i=0; i<n_order; i++) {
+      reqs[i].op = OP_LSTAT;
+      reqs[i].dir_fd = dir_fd;
+      reqs[i].path = l->entries[order[i].index].name;
+      reqs[i].mask = STATX_TYPE;
+    }
+    if (meta_batch(0, reqs, n_order) == 0) {
+      for (i=0; i<n_order; i++) {
+        struct src_entry *e = l->entries + order[i].index;
+        if (reqs[i].err) e->type = ST_ERROR;
+        else e->type = S_ISDIR(reqs[i].mode) ? ST_DIR : ST_OTHER;
+      }
+      n_order = 0;
+    }
+    free(reqs);
+  }
+  for (i=0; i<n_order; i++) {
+    struct src_entry *e = l->entries + order[i].index;
+    struct stat ssb;
+    int status;
+    if (dir_fd >= 0) {
+      status = meta_stat(dir_fd, e->name, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &ssb);
+    } else {
+      char *full_src_path = dfcaten(full_src, e->name);
+      status = meta_stat(AT_FDCWD, full_src_path, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &ssb);
+      free(full_src_path);
+    }
+    if (status < 0) {
+      e->type = ST_ERROR;
+    } else {
+      e->type = (S_ISDIR(ssb.st_mode)) ? ST_DIR : ST_OTHER;
+    }
+  }
+  if (dir_fd >= 0) close(dir_fd);
+  free(order);
+
+  pthread_mutex_lock(&src_lock);
+  node = strtab_insert(src_listings, full_src);
+  if (node->value) {
+    /* Another thread got there first */
+    free_src_listing(l);
+    l = (struct src_listing *) node->value;
+  } else {
+    node->value = l;
+  }
+  pthread_mutex_unlock(&src_lock);
+  return l;
+}
+/*}}}*/
+static void drop_src_listing(const char *full_src)/*{{{*/
+{
+  /* Forget the listing of 'full_src', for a walk that won't need it again */
+  struct src_listing *l = NULL;
+  pthread_mutex_lock(&src_lock);
+  if (src_listings) l = (struct src_listing *) strtab_remove(src_listings, full_src);
+  pthread_mutex_unlock(&src_lock);
+  if (l) free_src_listing(l);
+}
+/*}}}*/
+static void drop_all_src_listings(void)/*{{{*/
+{
+  /* Forget every listing, when there's no telling which are out of date */
+  int i;
+  pthread_mutex_lock(&src_lock);
+  for (i=0; src_listings && (i<src_listings->size); i++) {
+    struct strtab_node *n;
+    for (n = src_listings->buckets[i]; n; n = n->next) {
+      if (n->value) free_src_listing((struct src_listing *) n->value);
+    }
+  }
+  if (src_listings) strtab_free(src_listings);
+  src_listings = NULL;
+  pthread_mutex_unlock(&src_lock);
+}
+/*}}}*/
+/*}}}*/
+/*{{{ Install pipeline */
+/* With --pipeline, walking the trees runs as three overlapping stages.  A
+ * reader thread works ahead through the package, listing its directories and
+ * looking up the matching paths in the link area, so that they're already
+ * cached by the time they're wanted.  The main thread classifies each entry
+ * and decides what to do with it, as before.  During the install pass, the
+ * links it decides on are queued for a writer thread along with everything it
+ * prints, so the output comes out in the usual order.  Both stages are
+ * bounded, so that neither end gets far ahead of the other.  With --io-uring,
+ * the reader looks at each directory's entries as one batch, and the writer
+ * makes what's been queued as one batch. */
+
+#define READ_AHEAD 64        /* directories the reader may be ahead by */
+#define WRITE_QUEUE_SIZE 1024
+#define WRITE_BATCH 128      /* queued writes made together with --io-uring */
+
+static int pipelining = 0;
+
+enum write_kind {/*{{{*/
+  WK_MESSAGE,   /* just print the message */
+  WK_LINK,      /* create a symlink */
+  WK_RELINK     /* remove an existing link, then create a symlink */
+};
+/*}}}*/
+struct write_op {/*{{{*/
+  enum write_kind kind;
+  int override;     /* affects the wording of failure messages */
+  char *target;
+  char *source;     /* set if the link may be materialised from this file */
+  char *path;
+  char *message;    /* printed once the op has succeeded, may be NULL */
+};
+/*}}}*/
+
+static pthread_mutex_t pl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pl_read_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pl_not_full = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pl_not_empty = PTHREAD_COND_INITIALIZER;
+
+static struct {/*{{{*/
+  const char *src;
+  const char *dest;
+  const struct ignore_set *area_set;
+  int fetched;    /* directories the reader has started on */
+  int visited;    /* directories the main thread has started on */
+  int stop;
+  pthread_t reader;
+
+  int writing;    /* set while there's a writer thread */
+  struct write_op queue[WRITE_QUEUE_SIZE];
+  int head;
+  int count;
+  int closed;
+  int errors;
+  int links;
+  pthread_t writer;
+} pl;
+/*}}}*/
+
+static int reader_batch(const char *tail, const char *full_dest, const struct src_listing *l,/*{{{*/
+                        const struct ignore_set *pkg_set, char *is_dir)
+{
+  /* reader_visit()'s look at a directory, as one batch of stats.  Return -1,
+   * having done nothing, if that can't be done. */
+  struct meta_req *reqs;
+  int *index;
+  int dir_fd;
+  int n = 0;
+  int i;
+
+  if (!use_uring || staged || dest_cache) return -1;
+  dir_fd = open(full_dest[0] ? full_dest : "/", O_RDONLY | O_DIRECTORY);
+  if (dir_fd < 0) return -1;
+  reqs = new_array(struct meta_req, l->n + 1);
+  index = new_array(int, l->n + 1);
+  for (i=0; i<l->n; i++) {
+    is_dir[i] = 0;
+    if (check_ignore(pkg_set, pl.area_set, tail, l->entries[i].name)) continue;
+    memset(&reqs[n], 0, sizeof(struct meta_req));
+    reqs[n].op = OP_LSTAT;
+    reqs[n].dir_fd = dir_fd;
+    reqs[n].path = l->entries[i].name;
+    reqs[n].mask = STATX_TYPE;
+    index[n++] = i;
+  }
+  if (meta_batch(0, reqs, n) < 0) {
+    free(index);
+    free(reqs);
+    close(dir_fd);
+    return -1;
+  }
+  for (i=0; i<n; i++) {
+    if (reqs[i].err) continue;
+    if (S_ISLNK(reqs[i].mode)) {
+      char linkbuf[PATH_MAX];
+      meta_readlink(dir_fd, reqs[i].path, linkbuf, sizeof(linkbuf));
+    } else if (S_ISDIR(reqs[i].mode) && (l->entries[index[i]].type == ST_DIR)) {
+      is_dir[index[i]] = 1;
+    }
+  }
+  free(index);
+  free(reqs);
+  close(dir_fd);
+  return 0;
+}
+/*}}}*/
+struct reader_frame {/*{{{*/
+  char *tail;
+  struct src_listing *l;
+  char *is_dir;         /* which entries the walk will go into */
+  int next;             /* index of the next entry to try */
+};
+/*}}}*/
+static int reader_visit(struct reader_frame *f, char *tail)/*{{{*/
+{
+  /* Look at everything in directory 'tail' (taking it over) before going
+   * into any of its subdirectories, since that's the order the main thread
+   * will need them in, and set up 'f' for going on into them.  Return 0 if
+   * the pipeline is being stopped. */
+  struct src_listing *l;
+  const struct ignore_set *pkg_set;
+  char *full_src, *full_dest;
+  char *is_dir;
+  int stop;
+  int i;
+
+  pthread_mutex_lock(&pl_lock);
+  pl.fetched++;
+  while (!pl.stop && (pl.fetched - pl.visited > READ_AHEAD)) {
+    pthread_cond_wait(&pl_read_cond, &pl_lock);
+  }
+  stop = pl.stop;
+  pthread_mutex_unlock(&pl_lock);
+  if (stop) {
+    free(tail);
+    return 0;
+  }
+
+  pkg_set = package_ignores(pl.src);
+  full_src = caten(pl.src, tail);
+  full_dest = caten(pl.dest, tail);
+  l = read_src_listing(full_src);
+  is_dir = NULL;
+  if (l) {
+    is_dir = new_array(char, l->n + 1);
+    if (reader_batch(tail, full_dest, l, pkg_set, is_dir) < 0) {
+      for (i=0; i<l->n; i++) {
+        char *path;
+        char linkbuf[PATH_MAX];
+        mode_t mode;
+
+        is_dir[i] = 0;
+        if (check_ignore(pkg_set, pl.area_set, tail, l->entries[i].name)) continue;
+        path = dfcaten(full_dest, l->entries[i].name);
+        if (dest_lstat(path, &mode) == 0) {
+          if (S_ISLNK(mode)) {
+            dest_readlink(path, linkbuf, sizeof(linkbuf));
+          } else if (S_ISDIR(mode) && (l->entries[i].type == ST_DIR)) {
+            is_dir[i] = 1;
+          }
+        }
+        free(path);
+      }
+    }
+  }
+  free(full_src);
+  free(full_dest);
+  f->tail = tail;
+  f->l = l;
+  f->is_dir = is_dir;
+  f->next = 0;
+  return 1;
+}
+/*}}}*/
+static void reader_walk(void)/*{{{*/
+{
+  /* Work through the package a directory at a time, in the order the main
+   * thread's walk goes, keeping a stack of the directories on the way down. */
+  struct reader_frame *frames;
+  int n = 0, max = 16;
+
+  frames = new_array(struct reader_frame, max);
+  if (reader_visit(&frames[0], new_string(""))) n = 1;
+  while (n > 0) {
+    struct reader_frame *f = frames + n - 1;
+    char *new_tail;
+    while (f->l && (f->next < f->l->n) && !f->is_dir[f->next]) f->next++;
+    if (!f->l || (f->next == f->l->n)) {
+      if (f->is_dir) free(f->is_dir);
+      free(f->tail);
+      n--;
+      continue;
+    }
+    new_tail = dfcaten(f->tail, f->l->entries[f->next++].name);
+    if (n == max) {
+      max <<= 1;
+      frames = grow_array(struct reader_frame, max, frames);
+    }
+    if (!reader_visit(&frames[n], new_tail)) {
+      /* Stopping : let go of the whole stack */
+      while (n > 0) {
+        f = frames + --n;
+        if (f->is_dir) free(f->is_dir);
+        free(f->tail);
+      }
+      break;
+    }
+    n++;
+  }
+  free(frames);
+}
+/*}}}*/
+static void *reader_main(void *arg)/*{{{*/
+{
+  reader_walk();
+  return NULL;
+}
+/*}}}*/
+static void pipeline_visit(void)/*{{{*/
+{
+  /* The main thread has reached another directory */
+  pthread_mutex_lock(&pl_lock);
+  pl.visited++;
+  pthread_cond_signal(&pl_read_cond);
+  pthread_mutex_unlock(&pl_lock);
+}
+/*}}}*/
+static void unlink_failed(const struct write_op *op, int err)/*{{{*/
+{
+  if (op->override) {
+    printf("!! FAILED : can't remove old link <%s> : <%s>\n", op->path, strerror(err));
+  } else {
+    printf("!! FAILED : can't remove old link <%s> : %s\n", op->path, strerror(err));
+  }
+}
+/*}}}*/
+static void link_failed(const struct write_op *op, const char *what, int err)/*{{{*/
+{
+  printf("!! FAILED : can't create %s%s from <%s> to <%s> : %s\n",
+         op->override ? "override " : "", what, op->path, op->target, strerror(err));
+}
+/*}}}*/
+static int perform_write(struct write_op *op, int *links)/*{{{*/
+{
+  const char *what = "symlink";
+  int status;
+
+  switch (op->kind) {
+    case WK_MESSAGE:
+      break;
+    case WK_RELINK:
+      if (dest_unlink(op->path) < 0) {
+        unlink_failed(op, errno);
+        return 1;
+      }
+      /* fall through */
+    case WK_LINK:
+      status = op->source ? dest_materialise(op->source, op->path) : 1;
+      if (status <= 0) {
+        what = (materialise_mode == MAT_HARDLINK) ? "hard link" : "reflink";
+      } else {
+        status = dest_symlink(op->target, op->path);
+      }
+      if (status < 0) {
+        link_failed(op, what, errno);
+        return 1;
+      }
+      (*links)++;
+      break;
+  }
+  if (op->message) fputs(op->message, stdout);
+  return 0;
+}
+/*}}}*/
+static int symlink_only(const struct write_op *op)/*{{{*/
+{
+  return (op->kind != WK_MESSAGE) && (!op->source || (materialise_mode == MAT_SYMLINK));
+}
+/*}}}*/
+static int perform_writes(struct write_op *ops, int n, int *links)/*{{{*/
+{
+  /* Carry out 'n' queued writes, returning how many failed.  The plain
+   * symlinks among them go to the kernel as one batch if they can, then
+   * everything is reported in order. */
+  struct meta_req *reqs;
+  int *first;   /* each op's first request, -1 if it isn't in the batch */
+  int n_reqs = 0, errors = 0;
+  int batched;
+  int i;
+
+  reqs = new_array(struct meta_req, 2 * n);
+  first = new_array(int, n);
+  for (i=0; i<n; i++) {
+    struct write_op *op = &ops[i];
+    first[i] = -1;
+    if (!symlink_only(op)) continue;
+    first[i] = n_reqs;
+    if (op->kind == WK_RELINK) {
+      memset(&reqs[n_reqs], 0, sizeof(struct meta_req));
+      reqs[n_reqs].op = OP_UNLINK;
+      reqs[n_reqs].dir_fd = AT_FDCWD;
+      reqs[n_reqs].path = op->path;
+      reqs[n_reqs].chain = 1;
+      n_reqs++;
+    }
+    memset(&reqs[n_reqs], 0, sizeof(struct meta_req));
+    reqs[n_reqs].op = OP_SYMLINK;
+    reqs[n_reqs].dir_fd = AT_FDCWD;
+    reqs[n_reqs].path = op->path;
+    reqs[n_reqs].target = op->target;
+    n_reqs++;
+  }
+  batched = (n_reqs > 1) && (dest_batch(reqs, n_reqs) == 0);
+
+  for (i=0; i<n; i++) {
+    struct write_op *op = &ops[i];
+    const struct meta_req *req;
+    if (!batched || (first[i] < 0)) {
+      errors += perform_write(op, links);
+      continue;
+    }
+    req = &reqs[first[i]];
+    if (req->op == OP_UNLINK) {
+      if (req->err) {
+        unlink_failed(op, req->err);
+        errors++;
+        continue;
+      }
+      req++;
+    }
+    if (req->err) {
+      link_failed(op, "symlink", req->err);
+      errors++;
+      continue;
+    }
+    (*links)++;
+    if (op->message) fputs(op->message, stdout);
+  }
+  free(first);
+  free(reqs);
+  return errors;
+}
+/*}}}*/
+static void *writer_main(void *arg)/*{{{*/
+{
+  /* Take whatever has been queued, up to a batch at a time */
+  struct write_op ops[WRITE_BATCH];
+  int n, i;
+  for (;;) {
+    pthread_mutex_lock(&pl_lock);
+    while (!pl.count && !pl.closed) pthread_cond_wait(&pl_not_empty, &pl_lock);
+    if (!pl.count) {
+      pthread_mutex_unlock(&pl_lock);
+      break;
+    }
+    n = use_uring ? ((pl.count < WRITE_BATCH) ? pl.count : WRITE_BATCH) : 1;
+    for (i=0; i<n; i++) {
+      ops[i] = pl.queue[pl.head];
+      pl.head = (pl.head + 1) % WRITE_QUEUE_SIZE;
+    }
+    pl.count -= n;
+    pthread_cond_signal(&pl_not_full);
+    pthread_mutex_unlock(&pl_lock);
+
+    pl.errors += (n > 1) ? perform_writes(ops, n, &pl.links) : perform_write(&ops[0], &pl.links);
+    for (i=0; i<n; i++) {
+      if (ops[i].target) free(ops[i].target);
+      if (ops[i].source) free(ops[i].source);
+      if (ops[i].path) free(ops[i].path);
+      if (ops[i].message) free(ops[i].message);
+    }
+  }
+  return NULL;
+}
+/*}}}*/
+static int install_link(enum write_kind kind, int override, const char *target,/*{{{*/
+                        const char *source, const char *path, char *message)
+{
+  /* Carry out (or with a writer thread, queue) one of the install's writes.
+   * 'message' is taken over.  A queued write always 'succeeds' here; any
+   * failure is counted by pipeline_finish(). */
+  struct write_op op;
+  int result;
+
+  if (!pl.writing) {
+    op.kind = kind;
+    op.override = override;
+    op.target = (char *) target;
+    op.source = (char *) source;
+    op.path = (char *) path;
+    op.message = message;
+    result = perform_write(&op, &install_counts.links);
+    if (message) free(message);
+    return result;
+  }
+
+  pthread_mutex_lock(&pl_lock);
+  while (pl.count == WRITE_QUEUE_SIZE) pthread_cond_wait(&pl_not_full, &pl_lock);
+  op.kind = kind;
+  op.override = override;
+  op.target = target ? new_string(target) : NULL;
+  op.source = source ? new_string(source) : NULL;
+  op.path = path ? new_string(path) : NULL;
+  op.message = message;
+  pl.queue[(pl.head + pl.count) % WRITE_QUEUE_SIZE] = op;
+  pl.count++;
+  pthread_cond_signal(&pl_not_empty);
+  pthread_mutex_unlock(&pl_lock);
+  return 0;
+}
+/*}}}*/
+static char *format_message(const char *fmt, ...)/*{{{*/
+{
+  va_list ap;
+  char *result;
+  int len;
+  va_start(ap, fmt);
+  len = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  result = new_array(char, len + 1);
+  va_start(ap, fmt);
+  vsnprintf(result, len + 1, fmt, ap);
+  va_end(ap);
+  return result;
+}
+/*}}}*/
+static void pipeline_start(const char *src, const char *dest,/*{{{*/
+                           const struct ignore_set *area_set, int writes)
+{
+  /* Start the reader stage (and the writer stage, for the install pass) for a
+   * walk over src and dest, leaving out what the walk will. */
+  if (!pipelining) return;
+  pl.src = src;
+  pl.dest = dest;
+  pl.area_set = area_set;
+  pl.fetched = pl.visited = pl.stop = 0;
+  if (pthread_create(&pl.reader, NULL, reader_main, NULL)) {
+    fprintf(stderr, "Couldn't start the reader thread, carrying on without it\n");
+    pl.stop = 1;
+  }
+  if (writes) {
+    pl.head = pl.count = pl.closed = 0;
+    pl.errors = pl.links = 0;
+    fflush(stdout);
+    if (pthread_create(&pl.writer, NULL, writer_main, NULL) == 0) {
+      pl.writing = 1;
+    } else {
+      fprintf(stderr, "Couldn't start the writer thread, carrying on without it\n");
+    }
+  }
+}
+/*}}}*/
+static int pipeline_finish(void)/*{{{*/
+{
+  /* Wait for the stages to finish, and return the number of queued writes
+   * that failed. */
+  int had_reader;
+  if (!pipelining) return 0;
+  pthread_mutex_lock(&pl_lock);
+  had_reader = !pl.stop;
+  pl.stop = 1;
+  pl.closed = 1;
+  pthread_cond_broadcast(&pl_read_cond);
+  pthread_cond_broadcast(&pl_not_empty);
+  pthread_mutex_unlock(&pl_lock);
+  if (had_reader) pthread_join(pl.reader, NULL);
+  if (pl.writing) {
+    pthread_join(pl.writer, NULL);
+    pl.writing = 0;
+    install_counts.links += pl.links;
+    fflush(stdout);
+    return pl.errors;
+  }
+  return 0;
+}
+/*}}}*/
+/*}}}*/
+/*{{{ Generations */
+/* In generation mode the link area is itself a symbolic link, pointing at one
+ * of a set of numbered generations kept in a sibling directory:
+ *
+ *   /usr/local -> local.gen/7
+ *
+ * Each run builds generation N+1 and then swings the link area over to it with
+ * a single rename().  A new generation starts out as a copy of the top level of
+ * the current one, in which anything that isn't already a link is represented
+ * by a "generation link" back to the same place in the old generation, e.g.
+ * local.gen/8/share -> ../7/share.  Only the directories that the run actually
+ * has to change are materialised, one level at a time, as they're reached.
+ * Since all generations sit at the same depth, links copied from one
+ * generation into another resolve identically. */
+
+static int generation_mode = 0; /* set when writing into a new generation */
+
+/* Paths (relative to the link area) that a batch install will create as
+ * directories because more than one of its packages has something there */
+static struct strtab *batch_dirs = NULL;
+
+/* Packages that a reconcile will remove before installing the batch, whose
+ * links the pre-install check treats as though they had gone already */
+static char **removing_pkgs = NULL;
+static int n_removing_pkgs = 0;
+
+static int generation_link(const char *linkbuf, const char *tail_part)/*{{{*/
+{
+  /* If linkbuf is a generation link for the path 'tail_part' (relative to the
+   * top of a generation), return the generation it points into, else -1. */
+  const char *p, *q;
+  int gen;
+
+  q = linkbuf;
+  for (p = tail_part; *p; p++) {
+    if (*p == '/') {
+      if (strncmp(q, "../", 3)) return -1;
+      q += 3;
+    }
+  }
+  if (!isdigit((unsigned char) *q)) return -1;
+  gen = 0;
+  while (isdigit((unsigned char) *q)) gen = 10*gen + (*q++ - '0');
+  return strcmp(q, tail_part) ? -1 : gen;
+}
+/*}}}*/
+static char *make_generation_link(int depth, int gen, const char *tail_part)/*{{{*/
+{
+  char *res, *p;
+  int i;
+  res = new_array(char, 3*depth + 12 + strlen(tail_part));
+  p = res;
+  for (i=0; i<depth; i++) {
+    memcpy(p, "../", 3);
+    p += 3;
+  }
+  sprintf(p, "%d%s", gen, tail_part);
+  return res;
+}
+/*}}}*/
+static int copy_generation_entries(const char *from_dir, const char *to_dir,/*{{{*/
+                                   const char *tail_part, int gen)
+{
+  /* Populate to_dir with the entries of from_dir (in generation 'gen'),
+   * 'tail_part' being to_dir's path relative to the top of the generation.
+   * Links are copied as they are, anything else becomes a generation link.
+   * Return 1 if an error occurs, 0 otherwise. */
+  struct dirlist *dl;
+  int depth;
+  const char *p;
+  int result = 0;
+  int i;
+
+  depth = 1;
+  for (p = tail_part; *p; p++) {
+    if (*p == '/') depth++;
+  }
+
+  dl = read_dirlist(from_dir);
+  if (!dl) {
+    printf("!! ERROR Could not open directory <%s> to read contents : %s\n",
+           from_dir, strerror(errno));
+    return 1;
+  }
+  for (i=0; i<dl->n; i++) {
+    const char *name = dl->entries[i].name;
+    char *from, *to, *target;
+    struct stat sb;
+    char linkbuf[PATH_MAX];
+    int is_link = (dl->entries[i].type == DT_LNK);
+    from = dfcaten(from_dir, name);
+    to = dfcaten(to_dir, name);
+    target = NULL;
+    if ((dl->entries[i].type == DT_UNKNOWN) && (lstat(from, &sb) < 0)) {
+      printf("!! ERROR Could not stat <%s> : %s\n", from, strerror(errno));
+      result = 1;
+    } else if (is_link || ((dl->entries[i].type == DT_UNKNOWN) && S_ISLNK(sb.st_mode))) {
+      int len = readlink(from, linkbuf, PATH_MAX - 1);
+      if (len < 0) {
+        printf("!! ERROR Could not read link <%s> : %s\n", from, strerror(errno));
+        result = 1;
+      } else {
+        linkbuf[len] = 0;
+        target = new_string(linkbuf);
+      }
+    } else {
+      char *tail = dfcaten(tail_part, name);
+      target = make_generation_link(depth, gen, tail);
+      free(tail);
+    }
+    if (target) {
+      if (dest_symlink(target, to) < 0) {
+        printf("!! ERROR Could not create symlink from <%s> to <%s> : %s\n",
+               to, target, strerror(errno));
+        result = 1;
+      }
+      free(target);
+    }
+    free(from);
+    free(to);
+  }
+  free_dirlist(dl);
+  return result;
+}
+/*}}}*/
+static int materialise_generation_dir(const char *dir_link, const char *tail_part, int gen)/*{{{*/
+{
+  /* Replace a generation link to a directory with a real directory holding
+   * the same entries.  Return 0 on success, 1 if an error occurs, 2 if the
+   * link isn't to a directory. */
+  struct stat sb;
+  char *tmp;
+  int result;
+
+  if (stat(dir_link, &sb) < 0) {
+    printf("!! ERROR Could not stat <%s> : %s\n", dir_link, strerror(errno));
+    return 1;
+  }
+  if (!S_ISDIR(sb.st_mode)) return 2;
+
+  /* Build the directory alongside, reading the contents through the old
+   * link, then move it into place.  Nothing else can see this generation yet,
+   * so it doesn't matter that this isn't atomic. */
+  tmp = caten(dir_link, ".spill-tmp");
+  if (dest_mkdir(tmp, sb.st_mode & 07777) < 0) {
+    printf("!! ERROR Could not create new directory at <%s> : %s\n", tmp, strerror(errno));
+    free(tmp);
+    return 1;
+  }
+  result = copy_generation_entries(dir_link, tmp, tail_part, gen);
+  if (!result && ((dest_unlink(dir_link) < 0) || (rename(tmp, dir_link) < 0))) {
+    printf("!! ERROR Could not replace <%s> by a directory : %s\n", dir_link, strerror(errno));
+    result = 1;
+  }
+  dest_invalidate(dir_link);
+  free(tmp);
+  return result;
+}
+/*}}}*/
+static char *generation_dir(const char *link_area)/*{{{*/
+{
+  return caten(link_area, ".gen");
+}
+/*}}}*/
+static int current_generation(const char *link_area)/*{{{*/
+{
+  /* Return the generation the link area points to, 0 if the link area doesn't
+   * exist, -1 if it exists but isn't managed in generations. */
+  char linkbuf[PATH_MAX];
+  const char *base;
+  int len, base_len;
+  int gen;
+  char *p;
+
+  len = readlink(link_area, linkbuf, PATH_MAX - 1);
+  if (len < 0) {
+    return (errno == ENOENT) ? 0 : -1;
+  }
+  linkbuf[len] = 0;
+  base = strrchr(link_area, '/');
+  base = base ? base + 1 : link_area;
+  base_len = strlen(base);
+  if (strncmp(linkbuf, base, base_len) || strncmp(linkbuf + base_len, ".gen/", 5)) return -1;
+  p = linkbuf + base_len + 5;
+  if (!isdigit((unsigned char) *p)) return -1;
+  gen = strtol(p, &p, 10);
+  return (*p || (gen <= 0)) ? -1 : gen;
+}
+/*}}}*/
+static int scan_generations(const char *link_area, int below)/*{{{*/
+{
+  /* Return the highest generation that exists below 'below' (if it's
+   * non-zero, or overall if it's zero), 0 if there isn't one */
+  char *gen_dir;
+  DIR *d;
+  struct dirent *de;
+  int best = 0;
+
+  gen_dir = generation_dir(link_area);
+  d = opendir(gen_dir);
+  if (d) {
+    while ((de = readdir(d))) {
+      char *end;
+      int gen;
+      if (!isdigit((unsigned char) de->d_name[0])) continue;
+      gen = strtol(de->d_name, &end, 10);
+      if (*end) continue;
+      if (below && (gen >= below)) continue;
+      if (gen > best) best = gen;
+    }
+    closedir(d);
+  }
+  free(gen_dir);
+  return best;
+}
+/*}}}*/
+/* Generations being built by this run, which are thrown away if it exits
+ * without activating them */
+static char **pending_gens = NULL;
+static int n_pending_gens = 0;
+
+static void abandon_generations(void);
+static void lock_generation_dirs(int n, char **link_areas);
+static void unlock_generation_dir(const char *link_area);
+static void remove_generation(const char *path);
+static int flock_dir(const char *path, int exclusive);
+
+static void note_pending_generation(const char *path)/*{{{*/
+{
+  if (!pending_gens) atexit(abandon_generations);
+  pending_gens = grow_array(char *, n_pending_gens + 1, pending_gens);
+  pending_gens[n_pending_gens++] = new_string(path);
+}
+/*}}}*/
+static void forget_pending_generation(const char *path)/*{{{*/
+{
+  int i;
+  for (i=0; i<n_pending_gens; i++) {
+    if (!strcmp(pending_gens[i], path)) {
+      free(pending_gens[i]);
+      pending_gens[i] = pending_gens[--n_pending_gens];
+      return;
+    }
+  }
+}
+/*}}}*/
+static char *new_generation(const char *link_area, int *new_gen)/*{{{*/
+{
+  /* Create the next generation of the link area, return its path (NULL,
+   * having said why, if it can't be made) */
+  char *gen_dir, *path, *old_path;
+  char name[16];
+  int cur, result;
+
+  cur = current_generation(link_area);
+  if (cur < 0) {
+    fprintf(stderr, "Link area <%s> isn't managed in generations (it should be a link to %s.gen/<n>)\n",
+            link_area, link_area);
+    return NULL;
+  }
+
+  gen_dir = generation_dir(link_area);
+  if ((mkdir(gen_dir, 0755) < 0) && (errno != EEXIST)) {
+    fprintf(stderr, "Cannot create %s : %s\n", gen_dir, strerror(errno));
+    free(gen_dir);
+    return NULL;
+  }
+  /* Another run may have activated a generation while this one waited */
+  lock_generation_dirs(1, (char **) &link_area);
+  cur = current_generation(link_area);
+  *new_gen = scan_generations(link_area, 0) + 1;
+  sprintf(name, "%d", *new_gen);
+  path = dfcaten(gen_dir, name);
+  if (mkdir(path, 0755) < 0) {
+    fprintf(stderr, "Cannot create %s : %s\n", path, strerror(errno));
+    unlock_generation_dir(link_area);
+    free(path);
+    free(gen_dir);
+    return NULL;
+  }
+  note_pending_generation(path);
+
+  if (cur > 0) {
+    sprintf(name, "%d", cur);
+    old_path = dfcaten(gen_dir, name);
+    result = copy_generation_entries(old_path, path, "", cur);
+    if (!result) {
+      /* The package records get rewritten, so they have to be real. */
+      char *record_dir = dfcaten(path, RECORD_DIR);
+      struct stat sb;
+      if (lstat(record_dir, &sb) == 0) {
+        result = materialise_generation_dir(record_dir, "/" RECORD_DIR, cur);
+      }
+      free(record_dir);
+    }
+    free(old_path);
+    if (result) {
+      fprintf(stderr, "Could not set up generation %d of <%s>\n", *new_gen, link_area);
+      remove_generation(path);
+      unlock_generation_dir(link_area);
+      free(path);
+      free(gen_dir);
+      return NULL;
+    }
+  }
+
+  free(gen_dir);
+  return path;
+}
+/*}}}*/
+static int activate_generation(const char *link_area, int gen)/*{{{*/
+{
+  char *tmp;
+  char target[PATH_MAX];
+  const char *base;
+  int result = 0;
+
+  base = strrchr(link_area, '/');
+  base = base ? base + 1 : link_area;
+  snprintf(target, sizeof(target), "%s.gen/%d", base, gen);
+  tmp = caten(link_area, ".spill-tmp");
+  unlink(tmp);
+  if ((symlink(target, tmp) < 0) || (rename(tmp, link_area) < 0)) {
+    fprintf(stderr, "Could not point <%s> at <%s> : %s\n", link_area, target, strerror(errno));
+    unlink(tmp);
+    result = 1;
+  } else {
+    char *gen_dir = generation_dir(link_area);
+    char *gen_path;
+    snprintf(target, sizeof(target), "%d", gen);
+    gen_path = dfcaten(gen_dir, target);
+    forget_pending_generation(gen_path);
+    free(gen_path);
+    free(gen_dir);
+    unlock_generation_dir(link_area);
+  }
+  free(tmp);
+  return result;
+}
+/*}}}*/
+static void remove_generation(const char *path)/*{{{*/
+{
+  /* Remove a generation that was only built for a dry run, or is being
+   * pruned, or the directory a link area was converted from.  Anything in
+   * it that isn't a link or a directory has another name elsewhere. */
+  DIR *d;
+  struct dirent *de;
+  d = opendir(path);
+  if (d) {
+    while ((de = readdir(d))) {
+      char *sub;
+      struct stat sb;
+      if (!strcmp(de->d_name, ".")) continue;
+      if (!strcmp(de->d_name, "..")) continue;
+      sub = dfcaten(path, de->d_name);
+      if ((lstat(sub, &sb) == 0) && S_ISDIR(sb.st_mode)) {
+        remove_generation(sub);
+      } else {
+        unlink(sub);
+      }
+      free(sub);
+    }
+    closedir(d);
+  }
+  rmdir(path);
+  forget_pending_generation(path);
+}
+/*}}}*/
+static void abandon_generations(void)/*{{{*/
+{
+  /* At exit, remove the generations that weren't activated, and the
+   * directory they were to go in if that's left empty */
+  while (n_pending_gens) {
+    char *path = new_string(pending_gens[n_pending_gens - 1]);
+    char *slash;
+    remove_generation(path);
+    slash = strrchr(path, '/');
+    if (slash) {
+      *slash = 0;
+      rmdir(path);
+    }
+    free(path);
+  }
+}
+/*}}}*/
+static int fresh_generation(const char *dir)/*{{{*/
+{
+  /* Is 'dir' the first generation of a link area, which starts out empty
+   * and so can't be expected to look like a link area yet? */
+  struct dirlist *dl;
+  int result;
+  if (!generation_mode) return 0;
+  dl = read_dirlist(dir);
+  result = dl && (dl->n == 0);
+  if (dl) free_dirlist(dl);
+  return result;
+}
+/*}}}*/
+static int rollback_generation(const char *link_area)/*{{{*/
+{
+  int cur, prev;
+  if (current_generation(link_area) > 0) lock_generation_dirs(1, (char **) &link_area);
+  cur = current_generation(link_area);
+  if (cur <= 0) {
+    fprintf(stderr, "Link area <%s> isn't managed in generations\n", link_area);
+    return 1;
+  }
+  prev = scan_generations(link_area, cur);
+  if (!prev) {
+    fprintf(stderr, "No generation before %d to roll back to\n", cur);
+    return 1;
+  }
+  if (activate_generation(link_area, prev)) return 1;
+  fprintf(stderr, "Rolled <%s> back from generation %d to %d\n", link_area, cur, prev);
+  return 0;
+}
+/*}}}*/
+static int exchange_paths(const char *a, const char *b)/*{{{*/
+{
+  /* Swap what's at 'a' and 'b' in one step, which a rename() can't do when
+   * one is a directory and the other isn't */
+  return syscall(SYS_renameat2, AT_FDCWD, a, AT_FDCWD, b, RENAME_EXCHANGE);
+}
+/*}}}*/
+static int convert_entries(const char *from_dir, const char *to_dir, int up)/*{{{*/
+{
+  /* Fill 'to_dir', which is one level further than 'from_dir' from anything
+   * outside the link area, with from_dir's entries.  Directories are made
+   * afresh, relative links that lead out of the link area get another "../"
+   * and anything else gets a second name, so that it keeps its inode.  'up'
+   * is how far below the top of the link area the links in from_dir are
+   * resolved from (the records' targets are from the top).  Return 1 if an
+   * error occurs, 0 otherwise. */
+  struct dirlist *dl;
+  int result = 0;
+  int i;
+
+  dl = read_dirlist(from_dir);
+  if (!dl) {
+    printf("!! ERROR Could not open directory <%s> to read contents : %s\n",
+           from_dir, strerror(errno));
+    return 1;
+  }
+  for (i=0; !result && (i<dl->n); i++) {
+    const char *name = dl->entries[i].name;
+    char linkbuf[PATH_MAX];
+    struct stat sb;
+    char *from, *to;
+
+    from = dfcaten(from_dir, name);
+    to = dfcaten(to_dir, name);
+    if (lstat(from, &sb) < 0) {
+      printf("!! ERROR Could not stat <%s> : %s\n", from, strerror(errno));
+      result = 1;
+    } else if (S_ISDIR(sb.st_mode)) {
+      if (dest_mkdir(to, sb.st_mode & 07777) < 0) {
+        printf("!! ERROR Could not create new directory at <%s> : %s\n", to, strerror(errno));
+        result = 1;
+      } else {
+        int is_records = (up == 0) && !strcmp(name, RECORD_DIR);
+        result = convert_entries(from, to, is_records ? 0 : up + 1);
+      }
+    } else if (S_ISLNK(sb.st_mode)) {
+      int len = readlink(from, linkbuf, PATH_MAX - 1);
+      if (len < 0) {
+        printf("!! ERROR Could not read link <%s> : %s\n", from, strerror(errno));
+        result = 1;
+      } else {
+        const char *p;
+        char *target;
+        int k = 0;
+        linkbuf[len] = 0;
+        for (p = linkbuf; !strncmp(p, "../", 3); p += 3) k++;
+        target = (k > up) ? caten("../", linkbuf) : new_string(linkbuf);
+        if (dest_symlink(target, to) < 0) {
+          printf("!! ERROR Could not create symlink from <%s> to <%s> : %s\n",
+                 to, target, strerror(errno));
+          result = 1;
+        }
+        free(target);
+      }
+    } else if (link(from, to) < 0) {
+      printf("!! ERROR Could not link <%s> to <%s> : %s\n", to, from, strerror(errno));
+      result = 1;
+    }
+    free(from);
+    free(to);
+  }
+  free_dirlist(dl);
+  return result;
+}
+/*}}}*/
+static int has_materialised(const char *link_area)/*{{{*/
+{
+  /* Does any package have files in the link area from --hardlink or
+   * --reflink?  A generation would keep them as links to an older one, where
+   * removing the package wouldn't find them. */
+  struct dirlist *dl;
+  struct stat sb;
+  char *record_dir;
+  int result = 0;
+  int i;
+
+  record_dir = dfcaten(link_area, RECORD_DIR);
+  dl = read_dirlist(record_dir);
+  for (i=0; dl && !result && (i<dl->n); i++) {
+    char *path;
+    if (strncmp(dl->entries[i].name, LINKS_PREFIX, strlen(LINKS_PREFIX))) continue;
+    path = dfcaten(record_dir, dl->entries[i].name);
+    result = (stat(path, &sb) == 0) && (sb.st_size > 0);
+    free(path);
+  }
+  if (dl) free_dirlist(dl);
+  free(record_dir);
+  return result;
+}
+/*}}}*/
+static int convert_to_generations(const char *link_area)/*{{{*/
+{
+  /* Make the plain link area into generation 1 of one managed in
+   * generations.  The generation is built alongside, and then swapped with
+   * the link area in one step. */
+  struct stat sb;
+  char *gen_dir, *path, *tmp;
+  const char *base;
+  char target[PATH_MAX];
+  int result;
+
+  if ((lstat(link_area, &sb) < 0) || !S_ISDIR(sb.st_mode)) {
+    if (current_generation(link_area) > 0) {
+      fprintf(stderr, "Link area <%s> is already managed in generations\n", link_area);
+    } else {
+      fprintf(stderr, "Link area <%s> isn't a directory\n", link_area);
+    }
+    return 1;
+  }
+  gen_dir = generation_dir(link_area);
+  if ((mkdir(gen_dir, 0755) < 0) && (errno != EEXIST)) {
+    fprintf(stderr, "Cannot create %s : %s\n", gen_dir, strerror(errno));
+    free(gen_dir);
+    return 1;
+  }
+  /* Runs on the plain link area lock its top, those on generations the .gen;
+   * both are held until this run ends. */
+  lock_generation_dirs(1, (char **) &link_area);
+  flock_dir(link_area, 1);
+  if (scan_generations(link_area, 0) > 0) {
+    fprintf(stderr, "%s already holds generations\n", gen_dir);
+    free(gen_dir);
+    return 1;
+  }
+  if (has_materialised(link_area)) {
+    fprintf(stderr, "Link area <%s> has files put there by --hardlink or --reflink : "
+            "reinstall those packages without it first\n", link_area);
+    rmdir(gen_dir);
+    free(gen_dir);
+    return 1;
+  }
+
+  path = dfcaten(gen_dir, "1");
+  if (mkdir(path, sb.st_mode & 07777) < 0) {
+    fprintf(stderr, "Cannot create %s : %s\n", path, strerror(errno));
+    free(path);
+    free(gen_dir);
+    return 1;
+  }
+  note_pending_generation(path);
+  result = convert_entries(link_area, path, 0);
+
+  base = strrchr(link_area, '/');
+  base = base ? base + 1 : link_area;
+  snprintf(target, sizeof(target), "%s.gen/1", base);
+  tmp = caten(link_area, ".spill-tmp");
+  if (!result) {
+    unlink(tmp);
+    if (symlink(target, tmp) < 0) {
+      fprintf(stderr, "Could not create %s : %s\n", tmp, strerror(errno));
+      result = 1;
+    } else if (exchange_paths(tmp, link_area) < 0) {
+      fprintf(stderr, "Could not put generation 1 in place of <%s> : %s\n", link_area, strerror(errno));
+      unlink(tmp);
+      result = 1;
+    }
+  }
+  if (result) {
+    fprintf(stderr, "Could not convert <%s>, which is unchanged\n", link_area);
+    remove_generation(path);
+    rmdir(gen_dir);
+  } else {
+    /* What was the link area is now at tmp, with every file also in the generation */
+    forget_pending_generation(path);
+    remove_generation(tmp);
+    fprintf(stderr, "Converted <%s> into generation 1 of a link area managed in generations\n", link_area);
+  }
+  free(tmp);
+  free(path);
+  free(gen_dir);
+  return result;
+}
+/*}}}*/
+static int keep_from_pruned(const char *dir, const char *tail_part,/*{{{*/
+                            const char *pruned, int max_gen)
+{
+  /* Make 'dir', at 'tail_part' in a generation that's being kept, stand on
+   * its own without the generations marked in 'pruned'.  A generation link
+   * into one of them is replaced by a copy of the directory it leads to,
+   * which is then looked at in turn, or by another name for the file.  Each
+   * replacement is one step, so the current generation can be worked on in
+   * place.  Return 1 if an error occurs, 0 otherwise. */
+  struct dirlist *dl;
+  int result = 0;
+  int i;
+
+  dl = read_dirlist(dir);
+  if (!dl) {
+    printf("!! ERROR Could not open directory <%s> to read contents : %s\n",
+           dir, strerror(errno));
+    return 1;
+  }
+  for (i=0; !result && (i<dl->n); i++) {
+    const char *name = dl->entries[i].name;
+    char linkbuf[PATH_MAX];
+    struct stat sb;
+    char *path, *tail, *tmp;
+    int len, gen;
+
+    path = dfcaten(dir, name);
+    tail = dfcaten(tail_part, name);
+    gen = -1;
+    if (lstat(path, &sb) < 0) {
+      printf("!! ERROR Could not stat <%s> : %s\n", path, strerror(errno));
+      result = 1;
+    } else if (S_ISDIR(sb.st_mode)) {
+      result = keep_from_pruned(path, tail, pruned, max_gen);
+    } else if (S_ISLNK(sb.st_mode)) {
+      len = readlink(path, linkbuf, PATH_MAX - 1);
+      if (len >= 0) {
+        linkbuf[len] = 0;
+        gen = generation_link(linkbuf, tail);
+      }
+    }
+    if ((gen > 0) && (gen <= max_gen) && pruned[gen]) {
+      tmp = caten(path, ".spill-tmp");
+      if (stat(path, &sb) < 0) {
+        printf("!! ERROR Could not stat <%s> : %s\n", path, strerror(errno));
+        result = 1;
+      } else if (S_ISDIR(sb.st_mode)) {
+        if (mkdir(tmp, sb.st_mode & 07777) < 0) {
+          printf("!! ERROR Could not create new directory at <%s> : %s\n", tmp, strerror(errno));
+          result = 1;
+        } else if (copy_generation_entries(path, tmp, tail, gen) || (exchange_paths(tmp, path) < 0)) {
+          printf("!! ERROR Could not replace <%s> by a directory : %s\n", path, strerror(errno));
+          remove_generation(tmp);
+          result = 1;
+        } else {
+          unlink(tmp);
+          result = keep_from_pruned(path, tail, pruned, max_gen);
+        }
+      } else if ((linkat(AT_FDCWD, path, AT_FDCWD, tmp, AT_SYMLINK_FOLLOW) < 0) ||
+                 (rename(tmp, path) < 0)) {
+        printf("!! ERROR Could not replace <%s> by the file it leads to : %s\n", path, strerror(errno));
+        unlink(tmp);
+        result = 1;
+      }
+      free(tmp);
+    }
+    free(path);
+    free(tail);
+  }
+  free_dirlist(dl);
+  return result;
+}
+/*}}}*/
+static int prune_generations(const char *link_area, int keep)/*{{{*/
+{
+  /* Remove all but the current generation and the newest others, 'keep' in
+   * all.  Those kept stop sharing anything with the rest first, and if any
+   * of them can't, nothing is removed. */
+  struct dirlist *dl;
+  char *gen_dir, *path;
+  char *exists, *pruned;
+  char name[16];
+  int cur, top, gen, kept, n_pruned;
+  int result = 0;
+  int i;
+
+  if (current_generation(link_area) > 0) lock_generation_dirs(1, (char **) &link_area);
+  cur = current_generation(link_area);
+  if (cur <= 0) {
+    fprintf(stderr, "Link area <%s> isn't managed in generations\n", link_area);
+    return 1;
+  }
+  gen_dir = generation_dir(link_area);
+  top = scan_generations(link_area, 0);
+  exists = new_array(char, top + 1);
+  pruned = new_array(char, top + 1);
+  memset(exists, 0, top + 1);
+  memset(pruned, 0, top + 1);
+  dl = read_dirlist(gen_dir);
+  for (i=0; dl && (i<dl->n); i++) {
+    char *end;
+    if (!isdigit((unsigned char) dl->entries[i].name[0])) continue;
+    gen = strtol(dl->entries[i].name, &end, 10);
+    if (!*end && (gen > 0) && (gen <= top)) exists[gen] = 1;
+  }
+  if (dl) free_dirlist(dl);
+
+  kept = 1;
+  n_pruned = 0;
+  for (gen=top; gen>0; gen--) {
+    if (!exists[gen] || (gen == cur)) continue;
+    if (kept < keep) {
+      kept++;
+    } else {
+      pruned[gen] = 1;
+      n_pruned++;
+    }
+  }
+
+  for (gen=top; n_pruned && !result && (gen>0); gen--) {
+    if (!exists[gen] || pruned[gen]) continue;
+    sprintf(name, "%d", gen);
+    path = dfcaten(gen_dir, name);
+    if (keep_from_pruned(path, "", pruned, top)) {
+      fprintf(stderr, "Could not separate generation %d of <%s> from older ones : nothing pruned\n",
+              gen, link_area);
+      result = 1;
+    }
+    free(path);
+  }
+  for (gen=1; !result && (gen<=top); gen++) {
+    if (!pruned[gen]) continue;
+    sprintf(name, "%d", gen);
+    path = dfcaten(gen_dir, name);
+    remove_generation(path);
+    free(path);
+    fprintf(stderr, "Removed generation %d of <%s>\n", gen, link_area);
+  }
+  free(exists);
+  free(pruned);
+  free(gen_dir);
+  return result;
+}
+/*}}}*/
+/*}}}*/
+
+/*{{{ Locking */
+/* So that several spill runs can share a link area, each one locks the
+ * link-area directories it's going to look at before it looks at them : shared
+ * if it's only going to read a directory, exclusive if anything in it might
+ * change.  A run decides what to lock up front, by walking all the package
+ * trees it's going to install or remove together, and holds the locks until it
+ * finishes.  Every run takes its locks in the same order (a depth-first walk
+ * with the names in each directory sorted), so runs that need overlapping
+ * directories queue up rather than deadlocking, and runs that don't go ahead
+ * side by side.
+ *
+ * The .spill record directory has a lock of its own.  It's only held while a
+ * record is read or written, and never while waiting for another lock.  The
+ * locks are flock()s on the directories themselves, so there are no lock
+ * files to clean up, and they go when the process does.
+ *
+ * Each lock costs a descriptor for the whole run.  Once max_open_dirs of them
+ * are held, the next directory is locked exclusively, which covers everything
+ * under it since every other run locks its way down from the top too, and
+ * nothing below it is locked separately. */
+
+static int use_locks = 1;
+static struct strtab *held_locks = NULL; /* directory -> its lock */
+static int max_open_dirs = 0; /* 0 until set from the option or the fd limit */
+static int n_open_dirs = 0;
+
+struct held_lock {/*{{{*/
+  int fd;
+  int exclusive;
+  int subtree;  /* set if the lock stands for everything under it as well */
+};
+/*}}}*/
+static int open_dirs_left(void)/*{{{*/
+{
+  /* How many more directory descriptors may be held open */
+  if (!max_open_dirs) {
+    struct rlimit rl;
+    /* Leave half for everything else : listings, the pipeline, stdio */
+    if ((getrlimit(RLIMIT_NOFILE, &rl) == 0) && (rl.rlim_cur != RLIM_INFINITY)) {
+      max_open_dirs = (rl.rlim_cur > 64) ? (int) (rl.rlim_cur / 2) : 32;
+    } else {
+      max_open_dirs = 512;
+    }
+  }
+  return max_open_dirs - n_open_dirs;
+}
+/*}}}*/
+static int flock_dir(const char *path, int exclusive)/*{{{*/
+{
+  /* Return a descriptor for 'path' holding the lock, or -1 */
+  int fd;
+  fd = open(path[0] ? path : "/", O_RDONLY | O_DIRECTORY);
+  if (fd < 0) return -1;
+  n_open_dirs++;
+  while (flock(fd, exclusive ? LOCK_EX : LOCK_SH) < 0) {
+    if (errno != EINTR) {
+      fprintf(stderr, "Couldn't lock <%s> : %s, carrying on without\n", path, strerror(errno));
+      break;
+    }
+  }
+  return fd;
+}
+/*}}}*/
+
+/* Building a generation starts from whichever one is current and ends by
+ * activating the new one, so runs building generations of the same link
+ * area take turns : each holds an exclusive lock on <link area>.gen from
+ * before it looks at the current generation until it has activated its own.
+ * A run building several takes those locks together, in inode order, so
+ * that it can't deadlock with another. */
+struct gen_lock {/*{{{*/
+  dev_t dev;
+  ino_t ino;
+  char *gen_dir;
+  int fd;
+};
+/*}}}*/
+static struct gen_lock *gen_locks = NULL;
+static int n_gen_locks = 0;
+
+static int compare_gen_locks(const void *a, const void *b)/*{{{*/
+{
+  const struct gen_lock *ga = (const struct gen_lock *) a;
+  const struct gen_lock *gb = (const struct gen_lock *) b;
+  if (ga->dev != gb->dev) return (ga->dev < gb->dev) ? -1 : 1;
+  if (ga->ino != gb->ino) return (ga->ino < gb->ino) ? -1 : 1;
+  return 0;
+}
+/*}}}*/
+static int find_gen_lock(const struct gen_lock *locks, int n, const struct stat *sb)/*{{{*/
+{
+  int i;
+  for (i=0; i<n; i++) {
+    if ((locks[i].dev == sb->st_dev) && (locks[i].ino == sb->st_ino)) return i;
+  }
+  return -1;
+}
+/*}}}*/
+static void lock_generation_dirs(int n, char **link_areas)/*{{{*/
+{
+  /* Lock the .gen directories of the 'n' link areas, making them if need be */
+  struct gen_lock *want;
+  int n_want = 0;
+  int i;
+
+  if (!use_locks) return;
+  want = new_array(struct gen_lock, n + 1);
+  for (i=0; i<n; i++) {
+    char *gen_dir = generation_dir(link_areas[i]);
+    struct stat sb;
+    if (((mkdir(gen_dir, 0755) == 0) || (errno == EEXIST)) && (stat(gen_dir, &sb) == 0) &&
+        (find_gen_lock(gen_locks, n_gen_locks, &sb) < 0) && (find_gen_lock(want, n_want, &sb) < 0)) {
+      want[n_want].dev = sb.st_dev;
+      want[n_want].ino = sb.st_ino;
+      want[n_want].gen_dir = gen_dir;
+      n_want++;
+    } else {
+      free(gen_dir);
+    }
+  }
+  if (n_want > 1) qsort(want, n_want, sizeof(struct gen_lock), compare_gen_locks);
+  gen_locks = grow_array(struct gen_lock, n_gen_locks + n_want + 1, gen_locks);
+  for (i=0; i<n_want; i++) {
+    want[i].fd = flock_dir(want[i].gen_dir, 1);
+    if (want[i].fd < 0) {
+      free(want[i].gen_dir);
+      continue;
+    }
+    gen_locks[n_gen_locks++] = want[i];
+  }
+  free(want);
+}
+/*}}}*/
+static void unlock_generation_dir(const char *link_area)/*{{{*/
+{
+  /* Let other runs at the link area's generations, once this one is active */
+  char *gen_dir = generation_dir(link_area);
+  struct stat sb;
+  int k;
+  if ((stat(gen_dir, &sb) == 0) && ((k = find_gen_lock(gen_locks, n_gen_locks, &sb)) >= 0)) {
+    close(gen_locks[k].fd);
+    n_open_dirs--;
+    free(gen_locks[k].gen_dir);
+    gen_locks[k] = gen_locks[--n_gen_locks];
+  }
+  free(gen_dir);
+}
+/*}}}*/
+static int needs_exclusive(const char *dir, const struct dirlist *dl, int n, const char **names)/*{{{*/
+{
+  /* Could any of 'names' in 'dir' change?  Only real subdirectories are left
+   * alone by every action. */
+  int i;
+  for (i=0; i<n; i++) {
+    int k = find_dir_entry(dl, names[i]);
+    if (k < 0) return 1;
+    if (dl->entries[k].type == DT_UNKNOWN) {
+      struct stat sb;
+      char *path = dfcaten(dir, names[i]);
+      int is_dir = (meta_stat(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &sb) == 0) &&
+                   S_ISDIR(sb.st_mode);
+      free(path);
+      if (!is_dir) return 1;
+    } else if (dl->entries[k].type != DT_DIR) {
+      return 1;
+    }
+  }
+  return 0;
+}
+/*}}}*/
+static int compare_names(const void *a, const void *b)/*{{{*/
+{
+  return strcmp(*(const char **) a, *(const char **) b);
+}
+/*}}}*/
+static int compare_src_entry(const void *a, const void *b)/*{{{*/
+{
+  return strcmp((const char *) a, ((const struct src_entry *) b)->name);
+}
+/*}}}*/
+struct lock_frame {/*{{{*/
+  char *tail;
+  char *full_dest;
+  const char **names;   /* what the packages have here, sorted */
+  int n_names;
+  char *src_is_dir;
+  struct dirlist *dl;   /* NULL if there's nothing under it to lock */
+  int next;             /* index in names of the next subdirectory to try */
+};
+/*}}}*/
+static void lock_dir(struct lock_frame *f, const char *dest, char *tail, int n_srcs, const char **srcs)/*{{{*/
+{
+  /* Lock directory 'tail' of the link area, taking over 'tail', and set up
+   * 'f' for going on into its subdirectories. */
+  char *full_dest;
+  const char **names;
+  char *src_is_dir;
+  int n_names, max_names;
+  struct src_listing **listings;
+  struct dirlist *dl;
+  struct held_lock *hl;
+  struct strtab_node *node;
+  int i, j;
+
+  /* Everything the packages have at this level, sorted and without repeats */
+  names = NULL;
+  n_names = max_names = 0;
+  listings = new_array(struct src_listing *, n_srcs + 1);
+  for (i=0; i<n_srcs; i++) {
+    char *full_src = caten(srcs[i], tail);
+    struct src_listing *l = read_src_listing(full_src);
+    free(full_src);
+    listings[i] = l;
+    for (j=0; l && (j<l->n); j++) {
+      /* Not the rules files : an old version may have links they now rule
+       * out, which removing it will have to clear. */
+      if (check_ignore(NULL, NULL, tail, l->entries[j].name)) continue;
+      if (n_names == max_names) {
+        max_names = max_names ? (max_names << 1) : 64;
+        names = grow_array(const char *, max_names, names);
+      }
+      names[n_names++] = l->entries[j].name;
+    }
+  }
+  if (n_names > 1) qsort(names, n_names, sizeof(const char *), compare_names);
+  for (i=j=0; i<n_names; i++) {
+    if (!j || strcmp(names[j-1], names[i])) names[j++] = names[i];
+  }
+  n_names = j;
+
+  src_is_dir = new_array(char, n_names + 1);
+  for (i=0; i<n_names; i++) {
+    src_is_dir[i] = 0;
+    for (j=0; !src_is_dir[i] && (j<n_srcs); j++) {
+      struct src_entry *e;
+      if (!listings[j]) continue;
+      e = bsearch(names[i], listings[j]->entries, listings[j]->n,
+                  sizeof(struct src_entry), compare_src_entry);
+      if (e && (e->type == ST_DIR)) src_is_dir[i] = 1;
+    }
+  }
+  free(listings);
+
+  /* Lock the directory, shared to start with so that what's in it can be
+   * looked at, then exclusive if need be.  Nothing later in the order is held
+   * yet, so letting go in between is safe. */
+  full_dest = caten(dest, tail);
+  node = strtab_insert(held_locks, full_dest);
+  if (node->value) {
+    /* Already held from an earlier walk in this run, which must have covered
+     * everything this one does. */
+    hl = (struct held_lock *) node->value;
+    dl = hl->subtree ? NULL : read_dirlist(full_dest);
+  } else if (open_dirs_left() <= 1) {
+    /* Out of descriptors to lock the directories under it with */
+    hl = new(struct held_lock);
+    hl->exclusive = 1;
+    hl->subtree = 1;
+    hl->fd = flock_dir(full_dest, 1);
+    node->value = hl;
+    dl = NULL;
+  } else {
+    hl = new(struct held_lock);
+    hl->exclusive = 0;
+    hl->subtree = 0;
+    hl->fd = flock_dir(full_dest, 0);
+    node->value = hl;
+    dl = read_dirlist(full_dest);
+    if (dl && (hl->fd >= 0) && needs_exclusive(full_dest, dl, n_names, names)) {
+      close(hl->fd);
+      n_open_dirs--;
+      hl->fd = flock_dir(full_dest, 1);
+      hl->exclusive = 1;
+      free_dirlist(dl);
+      dl = read_dirlist(full_dest);
+    }
+  }
+  if (hl->fd < 0) {
+    /* Doesn't exist (yet), nothing below it to lock either */
+    strtab_remove(held_locks, full_dest);
+    free(hl);
+  }
+
+  f->tail = tail;
+  f->full_dest = full_dest;
+  f->names = names;
+  f->n_names = n_names;
+  f->src_is_dir = src_is_dir;
+  f->dl = dl;
+  f->next = 0;
+}
+/*}}}*/
+static int next_lock_subdir(struct lock_frame *f)/*{{{*/
+{
+  /* The index in f->names of the next subdirectory that the walk will go
+   * into, or -1 once there are no more. */
+  while (f->dl && (f->next < f->n_names)) {
+    int i = f->next++;
+    int k;
+    if (!f->src_is_dir[i]) continue;
+    k = find_dir_entry(f->dl, f->names[i]);
+    if (k < 0) continue;
+    if (f->dl->entries[k].type == DT_UNKNOWN) {
+      struct stat sb;
+      char *path = dfcaten(f->full_dest, f->names[i]);
+      int is_dir = (meta_stat(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &sb) == 0) &&
+                   S_ISDIR(sb.st_mode);
+      free(path);
+      if (!is_dir) continue;
+    } else if (f->dl->entries[k].type != DT_DIR) {
+      continue;
+    }
+    return i;
+  }
+  return -1;
+}
+/*}}}*/
+static void lock_walk(const char *dest, const char *tail, int n_srcs, const char **srcs)/*{{{*/
+{
+  /* Lock 'tail' and the directories under it, each before the ones under
+   * it and those in name order, keeping a stack of the directories on the
+   * way down rather than recursing. */
+  struct lock_frame *frames;
+  int n = 0, max = 16;
+
+  frames = new_array(struct lock_frame, max);
+  lock_dir(&frames[n++], dest, new_string(tail), n_srcs, srcs);
+  while (n > 0) {
+    struct lock_frame *f = frames + n - 1;
+    char *new_tail;
+    int i = next_lock_subdir(f);
+    if (i < 0) {
+      if (f->dl) free_dirlist(f->dl);
+      free(f->src_is_dir);
+      if (f->names) free(f->names);
+      free(f->full_dest);
+      free(f->tail);
+      n--;
+      continue;
+    }
+    new_tail = dfcaten(f->tail, f->names[i]);
+    if (n == max) {
+      max <<= 1;
+      frames = grow_array(struct lock_frame, max, frames);
+    }
+    lock_dir(&frames[n++], dest, new_tail, n_srcs, srcs);
+  }
+  free(frames);
+}
+/*}}}*/
+static void lock_area(const char *dest, int n_srcs, const char **srcs)/*{{{*/
+{
+  /* Lock the parts of link area 'dest' that installing or removing the
+   * packages in 'srcs' could involve. */
+  if (!use_locks || generation_mode) return;
+  if (!held_locks) held_locks = new_strtab();
+  lock_walk(dest, "", n_srcs, srcs);
+}
+/*}}}*/
+static char *recorded_install_area(const char *dest_path, const char *pkg)/*{{{*/
+{
+  /* Where the installed version of 'pkg' is, going by its record, or NULL */
+  char *linkpath;
+  char target[PATH_MAX];
+  int status;
+  linkpath = dfcaten3(dest_path, RECORD_DIR, pkg);
+  status = dest_readlink(linkpath, target, sizeof(target) - 1);
+  free(linkpath);
+  if (status < 0) return NULL;
+  target[status] = 0;
+  return (target[0] == '/') ? new_string(target) : dfcaten(dest_path, target);
+}
+/*}}}*/
+static void lock_packages(const char *dest, int n_srcs, char **srcs,/*{{{*/
+                          int n_pkgs, char **pkgs)
+{
+  /* Lock link area 'dest' for installing the packages in 'srcs' (clean
+   * paths) and for removing the installed versions of the packages named in
+   * 'pkgs', all in one walk. */
+  const char **all;
+  char **old;
+  int n_all, n_old;
+  int i;
+
+  if (!use_locks) return;
+  all = new_array(const char *, n_srcs + n_pkgs);
+  old = new_array(char *, n_pkgs + 1);
+  n_all = n_old = 0;
+  for (i=0; i<n_srcs; i++) all[n_all++] = srcs[i];
+  for (i=0; i<n_pkgs; i++) {
+    char *area = recorded_install_area(dest, pkgs[i]);
+    if (area) all[n_all++] = old[n_old++] = area;
+  }
+  lock_area(dest, n_all, all);
+  for (i=0; i<n_old; i++) free(old[i]);
+  free(old);
+  free(all);
+}
+/*}}}*/
+static int lock_registry(const char *dest_path, int exclusive)/*{{{*/
+{
+  /* Lock the record directory, returning the descriptor to unlock_registry()
+   * (-1 if there's no lock to drop). */
+  char *record_dir;
+  int fd;
+  if (!use_locks) return -1;
+  record_dir = dfcaten(dest_path, RECORD_DIR);
+  fd = flock_dir(record_dir, exclusive);
+  free(record_dir);
+  return fd;
+}
+/*}}}*/
+static void unlock_registry(int fd)/*{{{*/
+{
+  if (fd >= 0) {
+    close(fd);
+    n_open_dirs--;
+  }
+}
+/*}}}*/
+static void release_locks(void)/*{{{*/
+{
+  /* Let go of every lock taken so far.  A run of the program never needs to,
+   * but the library takes them afresh for each plan. */
+  int i;
+  if (!held_locks) return;
+  for (i=0; i<held_locks->size; i++) {
+    struct strtab_node *n;
+    for (n = held_locks->buckets[i]; n; n = n->next) {
+      struct held_lock *hl = (struct held_lock *) n->value;
+      close(hl->fd);
+      n_open_dirs--;
+      free(hl);
+    }
+  }
+  strtab_free(held_locks);
+  held_locks = NULL;
+}
+/*}}}*/
+/*}}}*/
+/*{{{ Archive output */
+/* What's been staged is written out as a tar stream (ustar, with pax headers
+ * for names too long for that), named from the top of the link area : each
+ * directory made and each link, the directories on disk above them, and a
+ * whiteout in the style of container image layers for each thing that was on
+ * disk but has been removed.  It's only written once everything has worked. */
+static char *archive_path = NULL;  /* "-" for stdout */
+static int archive_fd = -1;        /* stdout, while stdout goes to stderr */
+
+struct archive_member {/*{{{*/
+  char *name;
+  char type;           /* as in the tar header */
+  mode_t mode;
+  const char *link;
+};
+/*}}}*/
+static void open_archive_area(const char *dest)/*{{{*/
+{
+  /* Stage everything written to link area 'dest' from here on.  It has to
+   * exist, since it's what the archive goes on top of. */
+  struct stat sb;
+  char *link_area;
+  if ((stat(dest, &sb) < 0) || !S_ISDIR(sb.st_mode)) {
+    fprintf(stderr, "Link area %s must be a directory to build an archive for\n", dest);
+    exit(1);
+  }
+  link_area = cleanup_dir(dest);
+  if (current_generation(link_area) > 0) {
+    fprintf(stderr, "Link area %s is managed in generations, which --archive can't do\n", link_area);
+    exit(1);
+  }
+  staged = new_strtab();
+  staged_root = link_area;
+  staged_root_len = strlen(staged_root);
+  /* Nothing's written to the area, so there's nothing to lock */
+  use_locks = 0;
+  if (!strcmp(archive_path, "-")) {
+    /* Keep the messages out of the archive */
+    fflush(stdout);
+    archive_fd = dup(1);
+    dup2(2, 1);
+  }
+}
+/*}}}*/
+static void tar_number(char *field, int width, unsigned long value)/*{{{*/
+{
+  snprintf(field, width, "%0*lo", width - 1, value);
+}
+/*}}}*/
+static void tar_header(FILE *out, const char *name, char type, mode_t mode,/*{{{*/
+                       const char *link, unsigned long size, unsigned long mtime)
+{
+  char h[512];
+  unsigned long sum;
+  int i;
+
+  memset(h, 0, sizeof(h));
+  strncpy(h, name, 100);
+  tar_number(h + 100, 8, mode & 07777);
+  tar_number(h + 108, 8, 0);
+  tar_number(h + 116, 8, 0);
+  tar_number(h + 124, 12, size);
+  tar_number(h + 136, 12, mtime);
+  memset(h + 148, ' ', 8);
+  h[156] = type;
+  if (link) strncpy(h + 157, link, 100);
+  memcpy(h + 257, "ustar", 6);
+  memcpy(h + 263, "00", 2);
+  strcpy(h + 265, "root");
+  strcpy(h + 297, "root");
+  tar_number(h + 329, 8, 0);
+  tar_number(h + 337, 8, 0);
+  for (sum=0, i=0; i<512; i++) sum += (unsigned char) h[i];
+  snprintf(h + 148, 8, "%06lo", sum);
+  fwrite(h, 1, sizeof(h), out);
+}
+/*}}}*/
+static void pax_record(char **buf, int *len, const char *key, const char *value)/*{{{*/
+{
+  /* Add "<length> <key>=<value>\n", where the length counts itself */
+  int body = strlen(key) + strlen(value) + 3;
+  int total = body + 1;
+  while (body + snprintf(NULL, 0, "%d", total) != total) {
+    total = body + snprintf(NULL, 0, "%d", total);
+  }
+  *buf = grow_array(char, *len + total + 1, *buf);
+  sprintf(*buf + *len, "%d %s=%s\n", total, key, value);
+  *len += total;
+}
+/*}}}*/
+static void tar_member(FILE *out, const struct archive_member *m, unsigned long mtime)/*{{{*/
+{
+  static const char zeros[512];
+  if ((strlen(m->name) > 100) || (m->link && (strlen(m->link) > 100))) {
+    char *pax = NULL;
+    int len = 0;
+    if (strlen(m->name) > 100) pax_record(&pax, &len, "path", m->name);
+    if (m->link && (strlen(m->link) > 100)) pax_record(&pax, &len, "linkpath", m->link);
+    tar_header(out, "PaxHeader", 'x', 0644, NULL, len, mtime);
+    fwrite(pax, 1, len, out);
+    if (len & 511) fwrite(zeros, 1, 512 - (len & 511), out);
+    free(pax);
+  }
+  tar_header(out, m->name, m->type, m->mode, m->link, 0, mtime);
+}
+/*}}}*/
+static int compare_members(const void *a, const void *b)/*{{{*/
+{
+  return strcmp(((const struct archive_member *) a)->name,
+                ((const struct archive_member *) b)->name);
+}
+/*}}}*/
+static void add_member(struct archive_member **members, int *n, int *max,/*{{{*/
+                       const char *path, char type, mode_t mode, const char *link)
+{
+  struct archive_member *m;
+  if (*n == *max) {
+    *max = *max ? (*max << 1) : 256;
+    *members = grow_array(struct archive_member, *max, *members);
+  }
+  m = *members + (*n)++;
+  m->name = new_string(path + staged_root_len + 1);
+  if (type == '5') {
+    char *with_slash = caten(m->name, "/");
+    free(m->name);
+    m->name = with_slash;
+  }
+  m->type = type;
+  m->mode = mode;
+  m->link = link;
+}
+/*}}}*/
+static int write_archive(void)/*{{{*/
+{
+  /* Return non-zero if the archive couldn't be written */
+  static const char zeros[1024];
+  struct archive_member *members = NULL;
+  struct strtab *dirs;
+  const char *epoch;
+  unsigned long mtime;
+  FILE *out;
+  int n = 0, max = 0;
+  int i, status;
+
+  dirs = new_strtab();
+  for (i=0; i<staged->size; i++) {
+    struct strtab_node *node;
+    for (node = staged->buckets[i]; node; node = node->next) {
+      struct dest_state *ds = (struct dest_state *) node->value;
+      struct stat sb;
+      char *parent, *slash;
+      if (ds->err == 0) {
+        add_member(&members, &n, &max, node->key,
+                   ds->link ? '2' : '5', ds->link ? 0777 : ds->mode, ds->link);
+      } else if (!staged_shadowed(node->key) && (lstat(node->key, &sb) == 0)) {
+        char *dir = new_string(node->key);
+        char *name, *whiteout;
+        slash = strrchr(dir, '/');
+        *slash = 0;
+        name = caten(".wh.", slash + 1);
+        whiteout = dfcaten(dir, name);
+        add_member(&members, &n, &max, whiteout, '0', 0644, NULL);
+        free(whiteout);
+        free(name);
+        free(dir);
+      } else {
+        continue;
+      }
+      /* The directories on disk that it's in */
+      parent = new_string(node->key);
+      while ((slash = strrchr(parent, '/')) && (slash - parent > staged_root_len)) {
+        *slash = 0;
+        if (strtab_find(staged, parent) || strtab_find(dirs, parent)) break;
+        strtab_insert(dirs, parent);
+        if (lstat(parent, &sb) == 0) add_member(&members, &n, &max, parent, '5', sb.st_mode, NULL);
+      }
+      free(parent);
+    }
+  }
+  strtab_free(dirs);
+  if (n > 1) qsort(members, n, sizeof(struct archive_member), compare_members);
+
+  if (archive_fd >= 0) {
+    out = fdopen(archive_fd, "w");
+  } else {
+    out = fopen(archive_path, "w");
+  }
+  if (!out) {
+    fprintf(stderr, "Could not open %s to write the archive to : %s\n", archive_path, strerror(errno));
+    return 1;
+  }
+  epoch = getenv("SOURCE_DATE_EPOCH");
+  mtime = epoch ? strtoul(epoch, NULL, 10) : (unsigned long) time(NULL);
+  for (i=0; i<n; i++) {
+    tar_member(out, &members[i], mtime);
+    free(members[i].name);
+  }
+  if (members) free(members);
+  fwrite(zeros, 1, sizeof(zeros), out);
+  status = ferror(out);
+  if (fclose(out) != 0) status = 1;
+  if (status) {
+    fprintf(stderr, "Could not write the archive to %s\n", archive_path);
+    return 1;
+  }
+  return 0;
+}
+/*}}}*/
+/*}}}*/
+/*{{{ Link target kinds */
+/* Whether the things other packages' links point at are directories,
+ * remembered for the rest of the run by the path they resolve to : the same
+ * targets are looked at again by the install after the pre-install check, and
+ * again for each extra link area.  The package trees don't change under a
+ * run. */
+static struct strtab *target_kinds = NULL;
+static const enum dest_type kind_dir = DT_LINK_OTHER_DIR;
+static const enum dest_type kind_file = DT_LINK_OTHER_FILE;
+
+static enum dest_type other_link_kind(const char *full_dest_path, const char *linkbuf)/*{{{*/
+{
+  /* DT_LINK_OTHER_DIR or DT_LINK_OTHER_FILE for the link at 'full_dest_path'
+   * to 'linkbuf', or DT_ERROR if it's stale. */
+  char target[2 * PATH_MAX];
+  struct strtab_node *node;
+  struct stat lsb;
+  const char *key;
+  char *real_path;
+  int status;
+
+  if (linkbuf[0] == '/') {
+    key = linkbuf;
+  } else {
+    const char *slash = strrchr(full_dest_path, '/');
+    int dir_len = slash ? (slash - full_dest_path + 1) : 0;
+    if (dir_len + strlen(linkbuf) < sizeof(target)) {
+      memcpy(target, full_dest_path, dir_len);
+      strcpy(target + dir_len, linkbuf);
+      key = target;
+    } else {
+      key = NULL;
+    }
+  }
+  if (!target_kinds) target_kinds = new_strtab();
+  node = key ? strtab_find(target_kinds, key) : NULL;
+  if (node) return *(const enum dest_type *) node->value;
+
+  real_path = dest_resolve(full_dest_path);
+  status = meta_stat(AT_FDCWD, real_path, 0, STATX_TYPE, &lsb);
+  free(real_path);
+  if (status < 0) {
+    fprintf(stderr, "** ERROR, link at <%s> is stale, remove this and retry!\n", full_dest_path);
+    return DT_ERROR;
+  }
+  if (!key) return S_ISDIR(lsb.st_mode) ? DT_LINK_OTHER_DIR : DT_LINK_OTHER_FILE;
+  node = strtab_insert(target_kinds, key);
+  node->value = (void *) (S_ISDIR(lsb.st_mode) ? &kind_dir : &kind_file);
+  return *(const enum dest_type *) node->value;
+}
+/*}}}*/
+/*}}}*/
+/*{{{ Materialised links */
+/* Where each package's current version is installed, by link area, for
+ * recognising the hard links an install made before they were listed. */
+static struct strtab *recorded_areas = NULL;
+
+/* The hard links listed in each package's record, by link area */
+struct recorded_link {/*{{{*/
+  unsigned long long dev;
+  unsigned long long ino;
+  char *version;
+};
+/*}}}*/
+static struct strtab *recorded_links = NULL;
+
+static char *links_path(const char *dest_path, const char *pkg)/*{{{*/
+{
+  char *name, *result;
+  name = caten(LINKS_PREFIX, pkg);
+  result = dfcaten3(dest_path, RECORD_DIR, name);
+  free(name);
+  return result;
+}
+/*}}}*/
+
+static const char *recorded_area_for(const char *full_dest_path, int tail_len, const char *pkg)/*{{{*/
+{
+  /* The install area recorded for 'pkg' in the link area that
+   * 'full_dest_path' (whose last 'tail_len' characters are the path within
+   * the area) is in, or NULL. */
+  struct strtab_node *node;
+  int area_len = strlen(full_dest_path) - tail_len;
+  char *key = new_array(char, area_len + strlen(pkg) + 2);
+
+  sprintf(key, "%.*s\t%s", area_len, full_dest_path, pkg);
+  if (!recorded_areas) recorded_areas = new_strtab();
+  node = strtab_find(recorded_areas, key);
+  if (!node) {
+    char *area = new_array(char, area_len + 1);
+    memcpy(area, full_dest_path, area_len);
+    area[area_len] = 0;
+    node = strtab_insert(recorded_areas, key);
+    node->value = recorded_install_area(area, pkg);
+    free(area);
+  }
+  free(key);
+  return (const char *) node->value;
+}
+/*}}}*/
+static void free_recorded_link(struct recorded_link *rl)/*{{{*/
+{
+  free(rl->version);
+  free(rl);
+}
+/*}}}*/
+static struct strtab *read_recorded_links(const char *area, const char *pkg)/*{{{*/
+{
+  /* The list of hard links in 'pkg's record in 'area' (see
+   * record_hard_links()), keyed by their paths in the area.  Where a path
+   * was linked more than once, the last is the one that's there. */
+  struct strtab *links = new_strtab();
+  char line[2*PATH_MAX];
+  char *path;
+  FILE *in;
+
+  path = links_path(area, pkg);
+  in = fopen(path, "r");
+  free(path);
+  if (!in) return links;
+  while (fgets(line, sizeof(line), in)) {
+    struct strtab_node *node;
+    struct recorded_link *rl;
+    unsigned long long dev, ino;
+    char *version, *tail;
+    int len = strlen(line);
+    if ((len > 0) && (line[len-1] == '\n')) line[--len] = 0;
+    version = strchr(line, '\t');
+    if (!version) continue;
+    *version++ = 0;
+    tail = strchr(version, '\t');
+    if (!tail) continue;
+    *tail++ = 0;
+    if (sscanf(line, "%llu %llu", &dev, &ino) != 2) continue;
+    node = strtab_insert(links, tail);
+    if (node->value) free_recorded_link((struct recorded_link *) node->value);
+    rl = new(struct recorded_link);
+    rl->dev = dev;
+    rl->ino = ino;
+    rl->version = new_string(version);
+    node->value = rl;
+  }
+  fclose(in);
+  return links;
+}
+/*}}}*/
+static const struct recorded_link *recorded_link_for(const char *full_dest_path, int tail_len,/*{{{*/
+                                                     const char *pkg)
+{
+  /* The entry in 'pkg's list of hard links for 'full_dest_path' (whose last
+   * 'tail_len' characters are the path within the area), or NULL. */
+  struct strtab_node *node;
+  int area_len = strlen(full_dest_path) - tail_len;
+  char *key = new_array(char, area_len + strlen(pkg) + 2);
+
+  sprintf(key, "%.*s\t%s", area_len, full_dest_path, pkg);
+  if (!recorded_links) recorded_links = new_strtab();
+  node = strtab_find(recorded_links, key);
+  if (!node) {
+    char *area = new_array(char, area_len + 1);
+    memcpy(area, full_dest_path, area_len);
+    area[area_len] = 0;
+    node = strtab_insert(recorded_links, key);
+    node->value = read_recorded_links(area, pkg);
+    free(area);
+  }
+  free(key);
+  node = strtab_find((struct strtab *) node->value, full_dest_path + area_len);
+  return node ? (const struct recorded_link *) node->value : NULL;
+}
+/*}}}*/
+static void forget_recorded_areas(void)/*{{{*/
+{
+  /* After an install or a removal has changed the records */
+  int i, j;
+  if (recorded_areas) {
+    for (i=0; i<recorded_areas->size; i++) {
+      struct strtab_node *n;
+      for (n = recorded_areas->buckets[i]; n; n = n->next) {
+        if (n->value) free(n->value);
+      }
+    }
+    strtab_free(recorded_areas);
+    recorded_areas = NULL;
+  }
+  if (recorded_links) {
+    for (i=0; i<recorded_links->size; i++) {
+      struct strtab_node *n;
+      for (n = recorded_links->buckets[i]; n; n = n->next) {
+        struct strtab *links = (struct strtab *) n->value;
+        for (j=0; j<links->size; j++) {
+          struct strtab_node *m;
+          for (m = links->buckets[j]; m; m = m->next) free_recorded_link((struct recorded_link *) m->value);
+        }
+        strtab_free(links);
+      }
+    }
+    strtab_free(recorded_links);
+    recorded_links = NULL;
+  }
+}
+/*}}}*/
+static int copy_is_current(const char *full_dest_path, const char *full_src_path)/*{{{*/
+{
+  /* Was the reflinked copy at 'full_dest_path' made from the file now at
+   * 'full_src_path'?  A copy made before the source was recorded isn't. */
+  char stamp[128], now[128];
+  struct stat sb;
+  int len;
+
+  len = lgetxattr(full_dest_path, SOURCE_XATTR, stamp, sizeof(stamp) - 1);
+  if (len <= 0) return 0;
+  stamp[len] = 0;
+  if (meta_stat(AT_FDCWD, full_src_path, AT_SYMLINK_NOFOLLOW,
+                STATX_INO | STATX_SIZE | STATX_MTIME, &sb) < 0) return 0;
+  source_stamp(&sb, now, sizeof(now));
+  return !strcmp(stamp, now);
+}
+/*}}}*/
+static enum dest_type materialised_kind(const char *full_dest_path,/*{{{*/
+                                        const char *full_src_path,
+                                        const char *tail_part, int tail_len,
+                                        const char *pkg, const char *version,
+                                        const char **res_other_pkg,
+                                        const char **res_other_version)
+{
+  /* A regular file in the link area : see whether spill put it there in
+   * place of a link, and if so classify it as the link would have been.
+   * One that was made from this version, but from the file as it was before
+   * being replaced, counts as of another version, so that it's replaced too.
+   * A copy carries the path it came from; a hard link is only known for the
+   * package being worked on, by matching the file in this version or by the
+   * list in the package's record. */
+  char origin[PATH_MAX];
+  const struct link_prefix *lp;
+  const struct recorded_link *rl;
+  const char *old_area;
+  struct stat dsb, ssb;
+  char *old_path;
+  int len, same;
+
+  len = lgetxattr(full_dest_path, ORIGIN_XATTR, origin, PATH_MAX - 1);
+  if (len > 0) {
+    origin[len] = 0;
+    lp = decode_link_target(origin, len, tail_part, tail_len);
+    if (!lp) return DT_OTHER;
+    if (res_other_pkg) *res_other_pkg = lp->pkg;
+    if (res_other_version) *res_other_version = lp->version;
+    if (strcmp(lp->pkg, pkg)) return DT_LINK_OTHER_FILE;
+    if (strcmp(lp->version, version)) return DT_LINK_SAME_OTHER;
+    return copy_is_current(full_dest_path, full_src_path) ? DT_LINK_EXACT : DT_LINK_SAME_OTHER;
+  }
+
+  if (meta_stat(AT_FDCWD, full_dest_path, AT_SYMLINK_NOFOLLOW, STATX_NLINK | STATX_INO, &dsb) < 0) {
+    return DT_OTHER;
+  }
+  if ((dsb.st_nlink > 1) && (meta_stat(AT_FDCWD, full_src_path, 0, STATX_INO, &ssb) == 0) &&
+      (ssb.st_dev == dsb.st_dev) && (ssb.st_ino == dsb.st_ino)) {
+    return DT_LINK_EXACT;
+  }
+  rl = recorded_link_for(full_dest_path, tail_len, pkg);
+  if (rl && (rl->dev == (unsigned long long) dsb.st_dev) && (rl->ino == (unsigned long long) dsb.st_ino)) {
+    if (res_other_pkg) *res_other_pkg = pkg;
+    if (res_other_version) *res_other_version = rl->version;
+    return DT_LINK_SAME_OTHER;
+  }
+  if (dsb.st_nlink < 2) return DT_OTHER;
+  old_area = recorded_area_for(full_dest_path, tail_len, pkg);
+  if (!old_area) return DT_OTHER;
+  old_path = caten(old_area, tail_part);
+  same = (meta_stat(AT_FDCWD, old_path, 0, STATX_INO, &ssb) == 0) &&
+         (ssb.st_dev == dsb.st_dev) && (ssb.st_ino == dsb.st_ino);
+  free(old_path);
+  if (!same) return DT_OTHER;
+  lp = lookup_link_prefix((char *) old_area, strlen(old_area));
+  if (res_other_pkg) *res_other_pkg = lp->pkg;
+  if (res_other_version) *res_other_version = lp->version;
+  return DT_LINK_SAME_OTHER;
+}
+/*}}}*/
+/*}}}*/
+static int is_exact_link(const char *linkbuf, const char *relative_path,/*{{{*/
+                         const char *full_src_path, const char *tail_part)
+{
+  /* Does the link point where a new link to this entry would : the relative
+   * path and the entry's place in the package, or the full source path? */
+  int len;
+  if (!relative_path) return !strcmp(linkbuf, full_src_path);
+  len = strlen(relative_path);
+  return !strncmp(linkbuf, relative_path, len) && !strcmp(linkbuf + len, tail_part);
+}
+/*}}}*/
+/*{{{ Flattened links */
+/* Packages often link one of their files to another in the same directory
+ * (lib/libfoo.so -> libfoo.so.1 -> libfoo.so.1.2.3).  With --flatten, the link
+ * in the link area goes straight to the last file of such a chain, saving
+ * everything that uses it the hops in between.  A flattened link ends with
+ * the name of a different entry in the same directory of the package, so the
+ * package it belongs to is found from the directory part of its target. */
+
+#define MAX_FLATTEN_HOPS 16
+
+static int flatten_links = 0;
+
+static int flatten_source(const char *full_src_path, char *name, int size)/*{{{*/
+{
+  /* If the package's entry at 'full_src_path' is a link to another entry in
+   * the same directory, perhaps by way of several, put the name of the last
+   * of them into 'name' and return 1, else return 0. */
+  char path[PATH_MAX], target[PATH_MAX];
+  const char *slash = strrchr(full_src_path, '/');
+  int dir_len = slash ? (slash - full_src_path + 1) : 0;
+  struct stat sb;
+  int hops, len;
+
+  if (strlen(full_src_path) >= sizeof(path)) return 0;
+  strcpy(path, full_src_path);
+  for (hops=0; hops<MAX_FLATTEN_HOPS; hops++) {
+    len = meta_readlink(AT_FDCWD, path, target, sizeof(target) - 1);
+    if (len < 0) break;
+    target[len] = 0;
+    /* Only chains that stay in the directory */
+    if (strchr(target, '/') || !strcmp(target, ".") || !strcmp(target, "..")) break;
+    if ((dir_len + len >= (int) sizeof(path)) || (len >= size)) return 0;
+    strcpy(path + dir_len, target);
+    strcpy(name, target);
+  }
+  if (hops == MAX_FLATTEN_HOPS) return 0;  /* going round in circles */
+  return (hops > 0) && (meta_stat(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &sb) == 0);
+}
+/*}}}*/
+static char *make_linked_path(const char *relative_path, const char *full_src_path,/*{{{*/
+                              const char *taildir, const char *tailfile, int flatten)
+{
+  /* What a link to the entry should point at : relative to where the link
+   * goes if the package is being linked relatively, and to the end of the
+   * entry's chain of links if 'flatten' is set. */
+  char name[PATH_MAX];
+  const char *file = tailfile;
+  char *tail, *result;
+
+  if (flatten && flatten_source(full_src_path, name, sizeof(name))) file = name;
+  if (relative_path) {
+    tail = dfcaten(taildir, file);
+    result = caten(relative_path, tail);
+    free(tail);
+  } else if (file == tailfile) {
+    result = new_string(full_src_path);
+  } else {
+    const char *slash = strrchr(full_src_path, '/');
+    int dir_len = slash ? (slash - full_src_path + 1) : 0;
+    result = new_array(char, dir_len + strlen(file) + 1);
+    memcpy(result, full_src_path, dir_len);
+    strcpy(result + dir_len, file);
+  }
+  return result;
+}
+/*}}}*/
+static int flattened_prefix_len(const char *full_dest_path, const char *linkbuf,/*{{{*/
+                                const char *tail_part)
+{
+  /* If the link at 'full_dest_path' to 'linkbuf' is a flattened link for the
+   * entry at 'tail_part' in some package, return the length of the part of
+   * 'linkbuf' that leads to the package, else -1.  To be one, the directory
+   * part of the target has to be the entry's directory in a package, and
+   * that package's own entry has to be a link. */
+  const char *name = strrchr(tail_part, '/');
+  const char *slash = strrchr(linkbuf, '/');
+  char path[2 * PATH_MAX];
+  struct stat sb;
+  int dir_len = name - tail_part;
+  int prefix_len;
+
+  if (!slash || !name) return -1;
+  if (!strcmp(slash + 1, name + 1)) return -1; /* not flattened */
+  prefix_len = (slash - linkbuf) - dir_len;
+  if (prefix_len < 0) return -1;
+  if (strncmp(linkbuf + prefix_len, tail_part, dir_len)) return -1;
+
+  /* Where the package's entry is, from where the link is */
+  if (linkbuf[0] == '/') {
+    snprintf(path, sizeof(path), "%.*s%s", prefix_len, linkbuf, tail_part);
+  } else {
+    const char *dest_slash = strrchr(full_dest_path, '/');
+    int dest_dir_len = dest_slash ? (dest_slash - full_dest_path + 1) : 0;
+    snprintf(path, sizeof(path), "%.*s%.*s%s", dest_dir_len, full_dest_path, prefix_len, linkbuf, tail_part);
+  }
+  if ((meta_stat(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &sb) < 0) ||
+      !S_ISLNK(sb.st_mode)) return -1;
+  return prefix_len;
+}
+/*}}}*/
+static const struct link_prefix *decode_flattened_link(const char *full_dest_path,/*{{{*/
+                                                       char *linkbuf, int link_len,
+                                                       const char *tail_part)
+{
+  /* The package and version of a flattened link (see flattened_prefix_len()),
+   * else NULL */
+  int prefix_len = flattened_prefix_len(full_dest_path, linkbuf, tail_part);
+  return (prefix_len < 0) ? NULL : lookup_link_prefix(linkbuf, prefix_len);
+}
+/*}}}*/
+static int link_is_exact(const char *linkbuf, int link_len, const char *relative_path,/*{{{*/
+                         const char *full_src_path, const char *taildir,
+                         const char *tailfile, const char *tail_part)
+{
+  /* Does the link point where a new link to this entry would, flattened or
+   * not?  Either way counts whether or not --flatten was given this time, so
+   * that the links are removed along with their package. */
+  int tail_len = strlen(tail_part);
+  int result;
+  char *flat;
+
+  if ((link_len >= tail_len) && !strcmp(linkbuf + link_len - tail_len, tail_part)) {
+    return is_exact_link(linkbuf, relative_path, full_src_path, tail_part);
+  }
+  flat = make_linked_path(relative_path, full_src_path, taildir, tailfile, 1);
+  result = !strcmp(linkbuf, flat);
+  free(flat);
+  return result;
+}
+/*}}}*/
+/*}}}*/
+static int being_removed(const char *full_dest_path, int tail_len,/*{{{*/
+                         enum dest_type type, const char *other_pkg)
+{
+  /* Does what's at 'full_dest_path', of kind 'type', belong to one of the
+   * packages about to be removed?  A hard link is known by its package's list. */
+  struct stat sb;
+  int i;
+
+  switch (type) {
+    case DT_LINK_OTHER_FILE:
+    case DT_LINK_OTHER_DIR:
+      for (i=0; other_pkg && (i<n_removing_pkgs); i++) {
+        if (!strcmp(removing_pkgs[i], other_pkg)) return 1;
+      }
+      return 0;
+    case DT_OTHER:
+      if (meta_stat(AT_FDCWD, full_dest_path, AT_SYMLINK_NOFOLLOW, STATX_INO, &sb) < 0) return 0;
+      for (i=0; i<n_removing_pkgs; i++) {
+        const struct recorded_link *rl = recorded_link_for(full_dest_path, tail_len, removing_pkgs[i]);
+        if (rl && (rl->dev == (unsigned long long) sb.st_dev) &&
+            (rl->ino == (unsigned long long) sb.st_ino)) return 1;
+      }
+      return 0;
+    default:
+      return 0;
+  }
+}
+/*}}}*/
+/* While the library plans an install with expansion, the directory links
+ * that are to be expanded, each with its target (or the target it will
+ * have, if it's inside another of them).  The check goes on underneath them
+ * as though do_expand() had already filled them with links, so nothing is
+ * written until the plan is applied. */
+static struct strtab *planned_expansions = NULL;
+static char **planned_order = NULL;  /* outermost first */
+static int n_planned = 0, max_planned = 0;
+
+static int expanded_link(const char *path, char *buf, int size)/*{{{*/
+{
+  /* If 'path' is in a planned expansion, put the target of the link that
+   * do_expand() will make there into 'buf' and return its length, else -1. */
+  const char *slash = strrchr(path, '/');
+  struct strtab_node *node;
+  char parent[PATH_MAX];
+  const char *target;
+  int len;
+
+  if (!slash || (slash - path >= PATH_MAX)) return -1;
+  memcpy(parent, path, slash - path);
+  parent[slash - path] = 0;
+  node = strtab_find(planned_expansions, parent);
+  if (!node) return -1;
+  target = (const char *) node->value;
+  if (target[0] == '/') {
+    len = snprintf(buf, size, "%s/%s", target, slash + 1);
+  } else {
+    len = snprintf(buf, size, "../%s/%s", target, slash + 1);
+  }
+  return (len < size) ? len : -1;
+}
+/*}}}*/
+static int plan_expansion(const char *dir_link)/*{{{*/
+{
+  /* Note that 'dir_link' is to be expanded when the plan is applied */
+  char buffer[PATH_MAX];
+  struct strtab_node *node;
+  int link_len;
+
+  link_len = expanded_link(dir_link, buffer, PATH_MAX);
+  if (link_len < 0) link_len = dest_readlink(dir_link, buffer, PATH_MAX - 1);
+  if (link_len < 0) {
+    printf("!! ERROR Could not expand link <%s> into a directory : %s\n",
+           dir_link, strerror(errno));
+    return 1;
+  }
+  buffer[link_len] = 0;
+  node = strtab_insert(planned_expansions, dir_link);
+  if (!node->value) {
+    node->value = new_string(buffer);
+    if (n_planned == max_planned) {
+      max_planned = max_planned ? (max_planned << 1) : 8;
+      planned_order = grow_array(char *, max_planned, planned_order);
+    }
+    planned_order[n_planned++] = new_string(dir_link);
+  }
+  return 0;
+}
+/*}}}*/
+/*{{{ static enum dest_type find_dest_type*/
+static enum dest_type
+find_dest_type(const char *full_dest_path,
+               const char *full_src_path,
+               const char *relative_path,
+               const char *taildir,
+               const char *tailfile,
+               const char *pkg,
+               const char *version,
+               const char **res_other_pkg,
+               const char **res_other_version
+               )
+{
+  /* The package and version that a link belongs to are passed back through
+   * res_other_pkg and res_other_version (if given) as interned strings,
+   * which aren't to be freed. */
+  mode_t dmode;
+  enum dest_type result;
+  char tail_part[PATH_MAX];
+  int tail_len;
+
+  tail_len = snprintf(tail_part, sizeof(tail_part), "%s/%s", taildir, tailfile);
+
+  if (dest_lstat(full_dest_path, &dmode) < 0) {
+    if (errno == ENOENT) {
+      result = DT_VOID;
+      /* Somewhere that several packages in a batch need as a directory */
+      if (batch_dirs && strtab_find(batch_dirs, tail_part)) result = DT_DIRECTORY;
+    } else {
+      fprintf(stderr, "Couldn't stat <%s> : %s!\n", full_dest_path, strerror(errno));
+      result = DT_ERROR;
+    }
+  } else {
+    /* stat ok.  In a planned expansion, whatever is there will be linked to. */
+    char linkbuf[PATH_MAX];
+    int link_len = planned_expansions ? expanded_link(full_dest_path, linkbuf, PATH_MAX - 1) : -1;
+    if (link_len >= 0) dmode = S_IFLNK;
+    if (S_ISDIR(dmode)) {
+      result = DT_DIRECTORY;
+    } else if (S_ISLNK(dmode)) {
+      /* Decide whether the link is to the same package or not. */
+      if (link_len < 0) link_len = dest_readlink(full_dest_path, linkbuf, PATH_MAX - 1);
+      if (link_len < 0) {
+        fprintf(stderr, "Couldn't readlink on <%s> : %s!\n", full_dest_path, strerror(errno));
+        result = DT_ERROR;
+      } else {
+        /* linkbuf is where the link points to. The tail part of it
+         * should be '/tail/de->d_name', the part before this should be
+         * the path to the package base for which the link has already
+         * been installed. */
+        const struct link_prefix *lp;
+        int gen;
+
+        linkbuf[link_len] = 0;
+        if ((tail_len < (int) sizeof(tail_part)) && (gen = generation_link(linkbuf, tail_part)) >= 0) {
+          /* Stands for whatever is at this place in an older generation */
+          if (!generation_mode) {
+            result = DT_DIRECTORY; /* just reading through it */
+          } else {
+            switch (materialise_generation_dir(full_dest_path, tail_part, gen)) {
+              case 0:  result = DT_DIRECTORY; break;
+              case 2:  result = DT_OTHER; break;
+              default: result = DT_ERROR; break;
+            }
+          }
+        } else if (tail_len > link_len) {
+          result = DT_ERROR;
+          /* Obviously can't be a link pointing to an install area like the
+             sort spill creates itself, it must be a link pointing to something
+             else.  No point reporting this specifically, it's just an
+             uncorrectable error. */
+        } else if ((lp = decode_link_target(linkbuf, link_len, tail_part, tail_len)) ||
+                   (lp = decode_flattened_link(full_dest_path, linkbuf, link_len, tail_part))) {
+          /* Matched, deal with prefix. */
+          if (res_other_pkg) *res_other_pkg = lp->pkg;
+          if (res_other_version) *res_other_version = lp->version;
+          if (link_is_exact(linkbuf, link_len, relative_path, full_src_path, taildir, tailfile, tail_part)) {
+            result = DT_LINK_EXACT;
+          } else if (!strcmp(lp->pkg, pkg)) {
+            if (!strcmp(lp->version, version)) {
+              /* Same version */
+              /* FIXME : what if the links point to another place where the package is installed,
+               * insead of the "source" we're doing now?  Ought to fix this. */
+              result = DT_LINK_SAME_SAME;
+            } else {
+              result = DT_LINK_SAME_OTHER;
+            }
+          } else {
+            /* Links to another package. */
+            /* Check if link is to a directory, then explode it and retry. */
+            result = other_link_kind(full_dest_path, linkbuf);
+          }
+        } else {
+          result = DT_LINK_UNKNOWN;
+        }
+      }
+
+    } else if (S_ISREG(dmode)) {
+      result = materialised_kind(full_dest_path, full_src_path, tail_part, tail_len,
+                                 pkg, version, res_other_pkg, res_other_version);
+    } else {
+      result = DT_OTHER;
+    }
+  }
+
+  if (n_removing_pkgs &&
+      being_removed(full_dest_path, tail_len, result, res_other_pkg ? *res_other_pkg : NULL)) {
+    result = (batch_dirs && strtab_find(batch_dirs, tail_part)) ? DT_DIRECTORY : DT_VOID;
+  }
+  return result;
+}
+/*}}}*/
+
+static void emit_conflict(const char *full_dest_path)/*{{{*/
+{
+  if (conflict_file) {
+    fprintf(conflict_file, "%s\n", full_dest_path);
+  }
+  return;
+}
+/*}}}*/
+static int files_differ(const char *name1, const char *name2)/*{{{*/
+{
+  /* Return 0 if files match, 1 if they differ, 2 if there was a problem. */
+  FILE *x1, *x2;
+  struct stat sb;
+
+  if ((meta_stat(AT_FDCWD, name1, 0, STATX_TYPE, &sb) < 0) || (!S_ISREG(sb.st_mode))) return 2;
+  if ((meta_stat(AT_FDCWD, name2, 0, STATX_TYPE, &sb) < 0) || (!S_ISREG(sb.st_mode))) return 2;
+
+  x1 = fopen(name1, "rb");
+  x2 = fopen(name2, "rb");
+  if (x1 && x2) {
+    int result = 0;
+    int c1, c2;
+    do {
+      c1 = getc(x1);
+      c2 = getc(x2);
+      if (c1 == EOF) {
+        if (c2 == EOF) {
+          result = 0;
+          break;
+        } else {
+          result = 1;
+          break;
+        }
+      } else if (c2 == EOF) {
+        result = 1;
+        break;
+      } else if (c1 != c2) {
+        result = 1;
+        break;
+      }
+    } while (1);
+    fclose(x1);
+    fclose(x2);
+    return result;
+  } else {
+    if (x1) fclose(x1);
+    if (x2) fclose(x2);
+    return 2;
+  }
+}
+/*}}}*/
+
+static int expand_batched(const char *dir_link, mode_t mode, const struct dirlist *dl,/*{{{*/
+                          const char *buffer, int is_absolute, struct options *opt)
+{
+  /* do_expand()'s writes as two batches : the link's replacement by a
+   * directory, then the links inside.  Return -1, having done nothing, if
+   * they can't be batched. */
+  struct meta_req *reqs;
+  char **link_sites, **target_sites;
+  int result = 0;
+  int i;
+
+  reqs = new_array(struct meta_req, dl->n + 2);
+  memset(reqs, 0, (dl->n + 2) * sizeof(struct meta_req));
+  reqs[0].op = OP_UNLINK;
+  reqs[0].dir_fd = AT_FDCWD;
+  reqs[0].path = dir_link;
+  reqs[0].chain = 1;
+  reqs[1].op = OP_MKDIR;
+  reqs[1].dir_fd = AT_FDCWD;
+  reqs[1].path = dir_link;
+  reqs[1].mode = mode;
+  if (dest_batch(reqs, 2) < 0) {
+    free(reqs);
+    return -1;
+  }
+  if (reqs[0].err) {
+    printf("!! ERROR Could not remove the link at <%s> : %s\n", dir_link, strerror(reqs[0].err));
+    free(reqs);
+    return 1;
+  }
+  if (reqs[1].err) {
+    printf("!! ERROR Could not create new directory at <%s> : %s\n", dir_link, strerror(reqs[1].err));
+    free(reqs);
+    return 1;
+  }
+
+  link_sites = new_array(char *, dl->n + 1);
+  target_sites = new_array(char *, dl->n + 1);
+  for (i=0; i<dl->n; i++) {
+    link_sites[i] = dfcaten(dir_link, dl->entries[i].name);
+    if (is_absolute) {
+      target_sites[i] = dfcaten(buffer, dl->entries[i].name);
+    } else {
+      target_sites[i] = dfcaten3("..", buffer, dl->entries[i].name);
+    }
+    memset(&reqs[i], 0, sizeof(struct meta_req));
+    reqs[i].op = OP_SYMLINK;
+    reqs[i].dir_fd = AT_FDCWD;
+    reqs[i].path = link_sites[i];
+    reqs[i].target = target_sites[i];
+  }
+  if (dest_batch(reqs, dl->n) < 0) {
+    /* The ring has gone since the first batch */
+    for (i=0; i<dl->n; i++) {
+      reqs[i].err = (dest_symlink(target_sites[i], link_sites[i]) < 0) ? errno : 0;
+    }
+  }
+  for (i=0; i<dl->n; i++) {
+    if (result) continue;
+    if (reqs[i].err) {
+      printf("!! ERROR Could not create symlink from <%s> to <%s> : %s\n",
+             link_sites[i], target_sites[i], strerror(reqs[i].err));
+      result = 1;
+    } else if (!opt->quiet) {
+      printf("** EXPANDDIR Created link from <%s> to <%s>\n",
+             link_sites[i], target_sites[i]);
+    }
+  }
+  for (i=0; i<dl->n; i++) {
+    free(link_sites[i]);
+    free(target_sites[i]);
+  }
+  free(link_sites);
+  free(target_sites);
+  free(reqs);
+  if (!result) install_counts.expansions++;
+  return result;
+}
+/*}}}*/
+static int do_expand(const char *dir_link, struct options *opt)/*{{{*/
+{
+  /* Given the path to a symbolic link that points at a directory, replace that
+     link by a directory, and inside that new directory create symbolic links
+     that point at each entry in the directory to which the removed link used
+     to point.
+
+     If the existing link was absolute, create absolute links.  Otherwise,
+     create relative links.
+
+     Return 1 if an error occurs, 0 otherwise.
+     */
+
+  char buffer[PATH_MAX];
+  char *real_path;
+  int link_len;
+  int is_absolute;
+  struct dirlist *dl;
+  struct stat link_stat;
+  int i;
+
+  link_len = dest_readlink(dir_link, buffer, PATH_MAX - 1);
+  if (link_len < 0) {
+    printf("!! ERROR Could not expand link <%s> into a directory : %s\n",
+           dir_link, strerror(errno));
+    return 1;
+  }
+
+  buffer[link_len] = '\0';
+
+  /* Get the stat record for the directory that the link points to.  We'll use
+     its mode when creating the replacement directory, for want of something
+     better. */
+  real_path = dest_resolve(dir_link);
+  if (meta_stat(AT_FDCWD, real_path, 0, STATX_MODE, &link_stat) < 0) {
+    printf("!! ERROR Could not stat link <%s> : %s\n",
+           buffer, strerror(errno));
+    free(real_path);
+    return 1;
+  }
+
+  is_absolute = (buffer[0] == '/') ? 1 : 0;
+
+  dl = read_dirlist(real_path);
+  free(real_path);
+  if (dl && (dl->n > 1)) {
+    int status = expand_batched(dir_link, link_stat.st_mode, dl, buffer, is_absolute, opt);
+    if (status >= 0) {
+      free_dirlist(dl);
+      return status;
+    }
+  }
+  if (dl) {
+    /* Now clear the link, put a directory in its place and create a set of
+     * links inside. */
+    if (dest_unlink(dir_link) < 0) {
+      printf("!! ERROR Could not remove the link at <%s> : %s\n",
+             dir_link, strerror(errno));
+      free_dirlist(dl);
+      return 1;
+    }
+
+    if (dest_mkdir(dir_link, link_stat.st_mode) < 0) {
+      printf("!! ERROR Could not create new directory at <%s> : %s\n",
+             dir_link, strerror(errno));
+      free_dirlist(dl);
+      return 1;
+    }
+
+    /* Now populate it with links */
+    for (i=0; i<dl->n; i++) {
+      char *link_site, *target_site;
+      link_site = dfcaten(dir_link, dl->entries[i].name);
+      if (is_absolute) {
+        target_site = dfcaten(buffer, dl->entries[i].name);
+      } else {
+        target_site = dfcaten3("..", buffer, dl->entries[i].name);
+      }
+      if (dest_symlink(target_site, link_site) < 0) {
+        printf("!! ERROR Could not create symlink from <%s> to <%s> : %s\n",
+               link_site, target_site, strerror(errno));
+        free_dirlist(dl);
+        return 1;
+      }
+      if (!opt->quiet) {
+        printf("** EXPANDDIR Created link from <%s> to <%s>\n",
+               link_site, target_site);
+      }
+      free(link_site);
+      free(target_site);
+    }
+    free_dirlist(dl);
+    install_counts.expansions++;
+
+  } else {
+    printf("!! ERROR Could not open directory <%s> to read contents : %s\n",
+           dir_link, strerror(errno));
+    return 1;
+  }
+
+  return 0;
+
+}
+/*}}}*/
+/*{{{ Actions */
+/* What to do with each entry of a package tree depends only on the action
+ * being carried out, what's in the package (enum source_type), what's in the
+ * link area (enum dest_type) and the options.  The options are fixed for a
+ * walk, so for each action and set of options the whole decision is worked
+ * out once, into a table with a row for each (source, destination) pair
+ * saying what to do, what to print and what it returns.  The walk then just
+ * looks the row up and carries it out.  Messages that aren't going to be
+ * shown have no format in the row, so a quiet install never formats one. */
+
+enum step {/*{{{*/
+  STEP_REPORT,          /* print the message if any; nothing else */
+  STEP_DESCEND,         /* walk into the directory */
+  STEP_EXPAND,          /* expand the link to a directory, then walk into it */
+  STEP_KEEP,            /* leave the existing link, but count it */
+  STEP_LINK,            /* create a new link */
+  STEP_RELINK,          /* replace an old link of the package's */
+  STEP_OVERRIDE,        /* replace another package's link */
+  STEP_UNLINK           /* remove the package's link */
+};
+/*}}}*/
+enum message_args {/*{{{*/
+  MA_DEST,              /* dest */
+  MA_SRC,               /* full source path */
+  MA_LINKED,            /* link target */
+  MA_DEST_LINKED,       /* dest, link target */
+  MA_DEST_PKG,          /* dest, package */
+  MA_DEST_OTHER,        /* dest, other version, other package */
+  MA_DEST_DIFF,         /* dest, content comparison */
+  MA_DEST_OTHER_DIFF    /* dest, other version, other package, comparison */
+};
+/*}}}*/
+struct action_entry {/*{{{*/
+  enum step step;
+  const char *fmt;      /* NULL if nothing is printed */
+  enum message_args args;
+  unsigned to_stderr:1;
+  unsigned conflict:1;  /* write the path to the conflict list */
+  int result;           /* returned unless the step itself fails */
+};
+/*}}}*/
+#define N_SOURCE_TYPES (ST_OTHER + 1)
+#define N_DEST_TYPES (DT_OTHER + 1)
+struct action_table {/*{{{*/
+  enum action action;
+  struct action_entry e[N_SOURCE_TYPES][N_DEST_TYPES];
+};
+/*}}}*/
+/* One table for each action and combination of the options that matter */
+#define N_OPTION_SETS 16
+static struct action_table *action_tables[N_ACTIONS][N_OPTION_SETS];
+
+struct entry_context {/*{{{*/
+  const char *relative_path;
+  const char *full_src_path;
+  const char *full_dest_path;
+  const char *taildir;
+  const char *tailfile;
+  const char *pkg;
+  const char *other_pkg;
+  const char *other_version;
+  enum source_type src_type;
+  enum dest_type dest_type;
+  struct options *opt;
+  char *linked_path;    /* worked out when first needed */
+};
+/*}}}*/
+
+static void set_entry(struct action_entry *e, enum step step,/*{{{*/
+                      const char *fmt, enum message_args args, int result)
+{
+  e->step = step;
+  e->fmt = fmt;
+  e->args = args;
+  e->to_stderr = 0;
+  e->conflict = 0;
+  e->result = result;
+}
+/*}}}*/
+static void set_conflict(struct action_entry *e, const char *fmt, enum message_args args)/*{{{*/
+{
+  set_entry(e, STEP_REPORT, fmt, args, 1);
+  e->conflict = 1;
+}
+/*}}}*/
+static void fill_pre_install(struct action_entry (*e)[N_DEST_TYPES], const struct options *opt)/*{{{*/
+{
+  /* Messages about what would be done only appear on a dry run (otherwise
+   * the user gets them twice) */
+  int verbose = opt->dry_run && !opt->quiet;
+  struct action_entry *d = e[ST_DIR];
+  struct action_entry *o = e[ST_OTHER];
+  int i;
+
+  for (i=0; i<N_DEST_TYPES; i++) {
+    set_entry(&e[ST_ERROR][i], STEP_REPORT, "Could not examine source <%s>!\n", MA_LINKED, 1);
+    e[ST_ERROR][i].to_stderr = 1;
+  }
+
+  set_entry(&d[DT_VOID], STEP_REPORT,
+            verbose ? "** NEWDIRLINK from <%s> to <%s>\n" : NULL, MA_DEST_LINKED, 0);
+  set_conflict(&d[DT_ERROR], "!! ERROR can't examine path <%s>\n", MA_DEST);
+  set_entry(&d[DT_LINK_EXACT], STEP_REPORT,
+            verbose ? "** OK dir <%s> already linked to the required path\n" : NULL, MA_DEST, 0);
+  set_entry(&d[DT_LINK_SAME_SAME], STEP_REPORT,
+            verbose ? "** REPLACEDIR dir <%s> linked to <%s> through another path\n" : NULL, MA_DEST_PKG, 0);
+  set_entry(&d[DT_LINK_SAME_OTHER], STEP_REPORT,
+            verbose ? "** REPLACEDIR <%s> linked to other version <%s> of package <%s>\n" : NULL, MA_DEST_OTHER, 0);
+  if (opt->expand) {
+    set_entry(&d[DT_LINK_OTHER_DIR], STEP_EXPAND, NULL, MA_DEST, 0);
+  } else {
+    /* User has to manually resolve this one. */
+    set_entry(&d[DT_LINK_OTHER_DIR], STEP_REPORT,
+              "!! NEEDEXPN <%s> linked to a directory in version <%s> of package <%s>\n", MA_DEST_OTHER, 1);
+  }
+  set_entry(&d[DT_DIRECTORY], STEP_DESCEND, NULL, MA_DEST, 0);
+  if (opt->override) {
+    set_entry(&d[DT_LINK_OTHER_FILE], STEP_REPORT,
+              "** OVERRIDE <%s> linked to a non-directory in version <%s> of package <%s>\n", MA_DEST_OTHER, 0);
+    set_entry(&d[DT_LINK_UNKNOWN], STEP_REPORT,
+              "** OVERWRITE <%s> linked to something I don't understand\n", MA_DEST, 0);
+  } else {
+    set_conflict(&d[DT_LINK_OTHER_FILE],
+                 "!! CONFLICT <%s> linked to a non-directory in version <%s> of package <%s>\n", MA_DEST_OTHER);
+    set_conflict(&d[DT_LINK_UNKNOWN], "!! CONFLICT <%s> linked to something I don't understand\n", MA_DEST);
+  }
+  set_conflict(&d[DT_OTHER], "!! CONFLICT <%s> is not a link or directory\n", MA_DEST);
+
+  set_entry(&o[DT_VOID], STEP_REPORT,
+            verbose ? "** NEWLINK from <%s> to <%s>\n" : NULL, MA_DEST_LINKED, 0);
+  set_conflict(&o[DT_ERROR], "!! ERROR can't examine path <%s>\n", MA_DEST);
+  set_entry(&o[DT_LINK_EXACT], STEP_REPORT,
+            verbose ? "** OK <%s> already linked to the required path\n" : NULL, MA_DEST, 0);
+  set_entry(&o[DT_LINK_SAME_SAME], STEP_REPORT,
+            verbose ? "** REPLACE <%s> linked to <%s> through another path\n" : NULL, MA_DEST_PKG, 0);
+  set_entry(&o[DT_LINK_SAME_OTHER], STEP_REPORT,
+            verbose ? "** REPLACE <%s> linked to other version <%s> of package <%s>\n" : NULL, MA_DEST_OTHER, 0);
+  if (opt->override) {
+    set_entry(&o[DT_LINK_OTHER_DIR], STEP_REPORT,
+              "** OVERRIDE <%s> linked to a directory in version <%s> of package <%s>\n", MA_DEST_OTHER, 0);
+    set_entry(&o[DT_LINK_OTHER_FILE], STEP_REPORT,
+              "** OVERRIDE <%s> linked to a non-directory in version <%s> of package <%s>%s\n", MA_DEST_OTHER_DIFF, 0);
+    set_entry(&o[DT_LINK_UNKNOWN], STEP_REPORT,
+              "** OVERWRITE <%s> linked to something I don't understand%s\n", MA_DEST_DIFF, 0);
+  } else {
+    set_conflict(&o[DT_LINK_OTHER_DIR],
+                 "!! CONFLICT <%s> linked to a directory in version <%s> of package <%s>\n", MA_DEST_OTHER);
+    set_conflict(&o[DT_LINK_OTHER_FILE],
+                 "!! CONFLICT <%s> linked to a non-directory in version <%s> of package <%s>\n", MA_DEST_OTHER);
+    set_conflict(&o[DT_LINK_UNKNOWN], "!! CONFLICT <%s> linked to something I don't understand\n", MA_DEST);
+  }
+  set_conflict(&o[DT_DIRECTORY], "!! CONFLICT <%s> is a directory, can't link to <%s>\n", MA_DEST_LINKED);
+  set_conflict(&o[DT_OTHER], "!! CONFLICT <%s> is not a link or directory, can't link to <%s>\n", MA_DEST_LINKED);
+}
+/*}}}*/
+static void fill_install(struct action_entry (*e)[N_DEST_TYPES], const struct options *opt)/*{{{*/
+{
+  /* Anything the pre-install check would have stopped is a calamity here */
+  int quiet = opt->quiet;
+  struct action_entry *d = e[ST_DIR];
+  struct action_entry *o = e[ST_OTHER];
+  int i, j;
+
+  for (i=0; i<N_DEST_TYPES; i++) {
+    set_entry(&e[ST_ERROR][i], STEP_REPORT, "Could not examine source <%s>!\n", MA_SRC, 1);
+    e[ST_ERROR][i].to_stderr = 1;
+  }
+  for (i=ST_DIR; i<N_SOURCE_TYPES; i++) {
+    for (j=0; j<N_DEST_TYPES; j++) {
+      set_entry(&e[i][j], STEP_REPORT,
+                "!! CALAMITY : I shouldn't be here, my pre-install check should have failed (problem path=<%s>)!\n",
+                MA_DEST, 1);
+    }
+  }
+
+  set_entry(&d[DT_VOID], STEP_LINK,
+            quiet ? NULL : "** NEWDIRLINK from <%s> to <%s>\n", MA_DEST_LINKED, 0);
+  /* Link already exists pointing to the right place.  No-op for installing. */
+  set_entry(&d[DT_LINK_EXACT], STEP_KEEP,
+            quiet ? NULL : "** OK dir <%s> already linked to the required path <%s>\n", MA_DEST_LINKED, 0);
+  set_entry(&d[DT_LINK_SAME_SAME], STEP_RELINK,
+            quiet ? NULL : "** REPLACEDIR <%s> previously linked to version <%s> of package <%s>\n", MA_DEST_OTHER, 0);
+  d[DT_LINK_SAME_OTHER] = d[DT_LINK_SAME_SAME];
+  set_entry(&d[DT_DIRECTORY], STEP_DESCEND, NULL, MA_DEST, 0);
+
+  set_entry(&o[DT_VOID], STEP_LINK,
+            quiet ? NULL : "** NEWLINK from <%s> to <%s>\n", MA_DEST_LINKED, 0);
+  set_entry(&o[DT_LINK_EXACT], STEP_KEEP,
+            quiet ? NULL : "** OK <%s> already linked to required path <%s>\n", MA_DEST_LINKED, 0);
+  set_entry(&o[DT_LINK_SAME_SAME], STEP_RELINK,
+            quiet ? NULL : "** REPLACE <%s> previously linked to other version <%s> of package <%s>\n", MA_DEST_OTHER, 0);
+  o[DT_LINK_SAME_OTHER] = o[DT_LINK_SAME_SAME];
+
+  if (opt->override) {
+    set_entry(&d[DT_LINK_OTHER_DIR], STEP_OVERRIDE,
+              quiet ? NULL : "** NEWDIRLINK (OVERRIDE) from <%s> to <%s>\n", MA_DEST_LINKED, 0);
+    d[DT_LINK_OTHER_FILE] = d[DT_LINK_UNKNOWN] = d[DT_LINK_OTHER_DIR];
+    set_entry(&o[DT_LINK_OTHER_DIR], STEP_OVERRIDE,
+              quiet ? NULL : "** NEWLINK (OVERRIDE) from <%s> to <%s>\n", MA_DEST_LINKED, 0);
+    o[DT_LINK_OTHER_FILE] = o[DT_LINK_UNKNOWN] = o[DT_LINK_OTHER_DIR];
+  }
+}
+/*}}}*/
+static void fill_soft_delete(struct action_entry (*e)[N_DEST_TYPES], const struct options *opt)/*{{{*/
+{
+  /* Only links into the package are removed; anything else where one was
+   * expected is just noted.  Failing to remove a link is the only error. */
+  int i, j;
+
+  for (i=0; i<N_DEST_TYPES; i++) {
+    set_entry(&e[ST_ERROR][i], STEP_REPORT, "Could not examine source <%s>!\n", MA_SRC, 0);
+    e[ST_ERROR][i].to_stderr = 1;
+  }
+  for (i=ST_DIR; i<N_SOURCE_TYPES; i++) {
+    for (j=0; j<N_DEST_TYPES; j++) {
+      set_entry(&e[i][j], STEP_REPORT,
+                opt->quiet ? NULL : "!! WARNING : expected link not found at <%s>\n", MA_DEST, 0);
+    }
+    set_entry(&e[i][DT_LINK_EXACT], STEP_UNLINK,
+              opt->quiet ? NULL : "** SUCCESS : removed link at <%s>\n", MA_DEST, 0);
+  }
+  set_entry(&e[ST_DIR][DT_DIRECTORY], STEP_DESCEND, NULL, MA_DEST, 0);
+}
+/*}}}*/
+static void fill_list_owned(struct action_entry (*e)[N_DEST_TYPES], const struct options *opt)/*{{{*/
+{
+  /* Print each link into the package */
+  int i, j;
+
+  (void) opt;
+  for (i=0; i<N_SOURCE_TYPES; i++) {
+    for (j=0; j<N_DEST_TYPES; j++) {
+      set_entry(&e[i][j], STEP_REPORT, NULL, MA_DEST, 0);
+    }
+    set_entry(&e[i][DT_LINK_EXACT], STEP_REPORT, "%s\n", MA_DEST, 0);
+    e[i][DT_LINK_SAME_SAME] = e[i][DT_LINK_EXACT];
+  }
+  set_entry(&e[ST_DIR][DT_DIRECTORY], STEP_DESCEND, NULL, MA_DEST, 0);
+}
+/*}}}*/
+static enum dest_type action_dest_type(enum action action, enum dest_type dest_type,/*{{{*/
+                                       const char *version, const char *other_version)
+{
+  /* A file materialised from the very version being removed or listed, but
+   * whose source has been replaced since, is classed as of another version
+   * so that an install replaces it; it's still one of the package's own. */
+  if (((action == ACT_SOFT_DELETE) || (action == ACT_LIST_OWNED)) &&
+      (dest_type == DT_LINK_SAME_OTHER) && other_version && !strcmp(other_version, version)) {
+    return DT_LINK_EXACT;
+  }
+  return dest_type;
+}
+/*}}}*/
+static const struct action_table *get_action_table(enum action action, const struct options *opt)/*{{{*/
+{
+  /* The table for 'action' with the options in 'opt', made the first time
+   * it's needed.  (force doesn't affect anything done per entry.) */
+  struct action_table *t;
+  int key;
+
+  key = (opt->quiet ? 1 : 0) | (opt->dry_run ? 2 : 0) |
+        (opt->override ? 4 : 0) | (opt->expand ? 8 : 0);
+  t = action_tables[action][key];
+  if (t) return t;
+
+  t = new(struct action_table);
+  t->action = action;
+  switch (action) {
+    case ACT_PRE_INSTALL: fill_pre_install(t->e, opt); break;
+    case ACT_INSTALL:     fill_install(t->e, opt); break;
+    case ACT_SOFT_DELETE: fill_soft_delete(t->e, opt); break;
+    case ACT_LIST_OWNED:  fill_list_owned(t->e, opt); break;
+  }
+  action_tables[action][key] = t;
+  return t;
+}
+/*}}}*/
+static const char *entry_linked_path(struct entry_context *c)/*{{{*/
+{
+  /* Worked out the first time it's needed */
+  if (!c->linked_path) {
+    c->linked_path = make_linked_path(c->relative_path, c->full_src_path,
+                                      c->taildir, c->tailfile, flatten_links);
+  }
+  return c->linked_path;
+}
+/*}}}*/
+static const char *content_note(struct entry_context *c)/*{{{*/
+{
+  int d = files_differ(c->full_dest_path, entry_linked_path(c));
+  return (d == 0) ? " (content identical)" :
+         (d == 1) ? " (content differs)" : "";
+}
+/*}}}*/
+static char *entry_message(const struct action_entry *e, struct entry_context *c)/*{{{*/
+{
+  const char *dest = c->full_dest_path;
+  if (!e->fmt) return NULL;
+  switch (e->args) {
+    case MA_DEST:            return format_message(e->fmt, dest);
+    case MA_SRC:             return format_message(e->fmt, c->full_src_path);
+    case MA_LINKED:          return format_message(e->fmt, entry_linked_path(c));
+    case MA_DEST_LINKED:     return format_message(e->fmt, dest, entry_linked_path(c));
+    case MA_DEST_PKG:        return format_message(e->fmt, dest, c->pkg);
+    case MA_DEST_OTHER:      return format_message(e->fmt, dest, c->other_version, c->other_pkg);
+    case MA_DEST_DIFF:       return format_message(e->fmt, dest, content_note(c));
+    case MA_DEST_OTHER_DIFF: return format_message(e->fmt, dest, c->other_version, c->other_pkg, content_note(c));
+  }
+  return NULL;
+}
+/*}}}*/
+static int enter_directory(struct entry_context *c)/*{{{*/
+{
+  char *new_tail;
+  char *new_relative_path;
+  int result;
+  new_tail = dfcaten(c->taildir, c->tailfile);
+  new_relative_path = c->relative_path ? dfcaten("..", c->relative_path) : NULL;
+  result = descend(new_relative_path, new_tail);
+  free(new_tail);
+  if (new_relative_path) free(new_relative_path);
+  return result;
+}
+/*}}}*/
+/* When the library plans an install, the rows of the pre-install check that
+ * would stop it are gathered here instead of being printed. */
+static int collecting = 0;
+static struct spill_conflict *collected = NULL;
+static int n_collected = 0, max_collected = 0;
+
+static void collect_conflict(struct entry_context *c, char *message)/*{{{*/
+{
+  /* Keep a note of the row, taking over 'message' */
+  struct spill_conflict *x;
+  if (n_collected == max_collected) {
+    max_collected = max_collected ? (max_collected << 1) : 16;
+    collected = grow_array(struct spill_conflict, max_collected, collected);
+  }
+  x = collected + n_collected++;
+  if ((c->src_type == ST_ERROR) || (c->dest_type == DT_ERROR)) {
+    x->kind = SPILL_ERROR;
+  } else if ((c->src_type == ST_DIR) && (c->dest_type == DT_LINK_OTHER_DIR)) {
+    x->kind = SPILL_NEEDS_EXPAND;
+  } else {
+    x->kind = SPILL_CONFLICT;
+  }
+  x->path = new_string(c->full_dest_path);
+  x->other_pkg = c->other_pkg ? new_string(c->other_pkg) : NULL;
+  x->other_version = c->other_version ? new_string(c->other_version) : NULL;
+  x->message = message;
+}
+/*}}}*/
+static int run_entry(const struct action_table *t, const struct action_entry *e,/*{{{*/
+                     struct entry_context *c)
+{
+  /* Carry out one row of the table.  For the install, all the writes and
+   * everything printed to stdout go through install_link() so that they can
+   * be handed to the pipeline's writer stage in order. */
+  char *message;
+  int result = e->result;
+  /* A generation copies its parent's entries as links, so stays with them */
+  const char *source = ((materialise_mode == MAT_SYMLINK) || generation_mode) ? NULL : c->full_src_path;
+
+  switch (e->step) {
+    case STEP_REPORT:
+      message = entry_message(e, c);
+      if (collecting && (e->result || e->conflict)) {
+        collect_conflict(c, message);
+        break;
+      }
+      if (!message) break;
+      if (e->to_stderr) {
+        fputs(message, stderr);
+        free(message);
+      } else if (t->action == ACT_INSTALL) {
+        install_link(WK_MESSAGE, 0, NULL, NULL, NULL, message);
+      } else {
+        fputs(message, stdout);
+        free(message);
+      }
+      break;
+    case STEP_EXPAND:
+      if (planned_expansions) {
+        result = plan_expansion(c->full_dest_path);
+      } else {
+        result = do_expand(c->full_dest_path, c->opt);
+      }
+      if (result) break; /* Error occurred whilst expanding, don't proceed */
+      /* OK, expansion worked, now treat as though it's a directory. */
+      /* fall through */
+    case STEP_DESCEND:
+      result = enter_directory(c);
+      break;
+    case STEP_KEEP:
+      install_counts.links++;
+      result = install_link(WK_MESSAGE, 0, NULL, NULL, NULL, entry_message(e, c));
+      break;
+    case STEP_LINK:
+      message = entry_message(e, c);
+      result = install_link(WK_LINK, 0, entry_linked_path(c), source, c->full_dest_path, message);
+      break;
+    case STEP_RELINK:
+      message = entry_message(e, c);
+      result = install_link(WK_RELINK, 0, entry_linked_path(c), source, c->full_dest_path, message);
+      break;
+    case STEP_OVERRIDE:
+      message = entry_message(e, c);
+      result = install_link(WK_RELINK, 1, entry_linked_path(c), source, c->full_dest_path, message);
+      break;
+    case STEP_UNLINK:
+      if (dest_unlink(c->full_dest_path) < 0) {
+        printf("!! FAILED : unable to remove link at <%s>\n", c->full_dest_path);
+        result = 1;
+      } else {
+        message = entry_message(e, c);
+        if (message) {
+          fputs(message, stdout);
+          free(message);
+        }
+      }
+      break;
+  }
+  if (e->conflict) emit_conflict(c->full_dest_path);
+  return result;
+}
+/*}}}*/
+/*}}}*/
+/*{{{ Tree walk */
+/* The walk over a package tree keeps its own stack of the directories it's
+ * part way through, rather than recursing, so how deep a package goes only
+ * costs heap.  Each directory's listing is read in one go (and cached), so
+ * nothing is held open while the entries are worked through.  An action that
+ * wants the walk to go into a directory calls descend(), and the walk does so
+ * as soon as the action returns, before the next entry, just as though the
+ * action had recursed. */
+struct walk_frame {/*{{{*/
+  char *rel_path;       /* relative link prefix at this depth, or NULL */
+  char *tail;           /* directory relative to the top of the package */
+  char *full_src;
+  char *full_dest;
+  struct src_listing *l;
+  struct dest_snapshot *snap;
+  int next;             /* index of the next entry to act on */
+};
+/*}}}*/
+struct walk {/*{{{*/
+  struct walk_frame *frames;
+  int n, max;
+  int descending;       /* set by descend() */
+  char *new_rel_path;
+  char *new_tail;
+};
+/*}}}*/
+static struct walk *current_walk = NULL;
+
+static int descend(const char *rel_path, const char *tail)/*{{{*/
+{
+  /* Called from an action to have the current walk go into 'tail' next */
+  struct walk *w = current_walk;
+  assert(w && !w->descending);
+  w->descending = 1;
+  w->new_rel_path = rel_path ? new_string(rel_path) : NULL;
+  w->new_tail = new_string(tail);
+  return 0;
+}
+/*}}}*/
+static int push_frame(struct walk *w, char *rel_path, char *tail,/*{{{*/
+                      const char *src, const char *dest,
+                      const struct ignore_set *pkg_set, const struct ignore_set *area_set)
+{
+  /* Start on directory 'tail', taking over 'rel_path' and 'tail'.  Return 1
+   * if it can't be read. */
+  struct walk_frame *f;
+  struct src_listing *l;
+  char *full_src;
+  const char **wanted;
+  int n_wanted;
+  int i;
+
+  full_src = caten(src, tail);
+  if (pipelining) pipeline_visit();
+  l = read_src_listing(full_src);
+  if (!l) {
+    fprintf(stderr, "Could not open directory %s!\n", full_src);
+    free(full_src);
+    if (rel_path) free(rel_path);
+    free(tail);
+    return 1;
+  }
+
+  if (w->n == w->max) {
+    w->max = w->max ? (w->max << 1) : 16;
+    w->frames = grow_array(struct walk_frame, w->max, w->frames);
+  }
+  f = w->frames + w->n++;
+  f->rel_path = rel_path;
+  f->tail = tail;
+  f->full_src = full_src;
+  f->full_dest = caten(dest, tail);
+  f->l = l;
+  f->next = 0;
+
+  wanted = new_array(const char *, l->n + 1);
+  n_wanted = 0;
+  for (i=0; i<l->n; i++) {
+    if (!check_ignore(pkg_set, area_set, tail, l->entries[i].name)) wanted[n_wanted++] = l->entries[i].name;
+  }
+  f->snap = take_snapshot(f->full_dest, n_wanted, wanted);
+  free(wanted);
+  return 0;
+}
+/*}}}*/
+static void pop_frame(struct walk *w)/*{{{*/
+{
+  struct walk_frame *f = w->frames + --w->n;
+  drop_snapshot(f->snap);
+  if (f->rel_path) free(f->rel_path);
+  free(f->tail);
+  free(f->full_src);
+  free(f->full_dest);
+}
+/*}}}*/
+/* {{{ static int traverse_action */
+static int
+traverse_action(const char *rel_path,
+                const char *src,
+                const char *dest,
+                const char *pkg,
+                const char *version,
+                const char *tail,
+                struct options *opt,
+                const struct ignore_set *area_set,
+                enum action action)
+{
+  /* Carry out 'action' on everything in the package at 'src' from 'tail' down,
+   * with 'area_set' the rules of the link area at 'dest' (if any).  Return
+   * non-zero if anything went wrong, including directories that couldn't be
+   * read, which are counted and skipped. */
+  struct walk w, *outer;
+  const struct ignore_set *pkg_set;
+  const struct action_table *table;
+  enum source_type src_type;
+  enum dest_type dest_type;
+  int errors = 0;
+
+  /* The rules files only decide what gets linked.  Removing or listing a
+   * package goes by what's actually there, which may predate a rule. */
+  pkg_set = ((action == ACT_PRE_INSTALL) || (action == ACT_INSTALL)) ? package_ignores(src) : NULL;
+  table = get_action_table(action, opt);
+
+  memset(&w, 0, sizeof(w));
+  outer = current_walk;
+  current_walk = &w;
+  errors += push_frame(&w, rel_path ? new_string(rel_path) : NULL, new_string(tail),
+                       src, dest, pkg_set, area_set);
+
+  while (w.n > 0) {
+    struct walk_frame *f = w.frames + w.n - 1;
+    struct entry_context c;
+    const char *name;
+    char *full_src_path;
+    char *full_dest_path;
+    const char *other_pkg, *other_version;
+
+    if (f->next == f->l->n) {
+      pop_frame(&w);
+      continue;
+    }
+    name = f->l->entries[f->next].name;
+    src_type = f->l->entries[f->next].type;
+    f->next++;
+
+    if (check_ignore(pkg_set, area_set, f->tail, name)) continue;
+
+    full_src_path = dfcaten(f->full_src, name);
+    full_dest_path = dfcaten(f->full_dest, name);
+
+    if (src_type == ST_ERROR) errors++;
+
+    other_pkg = other_version = NULL;
+    dest_type = find_dest_type(full_dest_path, full_src_path,
+                               f->rel_path,
+                               f->tail, name, pkg, version,
+                               &other_pkg, &other_version);
+    dest_type = action_dest_type(action, dest_type, version, other_version);
+
+    c.relative_path = f->rel_path;
+    c.full_src_path = full_src_path;
+    c.full_dest_path = full_dest_path;
+    c.taildir = f->tail;
+    c.tailfile = name;
+    c.pkg = pkg;
+    c.other_pkg = other_pkg;
+    c.other_version = other_version;
+    c.src_type = src_type;
+    c.dest_type = dest_type;
+    c.opt = opt;
+    c.linked_path = NULL;
+    errors |= run_entry(table, &table->e[src_type][dest_type], &c);
+    if (c.linked_path) free(c.linked_path);
+
+
+    free(full_src_path);
+    free(full_dest_path);
+
+    if (w.descending) {
+      /* f may move when the stack grows */
+      w.descending = 0;
+      errors += push_frame(&w, w.new_rel_path, w.new_tail, src, dest, pkg_set, area_set);
+    }
+  }
+
+  if (w.frames) free(w.frames);
+  current_walk = outer;
+  return errors;
+}
+/*}}}*/
+/*}}}*/
+static char *make_rel(const char *src, const char *dest)/*{{{*/
+{
+  /* Return relative path to get from src to dest. Both are abs. */
+  const char *p, *q;
+
+  p = src, q = dest;
+  while (*p && *q && (*p == *q)) p++, q++;
+  if (!*p && !*q) {
+    /* Paths are identical. */
+    return new_string("");
+  } else if (!*p) { /* src is shorter */
+    return new_string(q+1);
+  } else if (!*q) { /* dest is shorter */
+    int slashes, i;
+    int len;
+    char *res;
+
+    while (*--p != '/') ;
+    slashes = 0;
+    while (*p) {
+      if (*p == '/') slashes++;
+      p++;
+    }
+
+    /* And form result. */
+
+    slashes--;
+    len = 3*slashes - 1;
+    res = new_array(char, len+1);
+    for (i=0; i<slashes; i++) {
+      if (i < (slashes-1)) {
+        memcpy(res+(3*i), "../", 3);
+      } else {
+        strcpy(res+(3*i), "..");
+      }
+    }
+    return res;
+
+  } else {
+    /* Backup to previous slash. */
+    int slashes, i;
+    int len;
+    char *res;
+
+    while (*--p != '/') ;
+    while (*--q != '/') ;
+    slashes = 0;
+    while (*p) {
+      if (*p == '/') slashes++;
+      p++;
+    }
+
+    /* And form result. */
+    q++; /* now points to char beyond slash */
+
+    len = 3*slashes + strlen(q);
+    res = new_array(char, len+1);
+    for (i=0; i<slashes; i++) {
+      memcpy(res+(3*i), "../", 3);
+    }
+    strcpy(res+(3*slashes), q);
+    return res;
+  }
+}
+/*}}}*/
+
+static char *stats_path(const char *dest_path, const char *pkg)/*{{{*/
+{
+  char *name, *result;
+  name = caten(STATS_PREFIX, pkg);
+  result = dfcaten3(dest_path, RECORD_DIR, name);
+  free(name);
+  return result;
+}
+/*}}}*/
+static void record_hard_links(const char *dest_path, const char *pkg, const char *version)/*{{{*/
+{
+  /* Add the hard links just made in 'dest_path' to the package's list, each
+   * as "dev ino<TAB>version<TAB>path in the area".  The list goes when the
+   * package is next removed, so with --retain it builds up over installs. */
+  char *path;
+  FILE *out;
+  int len = strlen(dest_path);
+  int i;
+
+  if (!n_new_hard_links) return;
+  path = links_path(dest_path, pkg);
+  out = fopen(path, "a");
+  if (!out) {
+    fprintf(stderr, "Cannot write %s : %s\n", path, strerror(errno));
+  }
+  for (i=0; i<n_new_hard_links; i++) {
+    char *tab = strchr(new_hard_links[i], '\t');
+    if (out && !strncmp(tab + 1, dest_path, len) && (tab[1 + len] == '/')) {
+      fprintf(out, "%.*s\t%s\t%s\n", (int) (tab - new_hard_links[i]), new_hard_links[i],
+              version, tab + 1 + len);
+    }
+    free(new_hard_links[i]);
+  }
+  n_new_hard_links = 0;
+  if (out && (fclose(out) != 0)) fprintf(stderr, "Cannot write %s : %s\n", path, strerror(errno));
+  dest_invalidate(path);
+  free(path);
+}
+/*}}}*/
+/*{{{ record_install() */
+static int record_install(const char *relative_path,
+    const char *src_path,
+    const char *dest_path,
+    const char *pkg,
+    const char *version)
+{
+  /* Return 1 if the install couldn't be recorded */
+  char *linkpath;
+  char *record_dir;
+  char counts[64];
+  mode_t mode;
+  int status;
+  int registry;
+  int result = 0;
+
+  record_dir = dfcaten(dest_path, RECORD_DIR);
+  status = dest_lstat(record_dir, &mode);
+  if (status < 0) {
+    if (dest_mkdir(record_dir, 0755) < 0) {
+      fprintf(stderr, "Cannot create %s.\nThe installed version of %s has not been recorded.\n", record_dir, pkg);
+      free(record_dir);
+      return 1;
+    }
+  }
+  registry = lock_registry(dest_path, 1);
+  linkpath = dfcaten3(dest_path, RECORD_DIR, pkg);
+  dest_unlink(linkpath);
+
+  if (dest_symlink(relative_path ? relative_path : src_path, linkpath) < 0) {
+    fprintf(stderr, "Cannot create %s.\nThe installed version of %s has not been recorded.\n", linkpath, pkg);
+    result = 1;
+  }
+  free(linkpath);
+
+  /* The counts go in a hidden link of their own, so that they can be read
+   * back with one readlink() and don't show up as a package. */
+  linkpath = stats_path(dest_path, pkg);
+  dest_unlink(linkpath);
+  sprintf(counts, "links=%d expansions=%d", install_counts.links, install_counts.expansions);
+  if (dest_symlink(counts, linkpath) < 0) {
+    fprintf(stderr, "Cannot create %s.\n", linkpath);
+  }
+  record_hard_links(dest_path, pkg, version);
+  unlock_registry(registry);
+
+  free(record_dir);
+  free(linkpath);
+  return result;
+}
+/*}}}*/
+/*{{{ remove_current_install() */
+static void remove_current_install(const char *relative_path,
+    const char *src_path,
+    const char *dest_path,
+    const char *pkg,
+    const char *version,
+    const char *tail,
+    struct options *opt)
+{
+  char *linkpath;
+  char target[1024];
+  int status;
+  int registry;
+  linkpath = dfcaten3(dest_path, RECORD_DIR, pkg);
+  status = dest_readlink(linkpath, target, sizeof(target));
+  if (status < 0) {
+    fprintf(stderr, "Failed to read target of <%s> : can't remove old version.\n", linkpath);
+    goto get_out;
+  }
+  target[status] = 0; /* Null terminate */
+  if (target[0] == '/') {
+    /* path is absolute */
+    traverse_action(NULL, target, dest_path, pkg, version, tail, opt, NULL, ACT_SOFT_DELETE);
+  } else {
+    /* path is relative */
+    char *install_area;
+    install_area = dfcaten(dest_path, target);
+    traverse_action(target, install_area, dest_path, pkg, version, tail, opt, NULL, ACT_SOFT_DELETE);
+    free(install_area);
+  }
+
+
+  registry = lock_registry(dest_path, 1);
+  dest_unlink(linkpath);
+  free(linkpath);
+  linkpath = stats_path(dest_path, pkg);
+  dest_unlink(linkpath);
+  free(linkpath);
+  linkpath = links_path(dest_path, pkg);
+  dest_unlink(linkpath);
+  unlock_registry(registry);
+  forget_recorded_areas();
+get_out:
+  free(linkpath);
+
+}
+/*}}}*/
+/*{{{ remove_pkg_by_name() */
+static int remove_pkg_by_name(const char *dest_path,
+    const char *pkg,
+    struct options *opt)
+{
+  /* Return non-zero if the package couldn't be removed, or only in part */
+  char *linkpath;
+  char target[1024];
+  char *version;
+  int status;
+  int registry;
+  int errors = 0;
+  linkpath = dfcaten3(dest_path, RECORD_DIR, pkg);
+  status = dest_readlink(linkpath, target, sizeof(target));
+  if (status < 0) {
+    fprintf(stderr, "Failed to read target of <%s> : can't remove old version.\n", linkpath);
+    errors = 1;
+    goto get_out;
+  }
+  target[status] = 0; /* Null terminate */
+  /* Get version */
+  for (version=target; *version; version++) ;
+  for (; version>=target && *version != '/'; version--) ;
+  version += (*version == '/');
+
+  if (target[0] == '/') {
+    errors = traverse_action(NULL, target, dest_path, pkg, version, "", opt, NULL, ACT_SOFT_DELETE);
+  } else {
+    /* Recorded relative to the link area */
+    char *install_area;
+    install_area = dfcaten(dest_path, target);
+    errors = traverse_action(target, install_area, dest_path, pkg, version, "", opt, NULL, ACT_SOFT_DELETE);
+    free(install_area);
+  }
+  registry = lock_registry(dest_path, 1);
+  dest_unlink(linkpath);
+  free(linkpath);
+  linkpath = stats_path(dest_path, pkg);
+  dest_unlink(linkpath);
+  free(linkpath);
+  linkpath = links_path(dest_path, pkg);
+  dest_unlink(linkpath);
+  free(linkpath);
+  linkpath = ignore_cache_path(dest_path, pkg);
+  dest_unlink(linkpath);
+  unlock_registry(registry);
+  forget_recorded_areas();
+get_out:
+  free(linkpath);
+  return errors ? 1 : 0;
+}
+/*}}}*/
+
+/*{{{ Batch install */
+struct batch_pkg {/*{{{*/
+  char *src;
+  char *clean_src;
+  char *relative_path;
+  char *pkg;
+  char *version;
+  int expansions;   /* made by its pre-install check */
+};
+/*}}}*/
+struct claim {/*{{{*/
+  int n;
+  int max;
+  int *who;     /* indices of the packages with something at this path */
+  int nondir;   /* set if any of them has a non-directory there */
+};
+/*}}}*/
+static char **read_manifest(const char *path, int *n)/*{{{*/
+{
+  /* One tool_install_path per line; blank lines and lines starting with '#'
+   * are ignored.  '-' means stdin. */
+  FILE *in;
+  char line[PATH_MAX + 2];
+  char **result = NULL;
+  int max = 0;
+
+  *n = 0;
+  in = strcmp(path, "-") ? fopen(path, "r") : stdin;
+  if (!in) {
+    fprintf(stderr, "Could not open manifest %s : %s\n", path, strerror(errno));
+    exit(1);
+  }
+  while (fgets(line, sizeof(line), in)) {
+    char *p = line, *e;
+    while (isspace((unsigned char) *p)) p++;
+    e = p + strlen(p);
+    while ((e > p) && isspace((unsigned char) e[-1])) e--;
+    *e = 0;
+    if (!*p || (*p == '#')) continue;
+    if (*n == max) {
+      max = max ? (max << 1) : 64;
+      result = grow_array(char *, max, result);
+    }
+    result[(*n)++] = new_string(p);
+  }
+  if (in != stdin) fclose(in);
+  return result;
+}
+/*}}}*/
+struct claim_frame {/*{{{*/
+  char *tail;
+  struct src_listing *l;
+  int next;             /* index of the next entry to look at */
+};
+/*}}}*/
+static void scan_claims(struct strtab *claims, const char *src, const struct ignore_set *area_set,/*{{{*/
+                        const char *tail, int idx)
+{
+  /* Note every path the package at 'src' would put in the link area, keeping
+   * a stack of the directories on the way down rather than recursing.  The
+   * listings are kept for the pre-install and install walks. */
+  const struct ignore_set *pkg_set = package_ignores(src);
+  struct claim_frame *frames;
+  int n = 0, max = 16;
+  char *full_src;
+
+  frames = new_array(struct claim_frame, max);
+  full_src = caten(src, tail);
+  frames[n].tail = new_string(tail);
+  frames[n].l = read_src_listing(full_src);
+  frames[n++].next = 0;
+  free(full_src);
+  while (n > 0) {
+    struct claim_frame *f = frames + n - 1;
+    const char *name;
+    char *new_tail;
+    struct claim *c;
+    struct strtab_node *node;
+    int is_dir;
+
+    if (!f->l || (f->next == f->l->n)) {
+      free(f->tail);
+      n--;
+      continue;
+    }
+    name = f->l->entries[f->next].name;
+    is_dir = (f->l->entries[f->next].type == ST_DIR);
+    if (f->l->entries[f->next++].type == ST_ERROR) continue;
+    if (check_ignore(pkg_set, area_set, f->tail, name)) continue;
+
+    new_tail = dfcaten(f->tail, name);
+    node = strtab_insert(claims, new_tail);
+    if (!node->value) {
+      c = new(struct claim);
+      c->n = c->max = c->nondir = 0;
+      c->who = NULL;
+      node->value = c;
+    }
+    c = (struct claim *) node->value;
+    if (c->n == c->max) {
+      c->max = c->max ? (c->max << 1) : 2;
+      c->who = grow_array(int, c->max, c->who);
+    }
+    c->who[c->n++] = idx;
+    if (!is_dir) {
+      c->nondir = 1;
+      free(new_tail);
+      continue;
+    }
+
+    if (n == max) {
+      max <<= 1;
+      frames = grow_array(struct claim_frame, max, frames);
+    }
+    full_src = caten(src, new_tail);
+    frames[n].tail = new_tail;
+    frames[n].l = read_src_listing(full_src);
+    frames[n++].next = 0;
+    free(full_src);
+  }
+  free(frames);
+}
+/*}}}*/
+static int compare_strings(const void *a, const void *b)/*{{{*/
+{
+  return strcmp(*(const char **) a, *(const char **) b);
+}
+/*}}}*/
+static int make_batch_dir(const char *dest, const char *tail, struct options *opt)/*{{{*/
+{
+  /* Make sure there's a real directory at 'tail' in the link area */
+  char *path;
+  mode_t mode;
+  int result = 0;
+
+  path = caten(dest, tail);
+  if (dest_lstat(path, &mode) < 0) {
+    if (dest_mkdir(path, 0755) < 0) {
+      printf("!! FAILED : can't create directory <%s> : %s\n", path, strerror(errno));
+      result = 1;
+    } else if (!opt->quiet) {
+      printf("** NEWDIR <%s> shared by several packages\n", path);
+    }
+  } else if (S_ISLNK(mode)) {
+    /* Pre-install checks let this through, so it's a link to another
+     * package's directory and expansion was asked for. */
+    result = do_expand(path, opt);
+  }
+  free(path);
+  return result;
+}
+/*}}}*/
+static int batch_install(int n, char **srcs, const char *dest,/*{{{*/
+                         const struct ignore_set *area_set,
+                         struct options *opt, int do_retain,
+                         const char *conflict_list_path,
+                         int n_remove, char **remove)
+{
+  /* Install the 'n' packages at 'srcs' together, first removing the
+   * 'n_remove' packages named in 'remove' once everything has been checked. */
+  struct batch_pkg *bp;
+  struct strtab *claims;
+  char *clean_dest, *canon_dest;
+  char **shared;
+  int n_shared;
+  int errors = 0;
+  int i, j;
+
+  bp = new_array(struct batch_pkg, n);
+  clean_dest = cleanup_dir(dest);
+
+  if (!opt->force && !fresh_generation(clean_dest) && !check_sane("destination", clean_dest)) exit(1);
+
+  /* Work out where the link area really is just once, for all the packages
+   * that need relative links. */
+  canon_dest = NULL;
+  for (i=0; i<n; i++) {
+    bp[i].src = srcs[i];
+    bp[i].clean_src = cleanup_dir(srcs[i]);
+    if (!opt->force && !check_sane("source", bp[i].clean_src)) exit(1);
+    if (srcs[i][0] != '/') {
+      char *canon_src = normalise_dir(srcs[i]);
+      if (!canon_dest) canon_dest = normalise_dir(dest);
+      bp[i].relative_path = make_rel(canon_dest, canon_src);
+      free(canon_src);
+    } else {
+      bp[i].relative_path = NULL;
+    }
+    extract_package_details(bp[i].clean_src, &bp[i].pkg, &bp[i].version);
+    for (j=0; j<i; j++) {
+      if (!strcmp(bp[j].pkg, bp[i].pkg)) {
+        fprintf(stderr, "Package <%s> appears more than once in the manifest\n", bp[i].pkg);
+        exit(1);
+      }
+    }
+  }
+  if (canon_dest) free(canon_dest);
+
+  if (use_locks) {
+    char **clean_srcs = new_array(char *, n);
+    char **pkgs = new_array(char *, n);
+    for (i=0; i<n; i++) {
+      clean_srcs[i] = bp[i].clean_src;
+      pkgs[i] = bp[i].pkg;
+    }
+    lock_packages(clean_dest, n, clean_srcs, do_retain ? 0 : n, pkgs);
+    free(clean_srcs);
+    free(pkgs);
+  }
+
+  if (conflict_list_path) {
+    conflict_file = fopen(conflict_list_path, "w");
+    if (!conflict_file) {
+      fprintf(stderr, "Could not open %s to write conflict list to\n", conflict_list_path);
+    }
+  }
+
+  /* Find out up front what the packages would do to each other : anything
+   * they both provide conflicts unless it's a directory in all of them, in
+   * which case it'll have to be a real directory in the link area. */
+  if (!opt->quiet) fprintf(stderr, "Checking %d packages against each other\n", n);
+  claims = new_strtab();
+  for (i=0; i<n; i++) scan_claims(claims, bp[i].clean_src, area_set, "", i);
+
+  shared = new_array(char *, claims->count);
+  n_shared = 0;
+  batch_dirs = new_strtab();
+  for (i=0; i<claims->size; i++) {
+    struct strtab_node *node;
+    for (node = claims->buckets[i]; node; node = node->next) {
+      struct claim *c = (struct claim *) node->value;
+      if (c->n > 1) shared[n_shared++] = node->key;
+    }
+  }
+  qsort(shared, n_shared, sizeof(char *), compare_strings);
+  for (i=0; i<n_shared; i++) {
+    struct claim *c = (struct claim *) strtab_find(claims, shared[i])->value;
+    if (c->nondir) {
+      char *path = caten(clean_dest, shared[i]);
+      for (j=1; j<c->n; j++) {
+        if (opt->override) {
+          printf("** OVERRIDE <%s> from package <%s> replaced by package <%s>\n",
+                 path, bp[c->who[j-1]].pkg, bp[c->who[j]].pkg);
+        } else {
+          printf("!! CONFLICT <%s> provided by package <%s> and package <%s>\n",
+                 path, bp[c->who[j-1]].pkg, bp[c->who[j]].pkg);
+          emit_conflict(path);
+          errors++;
+        }
+      }
+      free(path);
+    } else {
+      strtab_insert(batch_dirs, shared[i]);
+    }
+  }
+
+  /* Check each package against what's already in the link area, with the
+   * shared directories treated as though they exist and the packages to be
+   * removed as though they'd gone. */
+  removing_pkgs = remove;
+  n_removing_pkgs = n_remove;
+  for (i=0; i<n; i++) {
+    if (!opt->quiet) fprintf(stderr, "Run pre-installing check for package <%s>, version <%s>\n", bp[i].pkg, bp[i].version);
+    install_counts.expansions = 0;
+    pipeline_start(bp[i].clean_src, clean_dest, area_set, 0);
+    errors |= traverse_action(bp[i].relative_path, bp[i].clean_src, clean_dest,
+                              bp[i].pkg, bp[i].version, "", opt, area_set, ACT_PRE_INSTALL);
+    pipeline_finish();
+    bp[i].expansions = install_counts.expansions;
+  }
+  removing_pkgs = NULL;
+  n_removing_pkgs = 0;
+
+  if (conflict_file) {
+    fclose(conflict_file);
+    conflict_file = NULL;
+  }
+
+  if (errors) {
+    fprintf(stderr, "\nPre-install check found problems, exiting\n\n");
+  } else if (!opt->dry_run) {
+    for (i=0; i<n_remove; i++) {
+      if (!opt->quiet) fprintf(stderr, "Removing package <%s>\n", remove[i]);
+      errors |= remove_pkg_by_name(clean_dest, remove[i], opt);
+    }
+    if (errors) {
+      fprintf(stderr, "\nProblems found whilst removing packages : nothing installed\n\n");
+    } else if (!do_retain) {
+      if (!opt->quiet) fprintf(stderr, "\nPre-install checks OK, removing old versions\n\n");
+      for (i=0; i<n; i++) {
+        /* Packages that are new to the link area have nothing to remove */
+        char *record = dfcaten3(clean_dest, RECORD_DIR, bp[i].pkg);
+        mode_t mode;
+        if (dest_lstat(record, &mode) == 0) {
+          remove_current_install(NULL, bp[i].clean_src, clean_dest, bp[i].pkg, bp[i].version, "", opt);
+        }
+        free(record);
+      }
+    }
+
+    /* Parents sort before their children, so this goes top down. */
+    if (!errors) {
+      if (!opt->quiet) fprintf(stderr, "\nPre-install checks OK, creating shared directories\n\n");
+      for (i=0; i<n_shared; i++) {
+        if (strtab_find(batch_dirs, shared[i])) {
+          errors |= make_batch_dir(clean_dest, shared[i], opt);
+        }
+      }
+      if (errors) {
+        fprintf(stderr, "\nProblems found whilst creating shared directories : nothing installed\n\n");
+      }
+    }
+
+    for (i=0; !errors && (i<n); i++) {
+      if (!opt->quiet) fprintf(stderr, "\nInstalling package <%s>, version <%s>\n\n", bp[i].pkg, bp[i].version);
+      install_counts.links = 0;
+      install_counts.expansions = bp[i].expansions;
+      pipeline_start(bp[i].clean_src, clean_dest, area_set, 1);
+      errors = traverse_action(bp[i].relative_path, bp[i].clean_src, clean_dest,
+                               bp[i].pkg, bp[i].version, "", opt, area_set, ACT_INSTALL);
+      errors |= pipeline_finish();
+      if (errors) {
+        fprintf(stderr, "\nProblems found whilst installing <%s> : package may only be part-installed\n\n", bp[i].pkg);
+        errors = 1;
+        break;
+      }
+      if (record_install(bp[i].relative_path, bp[i].clean_src, clean_dest, bp[i].pkg, bp[i].version)) {
+        errors = 1;
+        break;
+      }
+    }
+  }
+
+  for (i=0; i<claims->size; i++) {
+    struct strtab_node *node;
+    for (node = claims->buckets[i]; node; node = node->next) {
+      struct claim *c = (struct claim *) node->value;
+      free(c->who);
+      free(c);
+    }
+  }
+  free(shared);
+  strtab_free(claims);
+  strtab_free(batch_dirs);
+  batch_dirs = NULL;
+  for (i=0; i<n; i++) {
+    free(bp[i].clean_src);
+    if (bp[i].relative_path) free(bp[i].relative_path);
+    free(bp[i].pkg);
+    free(bp[i].version);
+  }
+  free(bp);
+  free(clean_dest);
+  return errors;
+}
+/*}}}*/
+/*}}}*/
+
+/*{{{ Conflict analysis */
+/* spill --conflicts works out which of a set of packages would get in each
+ * other's way, without a link area.  Each package is read as a stream of the
+ * paths it would link, in tree order, and the streams are merged through a
+ * heap, so the whole set is done in one pass however many packages there
+ * are.  A stream only goes down into a directory when some other package has
+ * a directory there too, since nothing below a path that one package has to
+ * itself can clash. */
+
+struct stream_frame {/*{{{*/
+  char *full_src;
+  char *tail;
+  struct src_listing *l;
+  int pos;                  /* next entry to look at */
+};
+/*}}}*/
+struct path_stream {/*{{{*/
+  int idx;                  /* the package's place on the command line */
+  char *src;
+  char *pkg;
+  char *version;
+  const struct ignore_set *pkg_set;
+  struct stream_frame *frames;
+  int depth;
+  int max_depth;
+  char *tail;               /* the current path, NULL once it's finished */
+  int is_dir;
+};
+/*}}}*/
+static int compare_tails(const char *a, const char *b)/*{{{*/
+{
+  /* Order paths as a walk of the tree meets them : a directory's contents
+   * come straight after it, before any sibling whose name starts with the
+   * directory's name (so "a", "a/b", "a.c"). */
+  while (*a && (*a == *b)) {
+    a++;
+    b++;
+  }
+  if (*a == '/') return *b ? -1 : 1;
+  if (*b == '/') return *a ? 1 : -1;
+  return (unsigned char) *a - (unsigned char) *b;
+}
+/*}}}*/
+static int push_stream_frame(struct path_stream *s, const char *tail)/*{{{*/
+{
+  struct stream_frame *f;
+  char *full_src = caten(s->src, tail);
+  struct src_listing *l = read_src_listing(full_src);
+  if (!l) {
+    fprintf(stderr, "Couldn't read directory <%s> : %s!\n", full_src, strerror(errno));
+    free(full_src);
+    return -1;
+  }
+  if (s->depth == s->max_depth) {
+    s->max_depth = s->max_depth ? (s->max_depth << 1) : 8;
+    s->frames = grow_array(struct stream_frame, s->max_depth, s->frames);
+  }
+  f = &s->frames[s->depth++];
+  f->full_src = full_src;
+  f->tail = new_string(tail);
+  f->l = l;
+  f->pos = 0;
+  return 0;
+}
+/*}}}*/
+static int advance_stream(struct path_stream *s, int into)/*{{{*/
+{
+  /* Move on to the next path, going down into the current one first if
+   * 'into' is set and it's a directory.  Return -1 if a directory couldn't
+   * be read. */
+  int result = 0;
+
+  if (s->tail) {
+    if (into && s->is_dir) result = push_stream_frame(s, s->tail);
+    free(s->tail);
+    s->tail = NULL;
+  }
+  while (s->depth > 0) {
+    struct stream_frame *f = &s->frames[s->depth - 1];
+    while (f->pos < f->l->n) {
+      const struct src_entry *e = &f->l->entries[f->pos++];
+      if (e->type == ST_ERROR) continue;
+      if (check_ignore(s->pkg_set, NULL, f->tail, e->name)) continue;
+      s->tail = dfcaten(f->tail, e->name);
+      s->is_dir = (e->type == ST_DIR);
+      return result;
+    }
+    /* Each directory is only read once, so there's no point keeping it */
+    drop_src_listing(f->full_src);
+    free(f->full_src);
+    free(f->tail);
+    s->depth--;
+  }
+  return result;
+}
+/*}}}*/
+static int stream_before(const struct path_stream *a, const struct path_stream *b)/*{{{*/
+{
+  int c = compare_tails(a->tail, b->tail);
+  return (c < 0) || ((c == 0) && (a->idx < b->idx));
+}
+/*}}}*/
+static void heap_push(struct path_stream **heap, int *n, struct path_stream *s)/*{{{*/
+{
+  int i = (*n)++;
+  while ((i > 0) && stream_before(s, heap[(i - 1) / 2])) {
+    heap[i] = heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  heap[i] = s;
+}
+/*}}}*/
+static struct path_stream *heap_pop(struct path_stream **heap, int *n)/*{{{*/
+{
+  struct path_stream *top = heap[0];
+  struct path_stream *last = heap[--(*n)];
+  int i = 0;
+  while (1) {
+    int child = 2*i + 1;
+    if (child >= *n) break;
+    if ((child + 1 < *n) && stream_before(heap[child + 1], heap[child])) child++;
+    if (!stream_before(heap[child], last)) break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  if (*n > 0) heap[i] = last;
+  return top;
+}
+/*}}}*/
+static int same_content(const struct path_stream *a, const struct path_stream *b)/*{{{*/
+{
+  /* Would it matter which of the two packages the link went to?  Links
+   * within the packages are the same if they point the same way. */
+  char *path_a = caten(a->src, a->tail);
+  char *path_b = caten(b->src, b->tail);
+  char link_a[PATH_MAX], link_b[PATH_MAX];
+  int len_a, len_b;
+  int result;
+
+  len_a = readlink(path_a, link_a, PATH_MAX);
+  len_b = readlink(path_b, link_b, PATH_MAX);
+  if ((len_a >= 0) && (len_a == len_b) && !memcmp(link_a, link_b, len_a)) {
+    result = 1;
+  } else {
+    result = (files_differ(path_a, path_b) == 0);
+  }
+  free(path_a);
+  free(path_b);
+  return result;
+}
+/*}}}*/
+static void tally_pair(struct strtab *pairs, const char *pkg_a, const char *pkg_b, int same)/*{{{*/
+{
+  struct strtab_node *node;
+  int *counts;
+  char *key = new_array(char, strlen(pkg_a) + strlen(pkg_b) + 2);
+  sprintf(key, "%s\t%s", pkg_a, pkg_b);
+  node = strtab_insert(pairs, key);
+  free(key);
+  counts = node->value;
+  if (!counts) {
+    counts = new_array(int, 2);
+    counts[0] = counts[1] = 0;
+    node->value = counts;
+  }
+  counts[same ? 0 : 1]++;
+}
+/*}}}*/
+static int find_conflicts(int n, char **srcs, struct options *opt)/*{{{*/
+{
+  /* Return 0 if the packages can all be installed together, 1 if some of
+   * them conflict, 2 if something couldn't be read. */
+  struct path_stream *streams;
+  struct path_stream **heap;
+  struct path_stream **group;
+  struct strtab *pairs;
+  char **keys;
+  int n_heap = 0;
+  int n_keys;
+  int conflicts = 0, errors = 0;
+  int i, j, k;
+
+  streams = new_array(struct path_stream, n);
+  heap = new_array(struct path_stream *, n);
+  group = new_array(struct path_stream *, n);
+  for (i=0; i<n; i++) {
+    struct path_stream *s = &streams[i];
+    s->idx = i;
+    s->src = cleanup_dir(srcs[i]);
+    extract_package_details(s->src, &s->pkg, &s->version);
+    for (j=0; j<i; j++) {
+      if (!strcmp(streams[j].pkg, s->pkg)) {
+        fprintf(stderr, "Package <%s> appears more than once\n", s->pkg);
+        exit(2);
+      }
+    }
+    s->pkg_set = package_ignores(s->src);
+    s->frames = NULL;
+    s->depth = s->max_depth = 0;
+    s->tail = NULL;
+    if (push_stream_frame(s, "") < 0) {
+      errors++;
+      continue;
+    }
+    advance_stream(s, 0);
+    if (s->tail) heap_push(heap, &n_heap, s);
+  }
+
+  pairs = new_strtab();
+  while (n_heap > 0) {
+    int n_group = 0;
+    int all_dirs = 1;
+    group[n_group++] = heap_pop(heap, &n_heap);
+    while ((n_heap > 0) && !compare_tails(heap[0]->tail, group[0]->tail)) {
+      group[n_group++] = heap_pop(heap, &n_heap);
+    }
+    for (i=0; i<n_group; i++) all_dirs &= group[i]->is_dir;
+
+    if ((n_group > 1) && all_dirs) {
+      /* Has to be a real directory in the link area */
+      if (!opt->quiet) {
+        printf("expand\t%s", group[0]->tail + 1);
+        for (i=0; i<n_group; i++) printf("\t%s", group[i]->pkg);
+        printf("\n");
+      }
+    } else if (n_group > 1) {
+      int same = 1;
+      for (i=0; i<n_group; i++) {
+        for (j=i+1; j<n_group; j++) {
+          int pair_same = !group[i]->is_dir && !group[j]->is_dir && same_content(group[i], group[j]);
+          tally_pair(pairs, group[i]->pkg, group[j]->pkg, pair_same);
+          same &= pair_same;
+        }
+      }
+      if (!opt->quiet) {
+        printf("conflict\t%s\t%s", group[0]->tail + 1, same ? "identical" : "different");
+        for (i=0; i<n_group; i++) printf("\t%s", group[i]->pkg);
+        printf("\n");
+      }
+      conflicts++;
+    }
+
+    for (i=0; i<n_group; i++) {
+      if (advance_stream(group[i], (n_group > 1) && all_dirs) < 0) errors++;
+      if (group[i]->tail) heap_push(heap, &n_heap, group[i]);
+    }
+  }
+
+  /* Then how many paths each pair of packages clashes over */
+  keys = new_array(char *, pairs->count + 1);
+  n_keys = 0;
+  for (i=0; i<pairs->size; i++) {
+    struct strtab_node *node;
+    for (node = pairs->buckets[i]; node; node = node->next) keys[n_keys++] = node->key;
+  }
+  if (n_keys > 1) qsort(keys, n_keys, sizeof(char *), compare_strings);
+  if (n_keys > 0) {
+    if (!opt->quiet) printf("\n");
+    printf("%-24s %-24s %10s %10s\n", "package", "package", "identical", "different");
+    for (k=0; k<n_keys; k++) {
+      int *counts = strtab_find(pairs, keys[k])->value;
+      char *tab = strchr(keys[k], '\t');
+      *tab = 0;
+      printf("%-24s %-24s %10d %10d\n", keys[k], tab + 1, counts[0], counts[1]);
+      *tab = '\t';
+      free(counts);
+    }
+  }
+  free(keys);
+  strtab_free(pairs);
+
+  for (i=0; i<n; i++) {
+    free(streams[i].src);
+    free(streams[i].pkg);
+    free(streams[i].version);
+    if (streams[i].frames) free(streams[i].frames);
+  }
+  free(streams);
+  free(heap);
+  free(group);
+
+  if (errors) return 2;
+  return conflicts ? 1 : 0;
+}
+/*}}}*/
+/*}}}*/
+
+struct record {/*{{{*/
+  char *pkg;
+  char *target; /* where .spill/<pkg> points, i.e. the install area */
+  int links;      /* from the stats link, -1 if there isn't one */
+  int expansions;
+};
+/*}}}*/
+struct record_set {/*{{{*/
+  char *dest_path;
+  int n;
+  struct record *recs; /* sorted by pkg */
+};
+/*}}}*/
+static int compare_records(const void *a, const void *b)/*{{{*/
+{
+  const struct record *ra = (const struct record *) a;
+  const struct record *rb = (const struct record *) b;
+  return strcmp(ra->pkg, rb->pkg);
+}
+/*}}}*/
+static struct record *find_record(const struct record_set *rs, const char *pkg)/*{{{*/
+{
+  struct record key;
+  if (!rs->n) return NULL;
+  key.pkg = (char *) pkg;
+  return (struct record *) bsearch(&key, rs->recs, rs->n, sizeof(struct record), compare_records);
+}
+/*}}}*/
+static int load_records(const char *dest_path, struct record_set *rs)/*{{{*/
+{
+  /* Read every package record under the link area in a single sweep of the
+   * record directory.  Return 0 if the record directory couldn't be read. */
+  char *record_dir;
+  struct dirlist *dl;
+  int max;
+  struct record *stats = NULL;
+  int n_stats = 0, max_stats = 0;
+  int registry;
+  int i;
+
+  rs->dest_path = new_string(dest_path);
+  rs->n = 0;
+  rs->recs = NULL;
+  max = 0;
+
+  record_dir = dfcaten(dest_path, RECORD_DIR);
+  registry = lock_registry(dest_path, 0);
+  dl = read_dirlist(record_dir);
+  if (!dl) {
+    unlock_registry(registry);
+    free(record_dir);
+    return 0;
+  }
+  for (i=0; i<dl->n; i++) {
+    const char *name = dl->entries[i].name;
+    char *linkpath;
+    char target[PATH_MAX];
+    int status;
+    int is_stats;
+    struct record *r;
+    is_stats = !strncmp(name, STATS_PREFIX, sizeof(STATS_PREFIX) - 1);
+    /* '.', '..' and anything else hidden isn't a package record */
+    if ((name[0] == '.') && !is_stats) continue;
+    linkpath = dfcaten(record_dir, name);
+    status = readlink(linkpath, target, sizeof(target) - 1);
+    free(linkpath);
+    if (status < 0) continue;
+    target[status] = 0;
+    if (is_stats) {
+      if (n_stats == max_stats) {
+        max_stats = max_stats ? (max_stats << 1) : 64;
+        stats = grow_array(struct record, max_stats, stats);
+      }
+      r = stats + n_stats++;
+      r->pkg = new_string(name + sizeof(STATS_PREFIX) - 1);
+      r->target = NULL;
+      if (sscanf(target, "links=%d expansions=%d", &r->links, &r->expansions) != 2) {
+        r->links = r->expansions = -1;
+      }
+    } else {
+      if (rs->n == max) {
+        max = max ? (max << 1) : 64;
+        rs->recs = grow_array(struct record, max, rs->recs);
+      }
+      r = rs->recs + rs->n++;
+      r->pkg = new_string(name);
+      r->target = new_string(target);
+      r->links = r->expansions = -1;
+    }
+  }
+  free_dirlist(dl);
+  free(record_dir);
+
+  unlock_registry(registry);
+  /* The listing was sorted, so the records already are */
+  for (i=0; i<n_stats; i++) {
+    struct record *r = find_record(rs, stats[i].pkg);
+    if (r) {
+      r->links = stats[i].links;
+      r->expansions = stats[i].expansions;
+    }
+    free(stats[i].pkg);
+  }
+  if (stats) free(stats);
+  return 1;
+}
+/*}}}*/
+static void free_records(struct record_set *rs)/*{{{*/
+{
+  int i;
+  for (i=0; i<rs->n; i++) {
+    free(rs->recs[i].pkg);
+    free(rs->recs[i].target);
+  }
+  if (rs->recs) free(rs->recs);
+  free(rs->dest_path);
+  rs->n = 0;
+  rs->recs = NULL;
+  rs->dest_path = NULL;
+}
+/*}}}*/
+
+/*{{{ Reconcile */
+struct reconcile_plan {/*{{{*/
+  int n_install;
+  char **install;  /* tool_install_paths that aren't recorded as they should be */
+  int n_remove;
+  char **remove;   /* recorded packages that aren't wanted any more */
+};
+/*}}}*/
+static void plan_reconcile(const char *list_path, const char *dest, struct reconcile_plan *plan)/*{{{*/
+{
+  /* Work out what has to change to make the link area's records match the
+   * list.  A package whose record already points where the list says costs a
+   * hash lookup and a string compare; nothing under it is looked at. */
+  char **srcs;
+  int n_srcs;
+  struct record_set rs;
+  char *canon_dest = NULL;
+  char *wanted;
+  int i;
+
+  srcs = read_manifest(list_path, &n_srcs);
+  load_records(dest, &rs);
+  wanted = new_array(char, rs.n + 1);
+  for (i=0; i<rs.n; i++) wanted[i] = 0;
+
+  plan->n_install = plan->n_remove = 0;
+  plan->install = new_array(char *, n_srcs + 1);
+  plan->remove = new_array(char *, rs.n + 1);
+
+  for (i=0; i<n_srcs; i++) {
+    char *clean_src, *pkg, *version, *target;
+    struct record *r;
+
+    clean_src = cleanup_dir(srcs[i]);
+    extract_package_details(clean_src, &pkg, &version);
+    if (srcs[i][0] != '/') {
+      char *canon_src = normalise_dir(srcs[i]);
+      if (!canon_dest) canon_dest = normalise_dir(dest);
+      target = make_rel(canon_dest, canon_src);
+      free(canon_src);
+    } else {
+      target = new_string(clean_src);
+    }
+
+    r = find_record(&rs, pkg);
+    if (r) wanted[r - rs.recs] = 1;
+    if (r && !strcmp(r->target, target)) {
+      free(srcs[i]);
+    } else {
+      plan->install[plan->n_install++] = srcs[i];
+    }
+    free(target);
+    free(clean_src);
+    free(pkg);
+    free(version);
+  }
+
+  for (i=0; i<rs.n; i++) {
+    if (!wanted[i]) plan->remove[plan->n_remove++] = new_string(rs.recs[i].pkg);
+  }
+
+  if (canon_dest) free(canon_dest);
+  free(wanted);
+  free_records(&rs);
+  if (srcs) free(srcs);
+}
+/*}}}*/
+static int apply_reconcile(struct reconcile_plan *plan, const char *dest,/*{{{*/
+                           const struct ignore_set *area_set,
+                           struct options *opt, const char *conflict_list_path)
+{
+  /* The removals are handed to the batch install, which checks the new
+   * packages as though the removed ones had gone and only then removes them,
+   * so a failed check leaves the link area as it was.  Upgrades remove the
+   * old version of each package in the batch install too, which also creates
+   * any directories the new ones share just once. */
+  int i;
+
+  if (use_locks) {
+    /* Everything the run will touch is locked before any of it is, including
+     * what the batch install goes on to do. */
+    char *clean_dest = cleanup_dir(dest);
+    char **clean_srcs = new_array(char *, plan->n_install + 1);
+    char **pkgs = new_array(char *, plan->n_remove + plan->n_install + 1);
+    int n_pkgs = 0;
+    for (i=0; i<plan->n_remove; i++) pkgs[n_pkgs++] = plan->remove[i];
+    for (i=0; i<plan->n_install; i++) {
+      char *pkg, *version;
+      clean_srcs[i] = cleanup_dir(plan->install[i]);
+      extract_package_details(clean_srcs[i], &pkg, &version);
+      pkgs[n_pkgs++] = pkg;
+      free(version);
+    }
+    lock_packages(clean_dest, plan->n_install, clean_srcs, n_pkgs, pkgs);
+    for (i=0; i<plan->n_install; i++) {
+      free(clean_srcs[i]);
+      free(pkgs[plan->n_remove + i]);
+    }
+    free(clean_srcs);
+    free(pkgs);
+    free(clean_dest);
+  }
+
+  if (opt->dry_run) {
+    for (i=0; i<plan->n_remove; i++) printf("** REMOVE package <%s>\n", plan->remove[i]);
+  }
+  if (plan->n_install == 0) {
+    int errors = 0;
+    for (i=0; (i<plan->n_remove) && !opt->dry_run; i++) {
+      if (!opt->quiet) fprintf(stderr, "Removing package <%s>\n", plan->remove[i]);
+      errors |= remove_pkg_by_name(dest, plan->remove[i], opt);
+    }
+    return errors;
+  }
+  return batch_install(plan->n_install, plan->install, dest, area_set, opt, 0, conflict_list_path,
+                       plan->n_remove, plan->remove);
+}
+/*}}}*/
+/*}}}*/
+
+static void print_json_string(const char *s)/*{{{*/
+{
+  putchar('"');
+  for (; *s; s++) {
+    unsigned char c = (unsigned char) *s;
+    if ((c == '"') || (c == '\\')) {
+      putchar('\\');
+      putchar(c);
+    } else if (c < 0x20) {
+      printf("\\u%04x", c);
+    } else {
+      putchar(c);
+    }
+  }
+  putchar('"');
+}
+/*}}}*/
+static int list_records(const char *dest_path, int json)/*{{{*/
+{
+  struct record_set rs;
+  int i;
+  int w_pkg, w_ver;
+
+  if (!load_records(dest_path, &rs)) {
+    fprintf(stderr, "Could not read package records in <%s/%s> : %s\n",
+            dest_path, RECORD_DIR, strerror(errno));
+    free_records(&rs);
+    return 1;
+  }
+
+  if (json) {
+    printf("[");
+    for (i=0; i<rs.n; i++) {
+      struct record *r = rs.recs + i;
+      const char *version = strrchr(r->target, '/');
+      version = version ? version + 1 : r->target;
+      printf("%s\n  {\"package\": ", i ? "," : "");
+      print_json_string(r->pkg);
+      printf(", \"version\": ");
+      print_json_string(version);
+      printf(", \"path\": ");
+      print_json_string(r->target);
+      printf(", \"mode\": \"%s\"", (r->target[0] == '/') ? "absolute" : "relative");
+      if (r->links >= 0) {
+        printf(", \"links\": %d, \"expansions\": %d}", r->links, r->expansions);
+      } else {
+        printf(", \"links\": null, \"expansions\": null}");
+      }
+    }
+    printf("%s]\n", rs.n ? "\n" : "");
+  } else {
+    w_pkg = strlen("PACKAGE");
+    w_ver = strlen("VERSION");
+    for (i=0; i<rs.n; i++) {
+      const char *version = strrchr(rs.recs[i].target, '/');
+      int l;
+      version = version ? version + 1 : rs.recs[i].target;
+      l = strlen(rs.recs[i].pkg);
+      if (l > w_pkg) w_pkg = l;
+      l = strlen(version);
+      if (l > w_ver) w_ver = l;
+    }
+    printf("%-*s  %-*s  %-8s  %6s  %10s  %s\n",
+           w_pkg, "PACKAGE", w_ver, "VERSION", "MODE", "LINKS", "EXPANSIONS", "PATH");
+    for (i=0; i<rs.n; i++) {
+      struct record *r = rs.recs + i;
+      const char *version = strrchr(r->target, '/');
+      char links[16], expansions[16];
+      version = version ? version + 1 : r->target;
+      if (r->links >= 0) {
+        sprintf(links, "%d", r->links);
+        sprintf(expansions, "%d", r->expansions);
+      } else {
+        strcpy(links, "-");
+        strcpy(expansions, "-");
+      }
+      printf("%-*s  %-*s  %-8s  %6s  %10s  %s\n",
+             w_pkg, r->pkg, w_ver, version,
+             (r->target[0] == '/') ? "absolute" : "relative",
+             links, expansions, r->target);
+    }
+  }
+
+  free_records(&rs);
+  return 0;
+}
+/*}}}*/
+static char *find_link_area(const char *dir)/*{{{*/
+{
+  /* Return the nearest directory at or above 'dir' which holds a record
+   * directory, or NULL if there is none. */
+  char *area;
+  char *p;
+  struct stat sb;
+
+  area = new_string(dir);
+  do {
+    char *record_dir = dfcaten(area, RECORD_DIR);
+    int found = (stat(record_dir, &sb) == 0) && S_ISDIR(sb.st_mode);
+    free(record_dir);
+    if (found) return area;
+    p = strrchr(area, '/');
+    if (p) *p = 0;
+  } while (p);
+
+  free(area);
+  return NULL;
+}
+/*}}}*/
+static int query_owner(const char *path, const struct record_set *rs,/*{{{*/
+                       char **pkg, char **version)
+{
+  /* Walk down from the link area towards 'path'.  The first symbolic link met
+   * on the way is the one spill created; its target encodes the package that
+   * owns everything beneath it.  Return 1 if an owner was found. */
+  int area_len;
+  char *walk;
+  char *end;
+  struct stat sb;
+  int result = 0;
+
+  area_len = strlen(rs->dest_path);
+  walk = new_string(path);
+  end = walk + area_len;
+
+  while (*end) {
+    char *next = strchr(end + 1, '/');
+    char save;
+    if (!next) next = end + strlen(end);
+    save = *next;
+    *next = 0;
+    if (lstat(walk, &sb) < 0) break;
+    if (S_ISLNK(sb.st_mode)) {
+      char linkbuf[PATH_MAX];
+      const struct link_prefix *lp;
+      int link_len;
+      link_len = readlink(walk, linkbuf, PATH_MAX - 1);
+      if (link_len >= 0) {
+        linkbuf[link_len] = 0;
+        if (generation_link(linkbuf, walk + area_len) >= 0) {
+          /* Just a way through to an older generation */
+          *next = save;
+          end = next;
+          continue;
+        }
+        lp = decode_link_target(linkbuf, link_len, walk + area_len, next - (walk + area_len));
+        if (!lp) lp = decode_flattened_link(walk, linkbuf, link_len, walk + area_len);
+        if (lp && find_record(rs, lp->pkg)) {
+          *pkg = new_string(lp->pkg);
+          *version = new_string(lp->version);
+          result = 1;
+        }
+      }
+      break;
+    } else if (!S_ISDIR(sb.st_mode)) {
+      break;
+    }
+    *next = save;
+    end = next;
+  }
+
+  free(walk);
+  return result;
+}
+/*}}}*/
+static int show_owners(int n, char **paths)/*{{{*/
+{
+  /* Return the number of paths for which no owner was found. */
+  struct record_set rs;
+  char cwd[PATH_MAX];
+  char *last_parent = NULL;
+  char *area = NULL;
+  int have_records = 0;
+  int unowned = 0;
+  int i;
+
+  if (getcwd(cwd, PATH_MAX) == NULL) {
+    fprintf(stderr, "Couldn't get current directory!\n");
+    exit(1);
+  }
+
+  for (i=0; i<n; i++) {
+    char *abs_path, *path, *parent, *p;
+    char *pkg, *version;
+
+    abs_path = (paths[i][0] == '/') ? new_string(paths[i]) : dfcaten(cwd, paths[i]);
+    path = cleanup_dir(abs_path);
+    free(abs_path);
+
+    /* Consecutive queries mostly come from the same directory, so only go
+     * looking for the link area (and its records) when the parent changes. */
+    parent = new_string(path);
+    p = strrchr(parent, '/');
+    if (p) *p = 0;
+    if (!last_parent || strcmp(parent, last_parent)) {
+      char *new_area = find_link_area(parent);
+      if (!new_area || !area || strcmp(new_area, area)) {
+        if (have_records) free_records(&rs);
+        have_records = new_area ? load_records(new_area, &rs) : 0;
+      }
+      if (area) free(area);
+      area = new_area;
+      if (last_parent) free(last_parent);
+      last_parent = parent;
+    } else {
+      free(parent);
+    }
+
+    if (have_records && query_owner(path, &rs, &pkg, &version)) {
+      printf("%s\t%s\t%s\n", paths[i], pkg, version);
+      free(pkg);
+      free(version);
+    } else {
+      printf("%s\t-\n", paths[i]);
+      unowned++;
+    }
+    free(path);
+  }
+
+  if (have_records) free_records(&rs);
+  if (area) free(area);
+  if (last_parent) free(last_parent);
+  return unowned;
+}
+/*}}}*/
+static int show_files(const char *dest_path, const char *pkg, struct options *opt)/*{{{*/
+{
+  char *linkpath;
+  char target[PATH_MAX];
+  char *version;
+  int status;
+  int result;
+
+  linkpath = dfcaten3(dest_path, RECORD_DIR, pkg);
+  status = readlink(linkpath, target, sizeof(target) - 1);
+  if (status < 0) {
+    fprintf(stderr, "No record of package <%s> in <%s>\n", pkg, dest_path);
+    free(linkpath);
+    return 1;
+  }
+  target[status] = 0;
+  version = strrchr(target, '/');
+  version = version ? version + 1 : target;
+
+  if (target[0] == '/') {
+    result = traverse_action(NULL, target, dest_path, pkg, version, "", opt, NULL, ACT_LIST_OWNED);
+  } else {
+    /* The record holds the relative path from the link area */
+    char *install_area = dfcaten(dest_path, target);
+    result = traverse_action(target, install_area, dest_path, pkg, version, "", opt, NULL, ACT_LIST_OWNED);
+    free(install_area);
+  }
+
+  free(linkpath);
+  return result;
+}
+/*}}}*/
+/*{{{ Comparing link areas */
+/* spill --diff walks two link areas side by side, merging the sorted listings
+ * of each pair of directories, and reports where they differ.  Links are
+ * compared by the package and version they point into rather than by their
+ * text, so relative and absolute links into the same install are the same.
+ * Where one area links to a package's directory and the other has expanded it
+ * into a real directory, the package's directory is listed through the link
+ * and each of its entries stands for a link into that package, so only what
+ * really changed underneath is reported.  Pairs of directories are handed out
+ * to a pool of worker threads; the differences are sorted by path at the end,
+ * so the output doesn't depend on how the work was shared out. */
+
+enum diff_kind {/*{{{*/
+  DK_ADDED,
+  DK_REMOVED,
+  DK_RETARGETED,
+  DK_EXPANDED,
+  DK_COLLAPSED,
+  DK_CHANGED,
+  N_DIFF_KINDS
+};
+/*}}}*/
+static const char *diff_kind_names[N_DIFF_KINDS] = {
+  "added", "removed", "retargeted", "expanded", "collapsed", "changed"
+};
+
+struct diff_entry {/*{{{*/
+  enum diff_kind kind;
+  char *path;
+  const char *pkg[2];       /* interned; NULL where there's no link spill made */
+  const char *version[2];
+};
+/*}}}*/
+struct diff_side {/*{{{*/
+  /* How one area stands at a directory being compared */
+  int present;
+  const char *via_pkg;      /* set inside a package's own directory, */
+  const char *via_version;  /* reached through a link */
+};
+/*}}}*/
+struct diff_job {/*{{{*/
+  char *tail;               /* "" at the top, else "/a/b" */
+  struct diff_side side[2];
+};
+/*}}}*/
+enum slot_kind {/*{{{*/
+  SK_NONE,
+  SK_LINK,      /* a link into a package install, or an entry inside one */
+  SK_FOREIGN,   /* a link that spill didn't make */
+  SK_DIR,
+  SK_OTHER
+};
+/*}}}*/
+struct diff_slot {/*{{{*/
+  /* What one area has at a path */
+  enum slot_kind kind;
+  const char *pkg;          /* SK_LINK */
+  const char *version;
+  int in_package;           /* SK_LINK for an entry inside the package itself */
+  int is_dir;               /* ... and whether that entry is a directory */
+  char target[PATH_MAX];    /* SK_FOREIGN */
+};
+/*}}}*/
+
+static pthread_mutex_t diff_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t diff_cond = PTHREAD_COND_INITIALIZER;
+
+static struct {/*{{{*/
+  const char *area[2];
+  struct diff_job **jobs;   /* a stack, so the walk stays mostly depth first */
+  int n_jobs;
+  int max_jobs;
+  int busy;                 /* workers part way through a job */
+  struct diff_entry *entries;
+  int n_entries;
+  int max_entries;
+  int errors;
+} dw;
+/*}}}*/
+
+static void push_diff_job(const char *tail, const struct diff_side *a, const struct diff_side *b)/*{{{*/
+{
+  struct diff_job *job = new(struct diff_job);
+  job->tail = new_string(tail);
+  job->side[0] = *a;
+  job->side[1] = *b;
+  pthread_mutex_lock(&diff_lock);
+  if (dw.n_jobs == dw.max_jobs) {
+    dw.max_jobs = dw.max_jobs ? (dw.max_jobs << 1) : 256;
+    dw.jobs = grow_array(struct diff_job *, dw.max_jobs, dw.jobs);
+  }
+  dw.jobs[dw.n_jobs++] = job;
+  pthread_cond_signal(&diff_cond);
+  pthread_mutex_unlock(&diff_lock);
+}
+/*}}}*/
+static void add_difference(enum diff_kind kind, const char *tail,/*{{{*/
+                           const struct diff_slot *a, const struct diff_slot *b)
+{
+  struct diff_entry *d;
+  pthread_mutex_lock(&diff_lock);
+  if (dw.n_entries == dw.max_entries) {
+    dw.max_entries = dw.max_entries ? (dw.max_entries << 1) : 256;
+    dw.entries = grow_array(struct diff_entry, dw.max_entries, dw.entries);
+  }
+  d = &dw.entries[dw.n_entries++];
+  d->kind = kind;
+  d->path = new_string(tail + 1);
+  d->pkg[0] = (a->kind == SK_LINK) ? a->pkg : NULL;
+  d->version[0] = (a->kind == SK_LINK) ? a->version : NULL;
+  d->pkg[1] = (b->kind == SK_LINK) ? b->pkg : NULL;
+  d->version[1] = (b->kind == SK_LINK) ? b->version : NULL;
+  pthread_mutex_unlock(&diff_lock);
+}
+/*}}}*/
+static int classify_slot(struct diff_slot *slot, const struct diff_side *side,/*{{{*/
+                         const char *path, const char *tail, const struct dir_entry *e)
+{
+  /* Work out what one area has at 'path' (which is 'tail' in the area), from
+   * its entry in the directory listing.  Return 0, or -1 if it couldn't be
+   * read. */
+  unsigned char type = e->type;
+  struct stat sb;
+
+  if (type == DT_UNKNOWN) {
+    if (lstat(path, &sb) < 0) {
+      fprintf(stderr, "Couldn't stat <%s> : %s!\n", path, strerror(errno));
+      return -1;
+    }
+    type = S_ISDIR(sb.st_mode) ? DT_DIR : S_ISLNK(sb.st_mode) ? DT_LNK : DT_REG;
+  }
+
+  if (side->via_pkg) {
+    /* Anything in a linked package directory is as good as a link to it */
+    slot->kind = SK_LINK;
+    slot->pkg = side->via_pkg;
+    slot->version = side->via_version;
+    slot->in_package = 1;
+    slot->is_dir = (type == DT_DIR);
+    if (type == DT_LNK) slot->is_dir = (stat(path, &sb) == 0) && S_ISDIR(sb.st_mode);
+  } else if (type == DT_LNK) {
+    const struct link_prefix *lp;
+    int link_len, flat_len;
+    link_len = readlink(path, slot->target, PATH_MAX - 1);
+    if (link_len < 0) {
+      fprintf(stderr, "Couldn't readlink on <%s> : %s!\n", path, strerror(errno));
+      return -1;
+    }
+    slot->target[link_len] = 0;
+    if (generation_link(slot->target, tail) >= 0) {
+      /* Stands for the same directory in an older generation */
+      slot->kind = SK_DIR;
+      return 0;
+    }
+    /* The link prefix table is shared by all the workers, but whether the
+     * link is a flattened one takes a stat, which is done without the lock */
+    pthread_mutex_lock(&diff_lock);
+    lp = decode_link_target(slot->target, link_len, tail, strlen(tail));
+    pthread_mutex_unlock(&diff_lock);
+    if (!lp && ((flat_len = flattened_prefix_len(path, slot->target, tail)) >= 0)) {
+      pthread_mutex_lock(&diff_lock);
+      lp = lookup_link_prefix(slot->target, flat_len);
+      pthread_mutex_unlock(&diff_lock);
+    }
+    if (lp) {
+      slot->kind = SK_LINK;
+      slot->pkg = lp->pkg;
+      slot->version = lp->version;
+      slot->in_package = 0;
+    } else {
+      slot->kind = SK_FOREIGN;
+    }
+  } else {
+    slot->kind = (type == DT_DIR) ? SK_DIR : SK_OTHER;
+  }
+  return 0;
+}
+/*}}}*/
+static int slot_is_dir(const struct diff_slot *slot, const char *path)/*{{{*/
+{
+  /* Does a link slot lead to a directory? */
+  struct stat sb;
+  if (slot->in_package) return slot->is_dir;
+  return (stat(path, &sb) == 0) && S_ISDIR(sb.st_mode);
+}
+/*}}}*/
+static void compare_slots(const char *tail, const char **paths,/*{{{*/
+                          struct diff_slot *a, struct diff_slot *b)
+{
+  static const struct diff_side real = {1, NULL, NULL};
+  static const struct diff_side absent = {0, NULL, NULL};
+  struct diff_side linked;
+
+  if (a->kind == SK_NONE) {
+    add_difference(DK_ADDED, tail, a, b);
+    if (b->kind == SK_DIR) push_diff_job(tail, &absent, &real);
+  } else if (b->kind == SK_NONE) {
+    add_difference(DK_REMOVED, tail, a, b);
+    if (a->kind == SK_DIR) push_diff_job(tail, &real, &absent);
+  } else if ((a->kind == SK_LINK) && (b->kind == SK_LINK)) {
+    /* The names are interned, so the same package means the same pointer */
+    if ((a->pkg != b->pkg) || (a->version != b->version)) {
+      add_difference(DK_RETARGETED, tail, a, b);
+    }
+  } else if ((a->kind == SK_DIR) && (b->kind == SK_DIR)) {
+    push_diff_job(tail, &real, &real);
+  } else if ((a->kind == SK_LINK) && (b->kind == SK_DIR) && slot_is_dir(a, paths[0])) {
+    add_difference(DK_EXPANDED, tail, a, b);
+    linked.present = 1;
+    linked.via_pkg = a->pkg;
+    linked.via_version = a->version;
+    push_diff_job(tail, &linked, &real);
+  } else if ((a->kind == SK_DIR) && (b->kind == SK_LINK) && slot_is_dir(b, paths[1])) {
+    add_difference(DK_COLLAPSED, tail, a, b);
+    linked.present = 1;
+    linked.via_pkg = b->pkg;
+    linked.via_version = b->version;
+    push_diff_job(tail, &real, &linked);
+  } else if ((a->kind != b->kind) ||
+             ((a->kind == SK_FOREIGN) && strcmp(a->target, b->target))) {
+    add_difference(DK_CHANGED, tail, a, b);
+  }
+}
+/*}}}*/
+static void compare_dirs(const struct diff_job *job)/*{{{*/
+{
+  struct dirlist *dl[2];
+  struct diff_slot *slot[2];
+  int pos[2];
+  int s;
+
+  for (s=0; s<2; s++) {
+    dl[s] = NULL;
+    if (job->side[s].present) {
+      char *path = caten(dw.area[s], job->tail);
+      dl[s] = read_dirlist(path);
+      if (!dl[s]) {
+        fprintf(stderr, "Couldn't read directory <%s> : %s!\n", path, strerror(errno));
+        pthread_mutex_lock(&diff_lock);
+        dw.errors++;
+        pthread_mutex_unlock(&diff_lock);
+      }
+      free(path);
+    }
+    slot[s] = new(struct diff_slot);
+    pos[s] = 0;
+  }
+
+  while (1) {
+    const struct dir_entry *e[2];
+    const char *name;
+    char *tail;
+    char *paths[2];
+    int failed = 0;
+
+    for (s=0; s<2; s++) {
+      e[s] = (dl[s] && (pos[s] < dl[s]->n)) ? &dl[s]->entries[pos[s]] : NULL;
+    }
+    if (!e[0] && !e[1]) break;
+    if (e[0] && e[1]) {
+      int c = strcmp(e[0]->name, e[1]->name);
+      if (c < 0) e[1] = NULL;
+      else if (c > 0) e[0] = NULL;
+    }
+    name = e[0] ? e[0]->name : e[1]->name;
+    for (s=0; s<2; s++) {
+      if (e[s]) pos[s]++;
+    }
+    /* The package records differ whenever the links do */
+    if (!job->tail[0] && !strcmp(name, RECORD_DIR)) continue;
+
+    tail = dfcaten(job->tail, name);
+    for (s=0; s<2; s++) {
+      paths[s] = caten(dw.area[s], tail);
+      slot[s]->kind = SK_NONE;
+      if (e[s] && (classify_slot(slot[s], &job->side[s], paths[s], tail, e[s]) < 0)) failed = 1;
+    }
+    if (failed) {
+      pthread_mutex_lock(&diff_lock);
+      dw.errors++;
+      pthread_mutex_unlock(&diff_lock);
+    } else {
+      compare_slots(tail, (const char **) paths, slot[0], slot[1]);
+    }
+    for (s=0; s<2; s++) free(paths[s]);
+    free(tail);
+  }
+
+  for (s=0; s<2; s++) {
+    if (dl[s]) free_dirlist(dl[s]);
+    free(slot[s]);
+  }
+}
+/*}}}*/
+static void *diff_worker(void *arg)/*{{{*/
+{
+  struct diff_job *job;
+  while (1) {
+    pthread_mutex_lock(&diff_lock);
+    while ((dw.n_jobs == 0) && (dw.busy > 0)) {
+      pthread_cond_wait(&diff_cond, &diff_lock);
+    }
+    if (dw.n_jobs == 0) {
+      /* Nothing left, and nobody's going to make any more */
+      pthread_cond_broadcast(&diff_cond);
+      pthread_mutex_unlock(&diff_lock);
+      return NULL;
+    }
+    job = dw.jobs[--dw.n_jobs];
+    dw.busy++;
+    pthread_mutex_unlock(&diff_lock);
+
+    compare_dirs(job);
+    free(job->tail);
+    free(job);
+
+    pthread_mutex_lock(&diff_lock);
+    dw.busy--;
+    if ((dw.busy == 0) && (dw.n_jobs == 0)) pthread_cond_broadcast(&diff_cond);
+    pthread_mutex_unlock(&diff_lock);
+  }
+}
+/*}}}*/
+static int compare_diff_entries(const void *a, const void *b)/*{{{*/
+{
+  return strcmp(((const struct diff_entry *) a)->path, ((const struct diff_entry *) b)->path);
+}
+/*}}}*/
+static void tally_difference(struct strtab *tallies, const char *pkg, enum diff_kind kind)/*{{{*/
+{
+  struct strtab_node *node = strtab_insert(tallies, pkg);
+  int *counts = node->value;
+  int k;
+  if (!counts) {
+    counts = new_array(int, N_DIFF_KINDS);
+    for (k=0; k<N_DIFF_KINDS; k++) counts[k] = 0;
+    node->value = counts;
+  }
+  counts[kind]++;
+}
+/*}}}*/
+static int diff_areas(const char *area_a, const char *area_b, int jobs, struct options *opt)/*{{{*/
+{
+  /* Return 0 if the areas are the same, 1 if they differ, 2 if something
+   * couldn't be read. */
+  static const struct diff_side real = {1, NULL, NULL};
+  struct strtab *tallies;
+  pthread_t *threads;
+  char **pkgs;
+  int n_threads = 0;
+  int n_pkgs, i, k;
+
+  for (i=0; i<2; i++) {
+    const char *area = i ? area_b : area_a;
+    struct stat sb;
+    if ((stat(area, &sb) < 0) || !S_ISDIR(sb.st_mode)) {
+      fprintf(stderr, "Link area <%s> isn't a directory\n", area);
+      return 2;
+    }
+  }
+  dw.area[0] = area_a;
+  dw.area[1] = area_b;
+  push_diff_job("", &real, &real);
+
+  /* This thread does its share of the work too */
+  threads = new_array(pthread_t, jobs);
+  for (i=1; i<jobs; i++) {
+    if (pthread_create(&threads[n_threads], NULL, diff_worker, NULL)) break;
+    n_threads++;
+  }
+  diff_worker(NULL);
+  for (i=0; i<n_threads; i++) pthread_join(threads[i], NULL);
+  free(threads);
+
+  if (dw.n_entries > 1) qsort(dw.entries, dw.n_entries, sizeof(struct diff_entry), compare_diff_entries);
+
+  tallies = new_strtab();
+  for (i=0; i<dw.n_entries; i++) {
+    struct diff_entry *d = &dw.entries[i];
+    if (!opt->quiet) {
+      printf("%s\t%s", diff_kind_names[d->kind], d->path);
+      for (k=0; k<2; k++) {
+        if (d->pkg[k]) printf("\t%s\t%s", d->pkg[k], d->version[k]);
+        else if ((d->kind == DK_RETARGETED) || (d->kind == DK_CHANGED)) printf("\t-\t-");
+      }
+      printf("\n");
+    }
+    for (k=0; k<2; k++) {
+      if (d->pkg[k] && ((k == 0) || !d->pkg[0] || strcmp(d->pkg[0], d->pkg[k]))) {
+        tally_difference(tallies, d->pkg[k], d->kind);
+      }
+    }
+    free(d->path);
+  }
+
+  /* A summary per package, in name order */
+  pkgs = new_array(char *, tallies->count + 1);
+  n_pkgs = 0;
+  for (i=0; i<tallies->size; i++) {
+    struct strtab_node *n;
+    for (n = tallies->buckets[i]; n; n = n->next) pkgs[n_pkgs++] = n->key;
+  }
+  if (n_pkgs > 1) qsort(pkgs, n_pkgs, sizeof(char *), compare_strings);
+  if (n_pkgs > 0) {
+    if (!opt->quiet) printf("\n");
+    printf("%-24s", "package");
+    for (k=0; k<N_DIFF_KINDS; k++) printf(" %10s", diff_kind_names[k]);
+    printf("\n");
+    for (i=0; i<n_pkgs; i++) {
+      int *counts = strtab_find(tallies, pkgs[i])->value;
+      printf("%-24s", pkgs[i]);
+      for (k=0; k<N_DIFF_KINDS; k++) printf(" %10d", counts[k]);
+      printf("\n");
+      free(counts);
+    }
+  }
+  free(pkgs);
+  strtab_free(tallies);
+
+  if (dw.errors) return 2;
+  return dw.n_entries ? 1 : 0;
+}
+/*}}}*/
+/*}}}*/
+/*{{{ Daemon mode */
+/* The daemon loads the state of one link area into the destination cache,
+ * then keeps it current from inotify events.  Each request that comes in over
+ * the socket is an ordinary spill command line; it's run in a forked child,
+ * which inherits the warm cache, with its output going straight to the
+ * client's own stdout and stderr.  Requests are served one at a time, and the
+ * events caused by one request's writes are absorbed before the next one
+ * starts. */
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+/* How long a client may take over sending its request, in seconds */
+#define REQUEST_TIMEOUT 10
+
+static int spill_main(int argc, char **argv);
+
+static int inotify_fd = -1;
+static char **watch_dirs = NULL; /* indexed by watch descriptor */
+static int n_watch_dirs = 0;
+
+static int under_dir(const char *path, const char *dir)/*{{{*/
+{
+  int len = strlen(dir);
+  return !strncmp(path, dir, len) && ((path[len] == '/') || (path[len] == 0));
+}
+/*}}}*/
+static void load_dest_tree(const char *dir)/*{{{*/
+{
+  DIR *d;
+  struct dirent *de;
+  int wd;
+
+  wd = inotify_add_watch(inotify_fd, dir, WATCH_MASK);
+  if (wd < 0) {
+    /* Without a watch, anything cached below here could go stale. */
+    fprintf(stderr, "Can't watch <%s>, it won't be cached : %s\n", dir, strerror(errno));
+    return;
+  }
+  if (wd >= n_watch_dirs) {
+    int n = n_watch_dirs;
+    n_watch_dirs = wd + 256;
+    watch_dirs = grow_array(char *, n_watch_dirs, watch_dirs);
+    while (n < n_watch_dirs) watch_dirs[n++] = NULL;
+  }
+  if (!watch_dirs[wd]) watch_dirs[wd] = new_string(dir);
+  strtab_insert(dest_cache_dirs, dir)->value = watch_dirs[wd];
+
+  d = opendir(dir);
+  if (!d) return;
+  while ((de = readdir(d))) {
+    char *path;
+    struct dest_state *ds;
+    if (!strcmp(de->d_name, ".")) continue;
+    if (!strcmp(de->d_name, "..")) continue;
+    path = dfcaten(dir, de->d_name);
+    ds = lookup_dest(path);
+    if (!ds->err && S_ISDIR(ds->mode)) load_dest_tree(path);
+    free(path);
+  }
+  closedir(d);
+}
+/*}}}*/
+static void forget_dest_tree(const char *dir)/*{{{*/
+{
+  /* Drop the watches and everything cached at or below 'dir' */
+  int wd, i;
+  for (wd=0; wd<n_watch_dirs; wd++) {
+    if (watch_dirs[wd] && under_dir(watch_dirs[wd], dir)) {
+      inotify_rm_watch(inotify_fd, wd);
+      strtab_remove(dest_cache_dirs, watch_dirs[wd]);
+      free(watch_dirs[wd]);
+      watch_dirs[wd] = NULL;
+    }
+  }
+  for (i=0; i<dest_cache->size; i++) {
+    struct strtab_node *n, *next;
+    for (n = dest_cache->buckets[i]; n; n = next) {
+      next = n->next;
+      if (under_dir(n->key, dir)) dest_invalidate(n->key);
+    }
+  }
+}
+/*}}}*/
+static void absorb_events(void)/*{{{*/
+{
+  char buffer[65536] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  int overflow = 0;
+  int len;
+
+  while ((len = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+    char *p;
+    for (p = buffer; p < buffer + len; p += sizeof(struct inotify_event) + ((struct inotify_event *) p)->len) {
+      struct inotify_event *ev = (struct inotify_event *) p;
+      char *dir, *path;
+      if (ev->mask & IN_Q_OVERFLOW) {
+        overflow = 1;
+        continue;
+      }
+      if ((ev->wd < 0) || (ev->wd >= n_watch_dirs)) continue;
+      dir = watch_dirs[ev->wd];
+      if (!dir) continue;
+      if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        path = new_string(dir);
+        forget_dest_tree(path);
+        free(path);
+        continue;
+      }
+      if (!ev->len) continue;
+      path = dfcaten(dir, ev->name);
+      if (ev->mask & IN_ISDIR) {
+        forget_dest_tree(path);
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO)) load_dest_tree(path);
+      } else {
+        dest_invalidate(path);
+      }
+      free(path);
+    }
+  }
+
+  if (overflow) {
+    /* Lost track; start again from scratch. */
+    forget_dest_tree(dest_cache_root);
+    load_dest_tree(dest_cache_root);
+  }
+}
+/*}}}*/
+static int read_fully(int fd, char *buf, int len)/*{{{*/
+{
+  while (len > 0) {
+    int n = read(fd, buf, len);
+    if (n <= 0) {
+      if ((n < 0) && (errno == EINTR)) continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+/*}}}*/
+static int peer_is_owner(int fd)/*{{{*/
+{
+  /* Only the user the daemon runs as may have it run commands */
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) return 0;
+  if (cred.uid != geteuid()) {
+    fprintf(stderr, "Refused a request from uid %d\n", (int) cred.uid);
+    return 0;
+  }
+#endif
+  return 1;
+}
+/*}}}*/
+static void serve_request(int listen_fd)/*{{{*/
+{
+  /* A request is a 4 byte length, accompanied by the client's stdout and
+   * stderr descriptors, followed by that many bytes holding the client's
+   * working directory and its argv as NUL terminated strings. */
+  int fd;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char cbuf[CMSG_SPACE(2 * sizeof(int))];
+  unsigned int len;
+  int out_fds[2] = {-1, -1};
+  char *payload = NULL;
+  char **argv = NULL;
+  int argc;
+  char *p;
+  pid_t pid;
+  struct timeval tv;
+  int status, result;
+
+  fd = accept(listen_fd, NULL, NULL);
+  if (fd < 0) return;
+  if (!peer_is_owner(fd)) {
+    close(fd);
+    return;
+  }
+  /* Requests are served one at a time, so one that stalls mustn't hold up
+   * the rest for ever */
+  tv.tv_sec = REQUEST_TIMEOUT;
+  tv.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &len;
+  iov.iov_len = sizeof(len);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+  if (recvmsg(fd, &msg, 0) != sizeof(len)) goto get_out;
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+      memcpy(out_fds, CMSG_DATA(cmsg), sizeof(out_fds));
+    }
+  }
+  if ((out_fds[0] < 0) || (out_fds[1] < 0) || (len == 0) || (len > (1 << 20))) goto get_out;
+
+  payload = new_array(char, len + 1);
+  if (read_fully(fd, payload, len) < 0) goto get_out;
+  payload[len] = 0;
+
+  /* First string is the cwd, the rest are the arguments */
+  argv = new_array(char *, len + 1);
+  argc = 0;
+  for (p = payload + strlen(payload) + 1; p < payload + len; p += strlen(p) + 1) {
+    argv[argc++] = p;
+  }
+  argv[argc] = NULL;
+  if (argc == 0) goto get_out;
+
+  /* Make sure the cache reflects everything that's happened so far. */
+  absorb_events();
+
+  fflush(stdout);
+  fflush(stderr);
+  pid = fork();
+  if (pid < 0) {
+    result = 1;
+  } else if (pid == 0) {
+    close(listen_fd);
+    close(inotify_fd);
+    dup2(out_fds[0], 1);
+    dup2(out_fds[1], 2);
+    close(out_fds[0]);
+    close(out_fds[1]);
+    close(fd);
+    if (chdir(payload) < 0) {
+      fprintf(stderr, "Couldn't cd to %s : %s!\n", payload, strerror(errno));
+      exit(1);
+    }
+    exit(spill_main(argc, argv));
+  } else {
+    for (;;) {
+      if (waitpid(pid, &status, 0) >= 0) {
+        result = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+        break;
+      }
+      if (errno != EINTR) {
+        result = 1;
+        break;
+      }
+    }
+    absorb_events();
+  }
+
+  if (write(fd, &result, sizeof(result)) < 0) {
+    /* Client went away, nothing to be done */
+  }
+
+get_out:
+  if (out_fds[0] >= 0) close(out_fds[0]);
+  if (out_fds[1] >= 0) close(out_fds[1]);
+  if (payload) free(payload);
+  if (argv) free(argv);
+  close(fd);
+}
+/*}}}*/
+static int run_daemon(const char *socket_path, const char *area)/*{{{*/
+{
+  struct sockaddr_un addr;
+  mode_t old_umask;
+  int listen_fd, status;
+
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", socket_path);
+    return 1;
+  }
+
+  dest_cache_root = normalise_dir(area);
+  dest_cache_root_len = strlen(dest_cache_root);
+  dest_cache = new_strtab();
+  dest_cache_dirs = new_strtab();
+
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd < 0) {
+    fprintf(stderr, "Couldn't initialise inotify : %s\n", strerror(errno));
+    return 1;
+  }
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    fprintf(stderr, "Couldn't create socket : %s\n", strerror(errno));
+    return 1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+  unlink(socket_path);
+  /* Anyone who can connect can have spill run as this user, so the socket is
+   * made for this user alone */
+  old_umask = umask(077);
+  status = bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr));
+  umask(old_umask);
+  if ((status < 0) || (chmod(socket_path, 0600) < 0) ||
+      (listen(listen_fd, 16) < 0)) {
+    fprintf(stderr, "Couldn't listen on %s : %s\n", socket_path, strerror(errno));
+    return 1;
+  }
+  fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+  signal(SIGPIPE, SIG_IGN);
+
+  load_dest_tree(dest_cache_root);
+  fprintf(stderr, "Serving link area <%s> on <%s>, %d entries loaded\n",
+          dest_cache_root, socket_path, dest_cache->count);
+
+  while (1) {
+    struct pollfd pfd[2];
+    pfd[0].fd = listen_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = inotify_fd;
+    pfd[1].events = POLLIN;
+    if (poll(pfd, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "poll failed : %s\n", strerror(errno));
+      return 1;
+    }
+    if (pfd[1].revents) absorb_events();
+    if (pfd[0].revents) serve_request(listen_fd);
+  }
+}
+/*}}}*/
+static int run_client(const char *socket_path, int argc, char **argv)/*{{{*/
+{
+  struct sockaddr_un addr;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char cbuf[CMSG_SPACE(2 * sizeof(int))];
+  int out_fds[2] = {1, 2};
+  char cwd[PATH_MAX];
+  char *payload, *p;
+  unsigned int len;
+  int fd, i;
+  int result;
+
+  if (getcwd(cwd, PATH_MAX) == NULL) {
+    fprintf(stderr, "Couldn't get current directory!\n");
+    return 1;
+  }
+  len = strlen(cwd) + 1;
+  for (i=0; i<argc; i++) len += strlen(argv[i]) + 1;
+  payload = new_array(char, len);
+  p = payload;
+  strcpy(p, cwd);
+  p += strlen(cwd) + 1;
+  for (i=0; i<argc; i++) {
+    strcpy(p, argv[i]);
+    p += strlen(argv[i]) + 1;
+  }
+
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", socket_path);
+    return 1;
+  }
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+  if ((fd < 0) || (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)) {
+    fprintf(stderr, "Couldn't connect to spill daemon at %s : %s\n", socket_path, strerror(errno));
+    return 1;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &len;
+  iov.iov_len = sizeof(len);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(out_fds));
+  memcpy(CMSG_DATA(cmsg), out_fds, sizeof(out_fds));
+
+  fflush(stdout);
+  fflush(stderr);
+  if ((sendmsg(fd, &msg, 0) != sizeof(len)) ||
+      (write(fd, payload, len) != (int) len) ||
+      (read_fully(fd, (char *) &result, sizeof(result)) < 0)) {
+    fprintf(stderr, "Lost contact with spill daemon at %s\n", socket_path);
+    result = 1;
+  }
+
+  close(fd);
+  free(payload);
+  return result;
+}
+/*}}}*/
+/*}}}*/
+/*{{{ Watch mode */
+/* With --watch, spill stays running after installing the package and keeps
+ * the link area in step as the package changes, typically as 'make install'
+ * is run into it again.  Each of the package's directories is watched with
+ * inotify.  Events are gathered until things have been quiet for a moment,
+ * then each entry that changed goes through the same tables as in a full run,
+ * on its own, so the work is in proportion to the change rather than to the
+ * package.  Nothing needs doing for a change inside a directory that's linked
+ * as a whole, since it shows through the link.  The link area is only locked
+ * while a batch of changes is being dealt with. */
+
+#define WATCH_SETTLE_MS 200
+#define SRC_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                        IN_ONLYDIR | IN_DONT_FOLLOW)
+
+struct package_watch {/*{{{*/
+  int fd;
+  char **tails;         /* directory in the package, by watch descriptor */
+  int n_tails;
+  const char *rel_path; /* at the top of the package */
+  const char *src;
+  const char *dest;
+  const char *pkg;
+  const char *version;
+  const struct ignore_set *pkg_set;
+  const struct ignore_set *area_set;
+  struct options *opt;
+};
+/*}}}*/
+static void watch_tree(struct package_watch *pw, const char *tail)/*{{{*/
+{
+  /* Watch directory 'tail' of the package and everything under it.  A
+   * directory that's been moved keeps its watch, which just gets the new
+   * name. */
+  struct dirlist *dl;
+  char *full_src;
+  int wd, i;
+
+  full_src = caten(pw->src, tail);
+  wd = inotify_add_watch(pw->fd, full_src, SRC_WATCH_MASK);
+  if (wd < 0) {
+    fprintf(stderr, "Can't watch <%s>, changes to it won't be linked : %s\n", full_src, strerror(errno));
+    free(full_src);
+    return;
+  }
+  if (wd >= pw->n_tails) {
+    int n = pw->n_tails;
+    pw->n_tails = wd + 256;
+    pw->tails = grow_array(char *, pw->n_tails, pw->tails);
+    while (n < pw->n_tails) pw->tails[n++] = NULL;
+  }
+  if (pw->tails[wd]) free(pw->tails[wd]);
+  pw->tails[wd] = new_string(tail);
+
+  dl = read_dirlist(full_src);
+  for (i=0; dl && (i<dl->n); i++) {
+    const struct dir_entry *e = &dl->entries[i];
+    int is_dir = (e->type == DT_DIR);
+    if (e->type == DT_UNKNOWN) {
+      struct stat sb;
+      char *path = dfcaten(full_src, e->name);
+      is_dir = (lstat(path, &sb) == 0) && S_ISDIR(sb.st_mode);
+      free(path);
+    }
+    if (is_dir && !check_ignore(pw->pkg_set, pw->area_set, tail, e->name)) {
+      char *sub = dfcaten(tail, e->name);
+      watch_tree(pw, sub);
+      free(sub);
+    }
+  }
+  if (dl) free_dirlist(dl);
+  free(full_src);
+}
+/*}}}*/
+static char *watch_rel_path(const struct package_watch *pw, const char *tail)/*{{{*/
+{
+  /* The relative link prefix in directory 'tail', as the walk would have it */
+  char *result, *next;
+  const char *p;
+  if (!pw->rel_path) return NULL;
+  result = new_string(pw->rel_path);
+  for (p = tail; *p; p++) {
+    if (*p != '/') continue;
+    next = dfcaten("..", result);
+    free(result);
+    result = next;
+  }
+  return result;
+}
+/*}}}*/
+static void watch_context(struct package_watch *pw, struct entry_context *c,/*{{{*/
+                          const char *tail, const char *name,
+                          char *rel_path, char *full_src_path, char *full_dest_path)
+{
+  /* Classify what's in the link area for entry 'name' of directory 'tail' */
+  const char *other_pkg = NULL, *other_version = NULL;
+  c->dest_type = find_dest_type(full_dest_path, full_src_path, rel_path, tail, name,
+                                pw->pkg, pw->version, &other_pkg, &other_version);
+  c->relative_path = rel_path;
+  c->full_src_path = full_src_path;
+  c->full_dest_path = full_dest_path;
+  c->taildir = tail;
+  c->tailfile = name;
+  c->pkg = pw->pkg;
+  c->other_pkg = other_pkg;
+  c->other_version = other_version;
+  c->opt = pw->opt;
+  c->linked_path = NULL;
+}
+/*}}}*/
+static int watch_entry(struct package_watch *pw, const char *tail, const char *name,/*{{{*/
+                       enum action action)
+{
+  /* Carry out 'action' on entry 'name' of directory 'tail' of the package,
+   * as traverse_action() would in passing, going on into it if the table says
+   * to.  Return non-zero if anything went wrong. */
+  const struct action_table *table = get_action_table(action, pw->opt);
+  struct entry_context c;
+  struct src_listing *l;
+  struct src_entry *se;
+  struct walk w, *outer;
+  char *full_src, *full_dest, *rel_path, *full_src_path, *full_dest_path;
+  int errors;
+
+  full_src = caten(pw->src, tail);
+  l = read_src_listing(full_src);
+  se = l ? bsearch(name, l->entries, l->n, sizeof(struct src_entry), compare_src_entry) : NULL;
+  if (!se) {
+    /* Gone again already */
+    free(full_src);
+    return 0;
+  }
+  full_dest = caten(pw->dest, tail);
+  full_src_path = dfcaten(full_src, name);
+  full_dest_path = dfcaten(full_dest, name);
+  rel_path = watch_rel_path(pw, tail);
+  watch_context(pw, &c, tail, name, rel_path, full_src_path, full_dest_path);
+  c.dest_type = action_dest_type(action, c.dest_type, pw->version, c.other_version);
+  c.src_type = se->type;
+
+  memset(&w, 0, sizeof(w));
+  outer = current_walk;
+  current_walk = &w;
+  errors = run_entry(table, &table->e[c.src_type][c.dest_type], &c);
+  current_walk = outer;
+  if (c.linked_path) free(c.linked_path);
+  if (w.descending) {
+    errors |= traverse_action(w.new_rel_path, pw->src, pw->dest, pw->pkg, pw->version,
+                              w.new_tail, pw->opt, pw->area_set, action);
+    if (w.new_rel_path) free(w.new_rel_path);
+    free(w.new_tail);
+  }
+
+  if (rel_path) free(rel_path);
+  free(full_src_path);
+  free(full_dest_path);
+  free(full_dest);
+  free(full_src);
+  return errors;
+}
+/*}}}*/
+static int watch_removed(struct package_watch *pw, const char *tail, const char *name)/*{{{*/
+{
+  /* Entry 'name' of directory 'tail' has gone from the package : remove the
+   * link to it, or if there's a directory in the link area there, the links
+   * into the package under it.  Anything else is left alone. */
+  struct entry_context c;
+  char *full_src, *full_dest, *full_src_path, *full_dest_path, *rel_path;
+  mode_t mode;
+  int errors = 0;
+
+  full_dest = caten(pw->dest, tail);
+  full_dest_path = dfcaten(full_dest, name);
+  free(full_dest);
+  if (dest_lstat(full_dest_path, &mode) < 0) {
+    free(full_dest_path);
+    return 0;
+  }
+  full_src = caten(pw->src, tail);
+  full_src_path = dfcaten(full_src, name);
+  free(full_src);
+  rel_path = watch_rel_path(pw, tail);
+  watch_context(pw, &c, tail, name, rel_path, full_src_path, full_dest_path);
+  c.src_type = ST_OTHER;
+
+  if (c.dest_type == DT_DIRECTORY) {
+    struct dirlist *dl = read_dirlist(full_dest_path);
+    char *new_tail = dfcaten(tail, name);
+    int i;
+    for (i=0; dl && (i<dl->n); i++) {
+      errors |= watch_removed(pw, new_tail, dl->entries[i].name);
+    }
+    if (dl) free_dirlist(dl);
+    free(new_tail);
+  } else if (c.dest_type == DT_LINK_EXACT) {
+    const struct action_table *table = get_action_table(ACT_SOFT_DELETE, pw->opt);
+    errors = run_entry(table, &table->e[ST_OTHER][DT_LINK_EXACT], &c);
+  }
+  if (c.linked_path) free(c.linked_path);
+  if (rel_path) free(rel_path);
+  free(full_src_path);
+  free(full_dest_path);
+  return errors;
+}
+/*}}}*/
+static void watch_changed(struct package_watch *pw, const char *path)/*{{{*/
+{
+  /* Bring the link area up to date with 'path' in the package */
+  struct stat sb;
+  char *tail, *name, *full_src_path, *full_dest, *p;
+  mode_t mode;
+
+  tail = new_string(path);
+  name = strrchr(tail, '/');
+  *name++ = 0;
+  full_dest = caten(pw->dest, tail);
+  /* Each directory on the way down has to be a real one : under a link to
+   * one of the package's directories, or where nothing's linked at all,
+   * there's nothing to do.  (Looking at the last alone would go through any
+   * link above it.) */
+  for (p = full_dest + strlen(pw->dest); *p; ) {
+    char *slash = strchr(p + 1, '/');
+    int status;
+    if (slash) *slash = 0;
+    status = dest_lstat(full_dest, &mode);
+    if (slash) *slash = '/';
+    if ((status < 0) || !S_ISDIR(mode)) {
+      free(full_dest);
+      free(tail);
+      return;
+    }
+    p = slash ? slash : p + strlen(p);
+  }
+  full_src_path = caten(pw->src, path);
+  if (lstat(full_src_path, &sb) == 0) {
+    if (!check_ignore(pw->pkg_set, pw->area_set, tail, name) &&
+        !watch_entry(pw, tail, name, ACT_PRE_INSTALL)) {
+      watch_entry(pw, tail, name, ACT_INSTALL);
+    }
+  } else {
+    watch_removed(pw, tail, name);
+  }
+  free(full_src_path);
+  free(full_dest);
+  free(tail);
+}
+/*}}}*/
+static int watch_package(const char *rel_path, const char *src, const char *dest,/*{{{*/
+                         const char *pkg, const char *version,
+                         const struct ignore_set *area_set, struct options *opt)
+{
+  /* Keep link area 'dest' up to date with the package at 'src', which has
+   * just been installed, until killed. */
+  struct package_watch pw;
+  char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  const char *srcs[1];
+
+  pw.fd = inotify_init1(IN_CLOEXEC);
+  if (pw.fd < 0) {
+    fprintf(stderr, "Couldn't initialise inotify : %s\n", strerror(errno));
+    return 1;
+  }
+  pw.tails = NULL;
+  pw.n_tails = 0;
+  pw.rel_path = rel_path;
+  pw.src = src;
+  pw.dest = dest;
+  pw.pkg = pkg;
+  pw.version = version;
+  pw.pkg_set = package_ignores(src);
+  pw.area_set = area_set;
+  pw.opt = opt;
+  srcs[0] = src;
+
+  /* Other runs can have the area while nothing's changing */
+  release_locks();
+  watch_tree(&pw, "");
+  if (!opt->quiet) fprintf(stderr, "\nWatching <%s> for changes\n\n", src);
+
+  for (;;) {
+    struct strtab *changed = new_strtab();
+    const char **paths;
+    int timeout = -1;
+    int overflowed = 0;
+    int n_paths, i;
+
+    /* Gather events until there's a pause */
+    for (;;) {
+      struct pollfd pfd;
+      char *p;
+      int len;
+      pfd.fd = pw.fd;
+      pfd.events = POLLIN;
+      len = poll(&pfd, 1, timeout);
+      if ((len < 0) && (errno == EINTR)) continue;
+      if (len < 0) {
+        fprintf(stderr, "Couldn't wait for changes : %s\n", strerror(errno));
+        return 1;
+      }
+      if (len == 0) break;
+      len = read(pw.fd, buf, sizeof(buf));
+      if (len <= 0) continue;
+      for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *) p)->len) {
+        struct inotify_event *ev = (struct inotify_event *) p;
+        char *path;
+        if (ev->mask & IN_Q_OVERFLOW) overflowed = 1;
+        if ((ev->wd < 0) || (ev->wd >= pw.n_tails) || !pw.tails[ev->wd]) continue;
+        if (ev->mask & IN_IGNORED) {
+          free(pw.tails[ev->wd]);
+          pw.tails[ev->wd] = NULL;
+          continue;
+        }
+        if (!ev->len) continue;
+        path = dfcaten(pw.tails[ev->wd], ev->name);
+        strtab_insert(changed, path);
+        /* Its contents will be dealt with along with it, but what happens
+         * to them from now on needs watching too */
+        if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) && (ev->mask & IN_ISDIR) &&
+            !check_ignore(pw.pkg_set, pw.area_set, pw.tails[ev->wd], ev->name)) {
+          watch_tree(&pw, path);
+        }
+        free(path);
+        path = caten(src, pw.tails[ev->wd]);
+        drop_src_listing(path);
+        free(path);
+      }
+      timeout = WATCH_SETTLE_MS;
+    }
+
+    /* Parents sort before their children */
+    paths = new_array(const char *, changed->count + 1);
+    n_paths = 0;
+    for (i=0; i<changed->size; i++) {
+      struct strtab_node *node;
+      for (node = changed->buckets[i]; node; node = node->next) paths[n_paths++] = node->key;
+    }
+    if (n_paths > 1) qsort(paths, n_paths, sizeof(const char *), compare_names);
+
+    lock_area(dest, 1, srcs);
+    if (overflowed) {
+      /* Too much happened to keep track of : go over the whole package */
+      fprintf(stderr, "Lost track of changes to <%s>, checking all of it; anything removed from it meanwhile\n"
+                      "may still be linked, run spill again to clear that\n", src);
+      drop_all_src_listings();
+      if (!traverse_action(rel_path, src, dest, pkg, version, "", opt, area_set, ACT_PRE_INSTALL)) {
+        traverse_action(rel_path, src, dest, pkg, version, "", opt, area_set, ACT_INSTALL);
+      }
+    } else {
+      for (i=0; i<n_paths; i++) watch_changed(&pw, paths[i]);
+    }
+    release_locks();
+    fflush(stdout);
+    free(paths);
+    strtab_free(changed);
+  }
+  return 0;
+}
+/*}}}*/
+/*}}}*/
+static void usage(char *toolname)/*{{{*/
+{
+  fprintf(stderr,
+    "spill version %s - segregated package install logical linker\n"
+    "Copyright (C) Richard P. Curnow  2003-2006\n"
+    "\n"
+    "spill comes with ABSOLUTELY NO WARRANTY.\n"
+    "This is free software, and you are welcome to redistribute it\n"
+    "under certain conditions; see the GNU General Public License for details.\n", PROGRAM_VERSION);
+  fprintf(stderr,
+    "\n"
+    "Printing this help\n"
+    "Syntax : spill -h\n"
+    "  -h,  --help             Show this help message then exit\n"
+    "Showing just the version\n"
+    "Syntax : spill -V\n"
+    "  -V,  --version          Show the program version then exit\n"
+    "\n"
+    "---------------------------\n"
+    "Options for package install (default operation)\n"
+    "---------------------------\n"
+    "Syntax : spill [-f] [-n] [-q] [-x] [-r] [-o] [-g] [-a <link_install_path>...]\n"
+    "               [-l <file> | --conflict-list=<file>\n"
+    "               <tool_install_path> [<link_install_path>] [<ignore_path>...]\n"
+    "  -f,  --force            Attempt install even if expected subdirectories (bin,sbin,lib) are missing\n"
+    "  -r,  --retain           Don't clean out links to older version of the same package first\n"
+    "  -n,  --dry_run          Don't do install, just report potential link conflicts\n"
+    "  -q,  --quiet            Be quiet when installing, only show errors\n"
+    "  -x,  --expand           Expand any existing links to directories when needed\n"
+    "  -o,  --override         Override any existing links that conflict with the new package\n"
+    "  -g,  --generation       Build a new generation of <link_install_path> and switch to it atomically\n"
+    "  -a,  --also=<path>      Install into link area <path> as well (may be repeated)\n"
+    "  --pipeline              Overlap reading, checking and writing in separate threads\n"
+    "  --io-uring              As --pipeline, making the calls a directory at a time through io_uring\n"
+    "  --flatten               Link straight to the end of chains of links within a package directory\n"
+    "  --hardlink              Hard link regular files into the link area instead of symlinking them\n"
+    "  --reflink               Put reflinked copies of regular files in the link area instead of symlinks\n"
+    "  --archive=<file>        Write the links to a tar archive (\"-\" for stdout) instead of the link area\n"
+    "  --watch                 Stay running afterwards, linking and unlinking what changes in the package\n"
+    "  --no-lock               Don't lock the link area against other runs of spill\n"
+    "  --max-open-dirs=<n>     Hold no more than <n> directories open for locking at once\n"
+    "  --throttle=<ops/s>[,<outstanding>[,<ms>]]\n"
+    "                          Pace filesystem operations, backing off while they take over <ms>\n"
+    "  --nfs                   Trust cached file attributes, and report the filesystem calls made\n"
+    "  -l <conflict_file>\n"
+    "  --conflict-list=<file>  Filename to which conflicting destination paths are written\n"
+    "\n"
+    "<tool_install_path>       Directory specified as --prefix when package was built\n"
+    "                          (relative links are created if this is given as a relative path)\n"
+    "<link_install_path>       Base directory where links are created (e.g. /usr) (default is \".\")\n"
+    "<ignore_path>...          Space-separated list of relative paths not to be linked\n"
+    "                          (also read from .spillignore in the package and the link area)\n"
+    "\n"
+    "Syntax : spill [-f] [-n] [-q] [-x] [-r] [-o] [-g] --manifest=<file>\n"
+    "               [<link_install_path>] [<ignore_path>...]\n"
+    "  --manifest=<file>       Install every <tool_install_path> listed in <file> (one per line) in one run\n"
+    "\n"
+    "Syntax : spill [-f] [-n] [-q] [-x] [-o] [-g] --reconcile <desired_list>\n"
+    "               [<link_install_path>] [<ignore_path>...]\n"
+    "  --reconcile <file>      Install, upgrade and remove packages so that exactly the\n"
+    "                          <tool_install_path>s listed in <file> are installed\n"
+    "\n"
+    "---------------------------\n"
+    "Options for package removal\n"
+    "---------------------------\n"
+    "Syntax : spill -d [-q] [-a <link_install_path>...] <tool_install_path> [<link_install_path>]\n"
+    "  -q,  --quiet            Be quiet, only show errors\n"
+    "<tool_install_path> and <link_install_path> as above.\n"
+    "\n"
+    "\n"
+    "Syntax : spill -D [-q] [-a <link_install_path>...] <package_name> <link_install_path>\n"
+    "  -q,  --quiet            Be quiet, only show errors\n"
+    "<link_install_path> as above.\n"
+    "<package_name> is the name of package already symlinked.\n"
+    "\n"
+    "Syntax : spill --rollback <link_install_path>\n"
+    "  Switch <link_install_path> back to its previous generation\n"
+    "\n"
+    "Syntax : spill --convert <link_install_path>\n"
+    "  Turn the plain link area <link_install_path> into generation 1 of one managed in generations\n"
+    "\n"
+    "Syntax : spill --prune=<n> <link_install_path>\n"
+    "  Remove all but <n> generations of <link_install_path> : the current one and the newest others\n"
+    "\n"
+    "---------------------------\n"
+    "Queries\n"
+    "---------------------------\n"
+    "Syntax : spill --owner <path>...\n"
+    "  Show the package and version that each <path> under a link area belongs to\n"
+    "\n"
+    "Syntax : spill --files <package_name> [<link_install_path>]\n"
+    "  Show the links in <link_install_path> that belong to <package_name>\n"
+    "\n"
+    "Syntax : spill --list [--json] [<link_install_path>]\n"
+    "  List the packages recorded in <link_install_path>\n"
+    "  --json                  Write the list as JSON instead of a table\n"
+    "\n"
+    "Syntax : spill --conflicts [-q] [--manifest=<file>] [<tool_install_path>...]\n"
+    "  Show the paths that more than one of the packages would link, and the\n"
+    "  directories they'd have to share, without needing a link area\n"
+    "  -q,  --quiet            Only show how many paths each pair of packages clashes over\n"
+    "\n"
+    "Syntax : spill --diff [-q] [--jobs=<n>] <link_install_path_a> <link_install_path_b>\n"
+    "  Show the links added, removed, retargeted, expanded or collapsed going from\n"
+    "  <link_install_path_a> to <link_install_path_b>, and a summary per package\n"
+    "  -q,  --quiet            Only show the summary\n"
+    "  --jobs=<n>              Compare <n> directories at once (default: one per CPU)\n"
+    "\n"
+    "---------------------------\n"
+    "Daemon mode\n"
+    "---------------------------\n"
+    "Syntax : spill --daemon=<socket> [<link_install_path>]\n"
+    "  Keep the state of <link_install_path> in memory and serve requests on <socket>\n"
+    "Syntax : spill --client=<socket> <any other spill arguments>\n"
+    "  Have the daemon listening on <socket> carry out the request\n"
+    "\n"
+
+    );
+}
+/*}}}*/
+static void show_version(char *toolname)/*{{{*/
+{
+  fprintf(stderr, "spill version %s\n", PROGRAM_VERSION);
+}
+/*}}}*/
+struct area_run {/*{{{*/
+  const char *dest;    /* as given, or the new generation being built */
+  char *clean_dest;
+  char *relative_path; /* from this area to the package, for relative installs */
+  char *link_area;     /* these three are only set when building a generation */
+  char *gen_path;
+  int new_gen;
+  int expansions;      /* made by the pre-install check */
+  struct ignore_set *ignores; /* from the area's .spillignore, or NULL */
+};
+/*}}}*/
+static void open_area(struct area_run *a, const char *dest, int use_generations)/*{{{*/
+{
+  a->dest = dest;
+  a->clean_dest = cleanup_dir(dest);
+  a->relative_path = NULL;
+  a->link_area = NULL;
+  a->gen_path = NULL;
+  a->new_gen = 0;
+  a->expansions = 0;
+  if (use_generations || (current_generation(a->clean_dest) > 0)) {
+    /* Do all the work in a new generation, which only becomes visible if
+     * everything succeeds. */
+    a->link_area = a->clean_dest;
+    a->gen_path = new_generation(a->link_area, &a->new_gen);
+    if (!a->gen_path) exit(1);
+    generation_mode = 1;
+    a->dest = a->gen_path;
+    a->clean_dest = new_string(a->gen_path);
+  }
+  if (dest_cache) {
+    /* Running on behalf of the daemon, whose cache is keyed by absolute path */
+    free(a->clean_dest);
+    a->clean_dest = normalise_dir(a->dest);
+  }
+}
+/*}}}*/
+static void lock_areas(struct area_run *areas, int n_areas,/*{{{*/
+                       const char *src, const char *pkg, int with_old)
+{
+  /* Lock what's needed in each link area for installing or removing package
+   * 'src' (if given) and, if 'with_old', the version of 'pkg' recorded there.
+   * The areas are done in order of their real paths, so that other runs
+   * taking the same areas in a different order don't deadlock with this one. */
+  char **canon;
+  int *order;
+  int i, j;
+
+  if (!use_locks) return;
+  canon = new_array(char *, n_areas);
+  order = new_array(int, n_areas);
+  for (i=0; i<n_areas; i++) {
+    canon[i] = (n_areas > 1) ? normalise_dir(areas[i].dest) : NULL;
+    for (j=i; (j > 0) && (strcmp(canon[order[j-1]], canon[i]) > 0); j--) {
+      order[j] = order[j-1];
+    }
+    order[j] = i;
+  }
+  for (i=0; i<n_areas; i++) {
+    struct area_run *a = &areas[order[i]];
+    const char *srcs[2];
+    char *old = with_old ? recorded_install_area(a->clean_dest, pkg) : NULL;
+    int n = 0;
+    if (src) srcs[n++] = src;
+    if (old) srcs[n++] = old;
+    lock_area(a->clean_dest, n, srcs);
+    if (old) free(old);
+    if (canon[order[i]]) free(canon[order[i]]);
+  }
+  free(canon);
+  free(order);
+}
+/*}}}*/
+static int spill_main(int argc, char **argv)/*{{{*/
+{
+
+  char *src, *dest;
+  int is_rel_src;
+  char *clean_src;
+  int sane_src, sane_dest;
+  char *pkg=NULL, *version=NULL;
+  struct options opt;
+  int bare_args;
+  char *argv0 = argv[0];
+  char *conflict_list_path = NULL;
+  int do_tree_delete;
+  int do_pkg_delete;
+  int do_retain;
+  int hard_delete;
+  int do_owner;
+  int do_files;
+  int do_list;
+  int do_diff;
+  int do_conflicts;
+  int do_watch;
+  int jobs;
+  int json;
+  char **owner_paths;
+  int n_owner_paths;
+  char *daemon_socket;
+  int use_generations;
+  int do_rollback;
+  int do_convert;
+  int prune_keep;
+  char *manifest_path = NULL;
+  char *reconcile_path = NULL;
+  char **also_dests;
+  int n_also;
+  struct area_run *areas;
+  int n_areas;
+  int i;
+  char *link_area = NULL;
+  char *gen_path = NULL;
+  int new_gen = 0;
+  char **next_argv;
+  int next_argc;
+
+#ifdef TEST_MAKE_REL
+  printf("%s\n", make_rel("/x/y/zoo/foo", "/x/y/zaa/wib/ble"));
+  printf("%s\n", make_rel("/x/y/zoo", "/x/y/zaa/wib/ble"));
+  printf("%s\n", make_rel("/x/y", "/x/y/zaa/wib/ble"));
+  printf("%s\n", make_rel("/x", "/x/y/zaa/wib/ble"));
+  printf("%s\n", make_rel("/x/y/zaa/wib/ble", "/x/y/zoo/foo"));
+  printf("%s\n", make_rel("/x/y/zaa/wib/ble", "/x/y/zoo"));
+  printf("%s\n", make_rel("/x/y/zaa/wib/ble", "/x/y"));
+  printf("%s\n", make_rel("/x/y/zaa/wib/ble", "/x"));
+  printf("%s\n", make_rel("/x/y/zoo", "/x/y/zaa"));
+  printf("%s\n", make_rel("/x/y/zaa", "/x/y/zaa"));
+  exit(0);
+#endif
+
+
+  /* Parse arguments. */
+  opt.quiet = 0; /* off by default */
+  opt.dry_run = 0;
+  opt.expand = 0;
+  opt.force = 0;
+  opt.override = 0;
+  src = NULL; /* required. */
+  dest = "."; /* pwd by default. */
+  bare_args = 0;
+  do_tree_delete = 0;
+  do_pkg_delete = 0;
+  do_retain = 0;
+  hard_delete = 0;
+  do_owner = 0;
+  do_files = 0;
+  do_list = 0;
+  do_diff = 0;
+  do_conflicts = 0;
+  do_watch = 0;
+  jobs = 0;
+  json = 0;
+  daemon_socket = NULL;
+  use_generations = 0;
+  do_rollback = 0;
+  do_convert = 0;
+  prune_keep = 0;
+  owner_paths = new_array(char *, argc);
+  also_dests = new_array(char *, argc);
+  n_also = 0;
+  n_owner_paths = 0;
+
+  ++argv;
+  --argc;
+  while (argc > 0) {
+    /* Handle flags' arguments the same way tar does */
+    next_argv = argv + 1;
+    next_argc = argc - 1;
+    if (!strncmp(*argv, "--", 2)) {
+      /* Long argument */
+      if (!strcmp(*argv, "--quiet")) {
+        opt.quiet = 1;
+      } else if (!strcmp(*argv, "--dry_run")) {
+        opt.dry_run = 1;
+      } else if (!strcmp(*argv, "--expand")) {
+        opt.expand = 1;
+      } else if (!strcmp(*argv, "--help")) {
+        usage(argv0);
+        exit(0);
+      } else if (!strcmp(*argv, "--version")) {
+        show_version(argv0);
+        exit(0);
+      } else if (!strcmp(*argv, "--force")) {
+        opt.force = 1;
+      } else if (!strcmp(*argv, "--delete-tree")) {
+        do_tree_delete = 1;
+      } else if (!strcmp(*argv, "--delete-pkg")) {
+        do_pkg_delete = 1;
+      } else if (!strcmp(*argv, "--retain")) {
+        do_retain = 1;
+      } else if (!strcmp(*argv, "--override")) {
+        opt.override = 1;
+      } else if (!strcmp(*argv, "--owner")) {
+        do_owner = 1;
+      } else if (!strcmp(*argv, "--files")) {
+        do_files = 1;
+      } else if (!strcmp(*argv, "--list")) {
+        do_list = 1;
+      } else if (!strcmp(*argv, "--json")) {
+        json = 1;
+      } else if (!strcmp(*argv, "--diff")) {
+        do_diff = 1;
+      } else if (!strcmp(*argv, "--conflicts")) {
+        do_conflicts = 1;
+      } else if (!strcmp(*argv, "--watch")) {
+        do_watch = 1;
+      } else if (!strncmp(*argv, "--jobs=", 7)) {
+        jobs = atoi(*argv + 7);
+        if (jobs < 1) {
+          fprintf(stderr, "--jobs needs to be at least 1\n");
+          exit(1);
+        }
+      } else if (!strcmp(*argv, "--generation")) {
+        use_generations = 1;
+      } else if (!strcmp(*argv, "--no-lock")) {
+        use_locks = 0;
+      } else if (!strncmp(*argv, "--throttle=", 11)) {
+        if (!parse_throttle(*argv + 11)) {
+          fprintf(stderr, "Can't make sense of '%s' : expected --throttle=<ops/s>[,<outstanding>[,<ms>]]\n", *argv);
+          exit(1);
+        }
+      } else if (!strcmp(*argv, "--nfs")) {
+        if (!nfs_mode) atexit(report_meta_calls);
+        nfs_mode = 1;
+      } else if (!strncmp(*argv, "--max-open-dirs=", 16)) {
+        max_open_dirs = atoi(*argv + 16);
+        if (max_open_dirs < 2) {
+          fprintf(stderr, "--max-open-dirs needs to be at least 2\n");
+          exit(1);
+        }
+      } else if (!strcmp(*argv, "--pipeline")) {
+        pipelining = 1;
+      } else if (!strcmp(*argv, "--io-uring")) {
+        use_uring = 1;
+        pipelining = 1;
+      } else if (!strcmp(*argv, "--flatten")) {
+        flatten_links = 1;
+      } else if (!strcmp(*argv, "--hardlink")) {
+        materialise_mode = MAT_HARDLINK;
+      } else if (!strcmp(*argv, "--reflink")) {
+        materialise_mode = MAT_REFLINK;
+      } else if (!strncmp(*argv, "--archive=", 10)) {
+        archive_path = *argv + 10;
+      } else if (!strcmp(*argv, "--rollback")) {
+        do_rollback = 1;
+      } else if (!strcmp(*argv, "--convert")) {
+        do_convert = 1;
+      } else if (!strncmp(*argv, "--prune=", 8)) {
+        prune_keep = atoi(*argv + 8);
+        if (prune_keep < 1) {
+          fprintf(stderr, "--prune needs to keep at least 1 generation\n");
+          exit(1);
+        }
+      } else if (!strcmp(*argv, "--reconcile")) {
+        if (next_argc < 1) {
+          fprintf(stderr, "--reconcile needs a <desired_list>\n");
+          exit(1);
+        }
+        reconcile_path = *next_argv;
+        next_argv++;
+        next_argc--;
+      } else if (!strncmp(*argv, "--also=", 7)) {
+        also_dests[n_also++] = *argv + 7;
+      } else if (!strncmp(*argv, "--manifest=", 11)) {
+        manifest_path = *argv + 11;
+      } else if (!strncmp(*argv, "--daemon=", 9)) {
+        daemon_socket = *argv + 9;
+      } else if (!strncmp(*argv,"--conflict-list=", 16)) {
+        conflict_list_path = new_string(*argv + 16);
+      } else {
+        fprintf(stderr, "Unrecognized option '%s'\n", *argv);
+      }
+    } else if ((*argv)[0] == '-') {
+      char *p = (*argv) + 1;
+      /* Allow more than 1 flag per option starting with '-' */
+      while (*p) {
+        switch (*p) {
+          case 'q':
+            opt.quiet = 1;
+            break;
+          case 'n':
+            opt.dry_run = 1;
+            break;
+          case 'x':
+            opt.expand = 1;
+            break;
+          case 'h':
+            usage(argv0);
+            exit(0);
+          case 'V':
+            show_version(argv0);
+            exit(0);
+          case 'f':
+            opt.force = 1;
+            break;
+          case 'd':
+            do_tree_delete = 1;
+            break;
+          case 'D':
+            do_pkg_delete = 1;
+            break;
+          case 'r':
+            do_retain = 1;
+            break;
+          case 'o':
+            opt.override = 1;
+            break;
+          case 'g':
+            use_generations = 1;
+            break;
+          case 'a':
+            if (next_argc < 1) {
+              fprintf(stderr, "-a needs a <link_install_path>\n");
+              exit(1);
+            }
+            also_dests[n_also++] = *next_argv;
+            next_argv++;
+            next_argc--;
+            break;
+          case 'l':
+            conflict_list_path = new_string(*next_argv);
+            next_argv++;
+            next_argc--;
+            break;
+          default:
+            fprintf(stderr, "Unrecognized option '-%c'\n", *p);
+        }
+        p++;
+      }
+    } else if (do_owner || do_conflicts) {
+      owner_paths[n_owner_paths++] = *argv;
+    } else {
+      switch (bare_args) {
+        case 0: src  = *argv; break;
+        case 1: dest = *argv; break;
+        default:
+          add_ignore(*argv);
+          break;
+      }
+      ++bare_args;
+    }
+
+    argc = next_argc;
+    argv = next_argv;
+  }
+
+  if (materialise_mode == MAT_REFLINK) {
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, PATH_MAX) == NULL) {
+      fprintf(stderr, "Couldn't get current directory!\n");
+      exit(1);
+    }
+    materialise_cwd = new_string(cwd);
+  }
+
+  if (archive_path) {
+    if (materialise_mode != MAT_SYMLINK) {
+      fprintf(stderr, "An archive only holds symlinks : --archive can't be used with --hardlink or --reflink\n");
+      exit(1);
+    }
+    if (use_generations || n_also) {
+      fprintf(stderr, "--archive writes one link area : it can't be used with --generation or --also\n");
+      exit(1);
+    }
+  }
+
+  if (do_watch && (do_tree_delete || do_pkg_delete || manifest_path || reconcile_path ||
+                   use_generations || n_also || archive_path || opt.dry_run)) {
+    fprintf(stderr, "--watch keeps one link area up to date with one package : it can't be used with\n"
+                    "-d, -D, --manifest, --reconcile, --generation, --also, --archive or a dry run\n");
+    exit(1);
+  }
+
+  if (daemon_socket) {
+    if (dest_cache) {
+      fprintf(stderr, "Already running as a daemon\n");
+      exit(1);
+    }
+    /* The only bare argument is the link area */
+    exit(run_daemon(daemon_socket, src ? src : "."));
+  }
+
+  if (do_owner) {
+    if (n_owner_paths == 0) {
+      fprintf(stderr, "Missing arguments : need at least one <path>\n");
+      usage(argv0);
+      exit(1);
+    }
+    exit(show_owners(n_owner_paths, owner_paths) ? 1 : 0);
+  }
+
+  if (do_conflicts) {
+    char **srcs = owner_paths;
+    int n_srcs = n_owner_paths;
+    if (manifest_path) {
+      char **listed = read_manifest(manifest_path, &n_srcs);
+      srcs = new_array(char *, n_srcs + n_owner_paths);
+      for (i=0; i<n_srcs; i++) srcs[i] = listed[i];
+      for (i=0; i<n_owner_paths; i++) srcs[n_srcs++] = owner_paths[i];
+    }
+    if (n_srcs < 2) {
+      fprintf(stderr, "Missing arguments : need at least two <tool_install_path>s\n");
+      usage(argv0);
+      exit(2);
+    }
+    exit(find_conflicts(n_srcs, srcs, &opt));
+  }
+
+  if (do_rollback) {
+    if (!src) {
+      fprintf(stderr, "Missing arguments : need <link_install_path>\n");
+      usage(argv0);
+      exit(1);
+    }
+    link_area = cleanup_dir(src);
+    exit(rollback_generation(link_area));
+  }
+
+  if (do_convert || prune_keep) {
+    if (!src) {
+      fprintf(stderr, "Missing arguments : need <link_install_path>\n");
+      usage(argv0);
+      exit(1);
+    }
+    link_area = cleanup_dir(src);
+    exit(do_convert ? convert_to_generations(link_area) : prune_generations(link_area, prune_keep));
+  }
+
+  if (do_list) {
+    /* The only bare argument is the link area */
+    exit(list_records(src ? src : ".", json));
+  }
+
+  if (do_diff) {
+    if (bare_args != 2) {
+      fprintf(stderr, "Missing arguments : need <link_install_path_a> and <link_install_path_b>\n");
+      usage(argv0);
+      exit(2);
+    }
+    if (jobs == 0) {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      jobs = (cpus < 1) ? 1 : (cpus > 64) ? 64 : (int) cpus;
+    }
+    exit(diff_areas(src, dest, jobs, &opt));
+  }
+
+  if (do_files) {
+    if (!src) {
+      fprintf(stderr, "Missing arguments : need <package_name>\n");
+      usage(argv0);
+      exit(1);
+    }
+    exit(show_files(dest, src, &opt) ? 1 : 0);
+  }
+
+  if (manifest_path || reconcile_path) {
+    char **srcs = NULL;
+    int n_srcs = 0, status;
+    struct reconcile_plan plan = {0, NULL, 0, NULL};
+    struct ignore_set *area_set;
+    /* The first bare argument is the link area; the rest are ignores */
+    if (bare_args > 1) add_ignore(dest);
+    dest = src ? src : ".";
+    if (reconcile_path) {
+      plan_reconcile(reconcile_path, dest, &plan);
+      if ((plan.n_install == 0) && (plan.n_remove == 0)) {
+        if (!opt.quiet) fprintf(stderr, "<%s> is up to date\n", dest);
+        exit(0);
+      }
+    } else {
+      srcs = read_manifest(manifest_path, &n_srcs);
+      if (n_srcs == 0) {
+        fprintf(stderr, "Manifest %s lists no packages\n", manifest_path);
+        exit(1);
+      }
+    }
+    link_area = cleanup_dir(dest);
+    if (archive_path) open_archive_area(link_area);
+    area_set = load_area_ignores(link_area, 1, !opt.dry_run && !archive_path && !use_generations &&
+                                 (current_generation(link_area) == 0));
+    if (use_generations || (current_generation(dest) > 0)) {
+      gen_path = new_generation(link_area, &new_gen);
+      if (!gen_path) exit(1);
+      generation_mode = 1;
+      dest = gen_path;
+    }
+    if (reconcile_path) {
+      status = apply_reconcile(&plan, dest, area_set, &opt, conflict_list_path);
+    } else {
+      status = batch_install(n_srcs, srcs, dest, area_set, &opt, do_retain, conflict_list_path, 0, NULL);
+    }
+    if (archive_path && !status && !opt.dry_run) status = write_archive();
+    if (gen_path) {
+      if (status || opt.dry_run) {
+        if (status) fprintf(stderr, "Generation %d abandoned, <%s> is unchanged\n", new_gen, link_area);
+        remove_generation(gen_path);
+      } else {
+        if (activate_generation(link_area, new_gen)) exit(1);
+        if (!opt.quiet) fprintf(stderr, "Activated generation %d of <%s>\n", new_gen, link_area);
+      }
+    }
+    exit(status ? 1 : 0);
+  }
+
+  if (!src || !dest) {
+    fprintf(stderr, "Missing arguments : need at least <tool_install_path> and <link_install_path>\n");
+    usage(argv0);
+    exit(1);
+  }
+
+  /* normalise src. */
+  is_rel_src = (src[0] == '/') ? 0 : 1;
+
+  /* Clean up src and dest */
+  clean_src = cleanup_dir(src);
+  if (archive_path) open_archive_area(dest);
+  areas = new_array(struct area_run, n_also + 1);
+  if (n_also) {
+    /* Take the locks on all the generations to be built at once */
+    char **gen_areas = new_array(char *, n_also + 1);
+    int n_gen_areas = 0;
+    for (i=0; i<=n_also; i++) {
+      char *area = cleanup_dir(i ? also_dests[i - 1] : dest);
+      if (use_generations ? (current_generation(area) >= 0) : (current_generation(area) > 0)) {
+        gen_areas[n_gen_areas++] = area;
+      } else {
+        free(area);
+      }
+    }
+    lock_generation_dirs(n_gen_areas, gen_areas);
+    for (i=0; i<n_gen_areas; i++) free(gen_areas[i]);
+    free(gen_areas);
+  }
+  open_area(&areas[0], dest, use_generations);
+  for (i=0; i<n_also; i++) {
+    open_area(&areas[i + 1], also_dests[i], use_generations);
+  }
+  n_areas = n_also + 1;
+  for (i=0; i<n_areas; i++) {
+    areas[i].ignores = load_area_ignores(areas[i].link_area ? areas[i].link_area : areas[i].clean_dest,
+                                         i == 0, !opt.dry_run && !archive_path && !areas[i].gen_path);
+  }
+
+  if (do_pkg_delete) {
+    char *pkg_name = src;
+    lock_areas(areas, n_areas, NULL, pkg_name, 1);
+    for (i=0; i<n_areas; i++) {
+      remove_pkg_by_name(areas[i].dest, pkg_name, &opt);
+    }
+  } else {
+
+    /* See whether src and dest look reasonable. */
+    if (!opt.force) {
+      sane_src = check_sane("source", clean_src);
+      sane_dest = 1;
+      for (i=0; i<n_areas; i++) {
+        if (fresh_generation(areas[i].clean_dest)) continue;
+        sane_dest &= check_sane("destination", areas[i].clean_dest);
+      }
+
+      if (!sane_src || !sane_dest) {
+        exit(1);
+      }
+    }
+
+    if (is_rel_src) {
+      char *canon_src = normalise_dir(src);
+      for (i=0; i<n_areas; i++) {
+        char *canon_dest = normalise_dir(areas[i].dest);
+        areas[i].relative_path = make_rel(canon_dest, canon_src);
+        free(canon_dest);
+      }
+      free(canon_src);
+    }
+
+    /* Extract package and version for new package. */
+
+    extract_package_details(clean_src, &pkg, &version);
+
+    lock_areas(areas, n_areas, clean_src, pkg, !do_tree_delete && !do_retain);
+
+    if (do_tree_delete) {
+      /* Delete the links to the 'source' package from the destination tree,
+         assuming the 'source' tree still exists intact.  */
+
+      for (i=0; i<n_areas; i++) {
+        traverse_action(areas[i].relative_path, clean_src, areas[i].clean_dest, pkg, version, "", &opt, NULL, ACT_SOFT_DELETE);
+      }
+
+    } else {
+      /* Normal mode - package installation */
+      int failed = 0;
+
+      if (!opt.quiet) fprintf(stderr, "Run pre-installing check for package <%s>, version <%s>\n", pkg, version);
+
+      if (conflict_list_path) {
+        conflict_file = fopen(conflict_list_path, "w");
+        if (!conflict_file) {
+          fprintf(stderr, "Could not open %s to write conflict list to\n", conflict_list_path);
+        }
+      }
+
+      /* Every link area has to pass before any of them is touched */
+      for (i=0; i<n_areas; i++) {
+        if ((n_areas > 1) && !opt.quiet) fprintf(stderr, "Checking link area <%s>\n", areas[i].clean_dest);
+        install_counts.expansions = 0;
+        pipeline_start(clean_src, areas[i].clean_dest, areas[i].ignores, 0);
+        failed |= traverse_action(areas[i].relative_path, clean_src, areas[i].clean_dest, pkg, version, "", &opt,
+                                  areas[i].ignores, ACT_PRE_INSTALL);
+        pipeline_finish();
+        areas[i].expansions = install_counts.expansions;
+      }
+      if (failed) {
+        fprintf(stderr, "\nPre-install check found problems, exiting\n\n");
+        for (i=0; i<n_areas; i++) {
+          if (areas[i].gen_path) remove_generation(areas[i].gen_path);
+        }
+        exit(1);
+      }
+
+      if (conflict_file) {
+        fclose(conflict_file);
+      }
+
+      for (i=0; (i<n_areas) && !opt.dry_run; i++) {
+        struct area_run *a = &areas[i];
+        if (!do_retain) {
+          if (!opt.quiet) {
+            fprintf(stderr, "\nPre-install checks OK, removing old version\n\n");
+          }
+          remove_current_install(NULL, clean_src, a->clean_dest, pkg, version, "", &opt);
+        }
+        if (!opt.quiet) {
+          if (n_areas > 1) {
+            fprintf(stderr, "\nPre-install checks OK, proceeding to install into <%s>\n\n", a->clean_dest);
+          } else {
+            fprintf(stderr, "\nPre-install checks OK, proceeding to install\n\n");
+          }
+        }
+        install_counts.links = 0;
+        install_counts.expansions = a->expansions;
+        pipeline_start(clean_src, a->clean_dest, a->ignores, 1);
+        failed = traverse_action(a->relative_path, clean_src, a->clean_dest, pkg, version, "", &opt,
+                                 a->ignores, ACT_INSTALL);
+        failed |= pipeline_finish();
+        if (failed) {
+          if (a->gen_path) {
+            fprintf(stderr, "\nProblems found whilst installing : generation %d abandoned, <%s> is unchanged\n\n",
+                    a->new_gen, a->link_area);
+          } else {
+            fprintf(stderr, "\nProblems found whilst installing : package may only be part-installed\n\n");
+          }
+          /* No generation has been activated yet, so none of them is kept */
+          for (i=0; i<n_areas; i++) {
+            if (areas[i].gen_path) remove_generation(areas[i].gen_path);
+          }
+          exit(1);
+        }
+        if (record_install(a->relative_path, clean_src, a->clean_dest, pkg, version)) exit(1);
+      }
+    }
+  }
+
+  if (archive_path && !opt.dry_run && write_archive()) exit(1);
+
+  if (do_watch) exit(watch_package(areas[0].relative_path, clean_src, areas[0].clean_dest, pkg, version,
+                                     areas[0].ignores, &opt));
+
+  for (i=0; i<n_areas; i++) {
+    struct area_run *a = &areas[i];
+    if (a->gen_path) {
+      if (opt.dry_run) {
+        remove_generation(a->gen_path);
+      } else {
+        if (activate_generation(a->link_area, a->new_gen)) exit(1);
+        if (!opt.quiet) fprintf(stderr, "Activated generation %d of <%s>\n", a->new_gen, a->link_area);
+      }
+      free(a->gen_path);
+      free(a->link_area);
+    }
+    if (a->relative_path) free(a->relative_path);
+    free(a->clean_dest);
+  }
+  free(areas);
+
+  free(clean_src);
+  if (pkg) free(pkg);
+  if (version) free(version);
+
+  return 0;
+
+}
+/*}}}*/
+/*{{{ Library interface */
+/* What spill_open() and the planning calls in spill.h work with.  A plan is
+ * the pre-install check of the command line, run with its findings gathered
+ * up rather than printed; applying it does the rest of what the command line
+ * does, under the same locks. */
+struct spill_area {/*{{{*/
+  char *clean_dest;
+  char *canon_dest;     /* absolute, for working out relative links */
+  struct ignore_set *ignores;
+};
+/*}}}*/
+struct spill_plan {/*{{{*/
+  struct spill_area *area;
+  enum action action;   /* ACT_INSTALL or ACT_SOFT_DELETE */
+  int flags;
+  char *clean_src;
+  char *relative_path;
+  char *pkg;
+  char *version;
+  struct spill_conflict *conflicts;
+  int n_conflicts;
+  char **expansions;    /* directory links to expand when it's applied */
+  int n_expansions;
+  int applied;
+};
+/*}}}*/
+static void use_area(struct spill_area *a);
+
+struct spill_area *spill_open(const char *link_area, int flags)/*{{{*/
+{
+  struct spill_area *a;
+  struct stat sb;
+  char *clean_dest;
+
+  if ((stat(link_area, &sb) < 0) || !S_ISDIR(sb.st_mode)) {
+    fprintf(stderr, "Link area %s can't be used\n", link_area);
+    return NULL;
+  }
+  clean_dest = cleanup_dir(link_area);
+  if (current_generation(clean_dest) > 0) {
+    fprintf(stderr, "Link area %s is managed in generations, which the library can't do\n", clean_dest);
+    free(clean_dest);
+    return NULL;
+  }
+  if (!(flags & SPILL_FORCE) && !check_sane("destination", clean_dest)) {
+    free(clean_dest);
+    return NULL;
+  }
+
+  a = new(struct spill_area);
+  a->clean_dest = clean_dest;
+  a->canon_dest = try_normalise_dir(clean_dest);
+  if (!a->canon_dest) {
+    free(a->clean_dest);
+    free(a);
+    return NULL;
+  }
+  use_area(a);
+  a->ignores = load_ignore_file(a->clean_dest, NULL);
+  return a;
+}
+/*}}}*/
+void spill_close(struct spill_area *a)/*{{{*/
+{
+  if (ignore_cache_area == a->clean_dest) ignore_cache_area = NULL;
+  if (a->ignores) free_ignore_set(a->ignores);
+  free(a->clean_dest);
+  free(a->canon_dest);
+  free(a);
+}
+/*}}}*/
+static void use_area(struct spill_area *a)/*{{{*/
+{
+  /* Read compiled rules from 'a', in place of the command line's first area.
+   * They're only written by spill_apply(). */
+  ignore_cache_area = a->clean_dest;
+  ignore_cache_write = 0;
+}
+/*}}}*/
+static void plan_options(const struct spill_plan *p, int expand, struct options *opt)/*{{{*/
+{
+  memset(opt, 0, sizeof(struct options));
+  opt->quiet = (p->flags & SPILL_QUIET) ? 1 : 0;
+  opt->force = (p->flags & SPILL_FORCE) ? 1 : 0;
+  opt->override = (p->flags & SPILL_OVERRIDE) ? 1 : 0;
+  opt->expand = expand;
+}
+/*}}}*/
+static struct spill_plan *start_plan(struct spill_area *a, const char *tool_install_path,/*{{{*/
+                                     int flags, enum action action)
+{
+  struct spill_plan *p;
+  struct stat sb;
+
+  if ((stat(tool_install_path, &sb) < 0) || !S_ISDIR(sb.st_mode)) {
+    fprintf(stderr, "Package directory %s can't be used\n", tool_install_path);
+    return NULL;
+  }
+  p = new(struct spill_plan);
+  memset(p, 0, sizeof(struct spill_plan));
+  p->area = a;
+  p->action = action;
+  p->flags = flags;
+  p->clean_src = cleanup_dir(tool_install_path);
+  if (tool_install_path[0] != '/') {
+    char *canon_src = try_normalise_dir(tool_install_path);
+    if (!canon_src) {
+      free(p->clean_src);
+      free(p);
+      return NULL;
+    }
+    p->relative_path = make_rel(a->canon_dest, canon_src);
+    free(canon_src);
+  }
+  extract_package_details(p->clean_src, &p->pkg, &p->version);
+  use_area(a);
+  return p;
+}
+/*}}}*/
+static int check_plan(struct spill_plan *p, struct options *opt)/*{{{*/
+{
+  /* Run the pre-install check, keeping what it finds in the plan.  Directory
+   * links that are to be expanded are noted in the plan, and what's under
+   * them checked as though they had been. */
+  struct strtab_node *node;
+  int failed, i;
+
+  collecting = 1;
+  if (opt->expand) planned_expansions = new_strtab();
+  pipeline_start(p->clean_src, p->area->clean_dest, p->area->ignores, 0);
+  failed = traverse_action(p->relative_path, p->clean_src, p->area->clean_dest,
+                           p->pkg, p->version, "", opt, p->area->ignores, ACT_PRE_INSTALL);
+  pipeline_finish();
+  collecting = 0;
+  if (planned_expansions) {
+    for (i=0; i<planned_expansions->size; i++) {
+      for (node = planned_expansions->buckets[i]; node; node = node->next) free(node->value);
+    }
+    strtab_free(planned_expansions);
+    planned_expansions = NULL;
+  }
+  p->expansions = planned_order;
+  p->n_expansions = n_planned;
+  planned_order = NULL;
+  n_planned = max_planned = 0;
+
+  if (failed && !n_collected) {
+    /* Nothing to show for it but a directory that couldn't be read */
+    collected = grow_array(struct spill_conflict, 1, collected);
+    collected[0].kind = SPILL_ERROR;
+    collected[0].path = new_string(p->clean_src);
+    collected[0].other_pkg = collected[0].other_version = NULL;
+    collected[0].message = format_message("!! ERROR can't read all of package <%s>\n", p->clean_src);
+    n_collected = 1;
+  }
+
+  p->conflicts = collected;
+  p->n_conflicts = n_collected;
+  collected = NULL;
+  n_collected = max_collected = 0;
+  return p->n_conflicts;
+}
+/*}}}*/
+struct spill_plan *spill_plan_install(struct spill_area *a, const char *tool_install_path,/*{{{*/
+                                      int flags)
+{
+  struct spill_plan *p;
+  struct options opt;
+
+  p = start_plan(a, tool_install_path, flags, ACT_INSTALL);
+  if (!p) return NULL;
+  if (!(flags & SPILL_FORCE) && !check_sane("source", p->clean_src)) {
+    spill_free_plan(p);
+    return NULL;
+  }
+  lock_packages(a->clean_dest, 1, &p->clean_src, (flags & SPILL_RETAIN) ? 0 : 1, &p->pkg);
+  plan_options(p, (flags & SPILL_EXPAND) ? 1 : 0, &opt);
+  check_plan(p, &opt);
+  return p;
+}
+/*}}}*/
+struct spill_plan *spill_plan_delete(struct spill_area *a, const char *tool_install_path,/*{{{*/
+                                     int flags)
+{
+  struct spill_plan *p;
+  const char *srcs[1];
+
+  p = start_plan(a, tool_install_path, flags, ACT_SOFT_DELETE);
+  if (!p) return NULL;
+  srcs[0] = p->clean_src;
+  lock_area(a->clean_dest, 1, srcs);
+  return p;
+}
+/*}}}*/
+const char *spill_plan_package(const struct spill_plan *p)/*{{{*/
+{
+  return p->pkg;
+}
+/*}}}*/
+const char *spill_plan_version(const struct spill_plan *p)/*{{{*/
+{
+  return p->version;
+}
+/*}}}*/
+int spill_plan_conflicts(const struct spill_plan *p, const struct spill_conflict **conflicts)/*{{{*/
+{
+  *conflicts = p->conflicts;
+  return p->n_conflicts;
+}
+/*}}}*/
+int spill_apply(struct spill_plan *p)/*{{{*/
+{
+  struct spill_area *a = p->area;
+  struct options opt;
+  char *old_area;
+  int expansions;
+  int failed;
+  int i;
+
+  if (p->n_conflicts || p->applied) return 1;
+  p->applied = 1;
+  use_area(a);
+  plan_options(p, 1, &opt);
+
+  if (p->action == ACT_SOFT_DELETE) {
+    return traverse_action(p->relative_path, p->clean_src, a->clean_dest,
+                           p->pkg, p->version, "", &opt, NULL, ACT_SOFT_DELETE) ? 1 : 0;
+  }
+
+  /* Everything has been checked, so the expansions can go ahead */
+  install_counts.expansions = 0;
+  for (i=0; i<p->n_expansions; i++) {
+    if (do_expand(p->expansions[i], &opt)) return 1;
+  }
+  expansions = install_counts.expansions;
+
+  old_area = (p->flags & SPILL_RETAIN) ? NULL : recorded_install_area(a->clean_dest, p->pkg);
+  if (old_area) {
+    remove_current_install(NULL, p->clean_src, a->clean_dest, p->pkg, p->version, "", &opt);
+    free(old_area);
+  }
+  install_counts.links = 0;
+  install_counts.expansions = expansions;
+  pipeline_start(p->clean_src, a->clean_dest, a->ignores, 1);
+  failed = traverse_action(p->relative_path, p->clean_src, a->clean_dest,
+                           p->pkg, p->version, "", &opt, a->ignores, ACT_INSTALL);
+  failed |= pipeline_finish();
+  if (!failed) failed = record_install(p->relative_path, p->clean_src, a->clean_dest, p->pkg, p->version);
+  if (!failed) {
+    save_ignore_cache(a->clean_dest, NULL, a->ignores);
+    save_ignore_cache(p->clean_src, p->pkg, package_ignores(p->clean_src));
+  }
+  forget_recorded_areas();
+  return failed ? 1 : 0;
+}
+/*}}}*/
+void spill_free_plan(struct spill_plan *p)/*{{{*/
+{
+  int i;
+  for (i=0; i<p->n_conflicts; i++) {
+    struct spill_conflict *x = p->conflicts + i;
+    free((char *) x->path);
+    if (x->other_pkg) free((char *) x->other_pkg);
+    if (x->other_version) free((char *) x->other_version);
+    if (x->message) free((char *) x->message);
+  }
+  if (p->conflicts) free(p->conflicts);
+  for (i=0; i<p->n_expansions; i++) free(p->expansions[i]);
+  if (p->expansions) free(p->expansions);
+  free(p->clean_src);
+  if (p->relative_path) free(p->relative_path);
+  free(p->pkg);
+  free(p->version);
+  free(p);
+  release_locks();
+}
+/*}}}*/
+/*}}}*/
+int spill_command(int argc, char **argv)/*{{{*/
+{
+  int i;
+
+  /* With --client, hand the rest of the command line to a running daemon. */
+  for (i=1; i<argc; i++) {
+    if (!strncmp(argv[i], "--client=", 9)) {
+      char *socket_path = argv[i] + 9;
+      for (; i<argc-1; i++) argv[i] = argv[i+1];
+      return run_client(socket_path, argc - 1, argv);
+    }
+  }
+
+  return spill_main(argc, argv);
+}
+/*}}}*/
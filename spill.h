@@ -0,0 +1,112 @@
+/*
+  spill - segregated package install logical linker
+
+ **********************************************************************
+ * Copyright (C) Richard P. Curnow  2003, 2004, 2005, 2006, 2009
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of version 2 of the GNU General Public License as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ *
+ **********************************************************************
+ */
+
+/* libspill : the engine behind spill, for programs that want to install and
+ * remove packages in a link area without running spill for each one.
+ *
+ *   area = spill_open("/usr/local", 0);
+ *   plan = spill_plan_install(area, "/apps/foo/1.2", SPILL_EXPAND);
+ *   n = spill_plan_conflicts(plan, &conflicts);
+ *   if (n == 0) spill_apply(plan);
+ *   spill_free_plan(plan);
+ *   ...
+ *   spill_close(area);
+ *
+ * A plan holds the locks on the link area that it needs from when it's made
+ * until it's freed, so nothing changes between checking and applying it;
+ * freeing a plan drops all the locks, so have one plan at a time.
+ * What's been learnt about the package trees (their listings, and which
+ * install each link points into) is kept while the library is in use, so
+ * the trees are expected not to change underneath it.  Problems that would
+ * make spill itself give up, like a record that can't be written, are
+ * printed to stderr and returned as failures rather than ending the
+ * process.  The library isn't thread-safe : use it from one thread. */
+
+#ifndef SPILL_H
+#define SPILL_H
+
+/* Flags for planning, as the command line options of the same names */
+#define SPILL_FORCE     0x01  /* don't insist on bin, sbin or lib */
+#define SPILL_EXPAND    0x02  /* expand other packages' directory links */
+#define SPILL_OVERRIDE  0x04  /* replace other packages' links */
+#define SPILL_RETAIN    0x08  /* leave the links to other versions */
+#define SPILL_QUIET     0x10  /* only print errors while applying */
+
+struct spill_area;  /* an open link area */
+struct spill_plan;  /* what installing or removing a package would do */
+
+enum spill_conflict_kind {
+  SPILL_CONFLICT,     /* something else is already there */
+  SPILL_NEEDS_EXPAND, /* another package's directory link is in the way */
+  SPILL_ERROR         /* the path couldn't be examined */
+};
+
+struct spill_conflict {
+  enum spill_conflict_kind kind;
+  const char *path;           /* in the link area */
+  const char *other_pkg;      /* the package already there, or NULL */
+  const char *other_version;
+  const char *message;        /* what spill itself would print */
+};
+
+/* Open the link area at 'link_area' (which, unless SPILL_FORCE is given,
+ * must look like one).  NULL if it can't be used; areas managed in
+ * generations aren't supported. */
+extern struct spill_area *spill_open(const char *link_area, int flags);
+extern void spill_close(struct spill_area *area);
+
+/* Check what installing the package at 'tool_install_path' would do.
+ * Relative links are planned if the path is relative.  NULL if the package
+ * can't be read.  Nothing is written while planning : with SPILL_EXPAND,
+ * directory links in the way aren't reported, but what's under them is
+ * checked as though they had been expanded, which is only done once the
+ * plan is applied. */
+extern struct spill_plan *spill_plan_install(struct spill_area *area,
+                                             const char *tool_install_path,
+                                             int flags);
+
+/* Plan the removal of the links to the package at 'tool_install_path' */
+extern struct spill_plan *spill_plan_delete(struct spill_area *area,
+                                            const char *tool_install_path,
+                                            int flags);
+
+/* The package and version that the plan is for */
+extern const char *spill_plan_package(const struct spill_plan *plan);
+extern const char *spill_plan_version(const struct spill_plan *plan);
+
+/* Point '*conflicts' at the plan's conflicts and return how many there
+ * are.  They belong to the plan. */
+extern int spill_plan_conflicts(const struct spill_plan *plan,
+                                const struct spill_conflict **conflicts);
+
+/* Carry out the plan, if it has no conflicts.  Return 0 if it all worked.
+ * The link area's compiled ignore rules are kept here, not while planning. */
+extern int spill_apply(struct spill_plan *plan);
+
+/* Drop the plan and the locks it held */
+extern void spill_free_plan(struct spill_plan *plan);
+
+/* Run a spill command line, as the spill program does; returns the exit
+ * status. */
+extern int spill_command(int argc, char **argv);
+
+#endif /* SPILL_H */